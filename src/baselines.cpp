@@ -0,0 +1,853 @@
+#include "baselines.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <set>
+
+/******************
+ * baselines for the benchmark driver
+ ******************/
+
+const char *BENCH_SET_NAMES[] = {"lockfree", "mutex", "rwlock", "btree", "skiplist", "sharded",
+                                 NULL};
+
+/**
+ * bytes the node allocator has handed out and not got back, with their
+ * share of the slab headers
+ * retired nodes that are not freed yet are still allocated, so they are
+ * counted, like everything the locked baselines allocate
+ */
+static long node_bytes_in_use(void)
+{
+    node_alloc_stats stats;
+    node_alloc_get_stats(&stats);
+    return stats.bytes_in_use;
+}
+
+/**
+ * this tree, with the thread index set up the way test_parallel always did
+ */
+class LockFreeSet : public BenchSet
+{
+public:
+    LockFreeSet() : base_bytes(node_bytes_in_use()), root(rb_init()) {}
+    ~LockFreeSet() { rb_destroy(root); }
+
+    const char *name(void) { return "lockfree"; }
+    void thread_init(long index) { thread_index_init(index); }
+    void build(const tree_key *keys, long n)
+    {
+        rb_build(root, keys, n, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    bool insert(tree_key key) { return rb_insert(root, key); }
+    void remove(tree_key key) { rb_remove(root, key); }
+    bool find(tree_key key) { return rb_lookup(root, key); }
+    bool search(tree_key key)
+    {
+        tree_node *node = tree_search(root, key);
+        if (node == NULL)
+            return false;
+        release_flag(node); // tree_search() hands the node over flagged
+        return true;
+    }
+    long size(void) { return count_nodes(root); }
+    long memory(void) { return node_bytes_in_use() - base_bytes; }
+    bool check(void) { return check_tree_dfs(root->left_child); }
+
+private:
+    long base_bytes; // taken before the dummies are allocated
+    tree_node *root;
+};
+
+/**
+ * this tree split by range into shards with moving boundaries, "sharded"
+ * has SHARDED_DEFAULT shards, "sharded:N" N of them
+ */
+#define SHARDED_DEFAULT 16
+
+class ShardedSet : public BenchSet
+{
+public:
+    ShardedSet(const char *label, int shards) : base_bytes(node_bytes_in_use()), tree(shards)
+    {
+        snprintf(label_buf, sizeof(label_buf), "%s", label);
+    }
+
+    const char *name(void) { return label_buf; }
+    void build(const tree_key *keys, long n)
+    {
+        tree.build(keys, n, (int)sysconf(_SC_NPROCESSORS_ONLN));
+    }
+    bool insert(tree_key key) { return tree.insert(key); }
+    void remove(tree_key key) { tree.remove(key); }
+    bool find(tree_key key) { return tree.find(key); }
+    long size(void) { return tree.size(); }
+    long memory(void) { return node_bytes_in_use() - base_bytes; }
+    bool check(void) { return tree.check(); }
+    void print_stats(void)
+    {
+        printf("    %d shards, %ld boundary moves\n", tree.shards(), tree.boundary_moves());
+    }
+
+private:
+    long base_bytes;
+    ShardedRBTree tree;
+    char label_buf[32];
+};
+
+/**
+ * allocator that adds up the bytes a std::set holds, the set's lock
+ * guards the counter
+ */
+template <class T>
+struct counting_allocator
+{
+    typedef T value_type;
+    long *bytes;
+
+    counting_allocator(long *bytes) : bytes(bytes) {}
+    template <class U>
+    counting_allocator(const counting_allocator<U> &other) : bytes(other.bytes) {}
+
+    T *allocate(size_t n)
+    {
+        *bytes += n * sizeof(T);
+        return (T *)malloc(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        *bytes -= n * sizeof(T);
+        free(p);
+    }
+};
+
+template <class T, class U>
+bool operator==(const counting_allocator<T> &a, const counting_allocator<U> &b)
+{
+    return a.bytes == b.bytes;
+}
+
+template <class T, class U>
+bool operator!=(const counting_allocator<T> &a, const counting_allocator<U> &b)
+{
+    return a.bytes != b.bytes;
+}
+
+typedef set<tree_key, tree_key_compare, counting_allocator<tree_key>> counted_set;
+
+/**
+ * std::set behind one mutex
+ */
+class MutexSet : public BenchSet
+{
+public:
+    MutexSet() : bytes(0), keys(tree_key_compare(), counting_allocator<tree_key>(&bytes))
+    {
+        pthread_mutex_init(&lock, NULL);
+    }
+    ~MutexSet() { pthread_mutex_destroy(&lock); }
+
+    const char *name(void) { return "mutex"; }
+    void build(const tree_key *sorted, long n)
+    {
+        for (long i = 0; i < n; i++)
+            keys.insert(keys.end(), sorted[i]);
+    }
+    bool insert(tree_key key)
+    {
+        pthread_mutex_lock(&lock);
+        bool inserted = keys.insert(key).second;
+        pthread_mutex_unlock(&lock);
+        return inserted;
+    }
+    void remove(tree_key key)
+    {
+        pthread_mutex_lock(&lock);
+        keys.erase(key);
+        pthread_mutex_unlock(&lock);
+    }
+    bool find(tree_key key)
+    {
+        pthread_mutex_lock(&lock);
+        bool found = keys.count(key) != 0;
+        pthread_mutex_unlock(&lock);
+        return found;
+    }
+    long size(void) { return keys.size(); }
+    long memory(void) { return bytes; }
+    bool check(void) { return true; }
+
+private:
+    pthread_mutex_t lock;
+    long bytes;
+    counted_set keys;
+};
+
+/**
+ * std::set behind one reader-writer lock, lookups run in parallel
+ */
+class RwLockSet : public BenchSet
+{
+public:
+    RwLockSet() : bytes(0), keys(tree_key_compare(), counting_allocator<tree_key>(&bytes))
+    {
+        pthread_rwlock_init(&lock, NULL);
+    }
+    ~RwLockSet() { pthread_rwlock_destroy(&lock); }
+
+    const char *name(void) { return "rwlock"; }
+    void build(const tree_key *sorted, long n)
+    {
+        for (long i = 0; i < n; i++)
+            keys.insert(keys.end(), sorted[i]);
+    }
+    bool insert(tree_key key)
+    {
+        pthread_rwlock_wrlock(&lock);
+        bool inserted = keys.insert(key).second;
+        pthread_rwlock_unlock(&lock);
+        return inserted;
+    }
+    void remove(tree_key key)
+    {
+        pthread_rwlock_wrlock(&lock);
+        keys.erase(key);
+        pthread_rwlock_unlock(&lock);
+    }
+    bool find(tree_key key)
+    {
+        pthread_rwlock_rdlock(&lock);
+        bool found = keys.count(key) != 0;
+        pthread_rwlock_unlock(&lock);
+        return found;
+    }
+    long size(void) { return keys.size(); }
+    long memory(void) { return bytes; }
+    bool check(void) { return true; }
+
+private:
+    pthread_rwlock_t lock;
+    long bytes;
+    counted_set keys;
+};
+
+/******************
+ * B+ tree with lock coupling
+ ******************/
+
+/**
+ * Keys are in the leaves; an inner node with count keys has count + 1
+ * children, child i holds the keys below keys[i] and at or above
+ * keys[i - 1]. Every node has a reader-writer lock and a thread always
+ * takes the child's lock before it lets go of the parent's (Bayer and
+ * Schkolnick). Updates first descend with read locks and write-lock only
+ * the leaf; an insert into a full leaf starts again from the root with
+ * write locks and splits every full node on the way down, so a split
+ * never has to go back up. Removes never merge, a leaf may become empty
+ * and the tree never gets lower; that keeps them on the read-locked
+ * path. A leaf is allocated without the children array.
+ */
+
+#define BTREE_KEYS 32 // keys per node
+
+typedef struct btree_node_t
+{
+    pthread_rwlock_t lock;
+    bool leaf;
+    int count;
+    tree_key keys[BTREE_KEYS];
+    struct btree_node_t *children[BTREE_KEYS + 1]; // inner nodes only
+} btree_node;
+
+static size_t btree_bytes(bool leaf)
+{
+    return leaf ? offsetof(btree_node, children) : sizeof(btree_node);
+}
+
+static btree_node *btree_new(bool leaf)
+{
+    btree_node *node = (btree_node *)malloc(btree_bytes(leaf));
+    pthread_rwlock_init(&node->lock, NULL);
+    node->leaf = leaf;
+    node->count = 0;
+    return node;
+}
+
+/**
+ * the child of an inner node whose range holds key
+ */
+static int btree_child(btree_node *node, tree_key key)
+{
+    int i = 0;
+    while (i < node->count && !TREE_KEY_LESS(key, node->keys[i]))
+        i++;
+    return i;
+}
+
+/**
+ * the first key of a leaf that is not below key
+ */
+static int btree_position(btree_node *leaf, tree_key key)
+{
+    int i = 0;
+    while (i < leaf->count && TREE_KEY_LESS(leaf->keys[i], key))
+        i++;
+    return i;
+}
+
+static bool btree_leaf_has(btree_node *leaf, tree_key key)
+{
+    int i = btree_position(leaf, key);
+    return i < leaf->count && TREE_KEY_EQUAL(leaf->keys[i], key);
+}
+
+/**
+ * add key to a leaf that is not full, false if it is there
+ */
+static bool btree_leaf_insert(btree_node *leaf, tree_key key)
+{
+    int i = btree_position(leaf, key);
+    if (i < leaf->count && TREE_KEY_EQUAL(leaf->keys[i], key))
+        return false;
+    memmove(leaf->keys + i + 1, leaf->keys + i, (leaf->count - i) * sizeof(tree_key));
+    leaf->keys[i] = key;
+    leaf->count++;
+    return true;
+}
+
+/**
+ * split the full child at index of parent, which is not full; both are
+ * write-locked, the new right half is only reachable through parent
+ */
+static void btree_split(btree_node *parent, int index, btree_node *child)
+{
+    btree_node *right = btree_new(child->leaf);
+    int half = BTREE_KEYS / 2;
+    tree_key separator;
+    if (child->leaf)
+    {
+        right->count = child->count - half;
+        memcpy(right->keys, child->keys + half, right->count * sizeof(tree_key));
+        separator = right->keys[0];
+    }
+    else
+    {
+        separator = child->keys[half];
+        right->count = child->count - half - 1;
+        memcpy(right->keys, child->keys + half + 1, right->count * sizeof(tree_key));
+        memcpy(right->children, child->children + half + 1,
+               (right->count + 1) * sizeof(btree_node *));
+    }
+    child->count = half;
+
+    memmove(parent->keys + index + 1, parent->keys + index,
+            (parent->count - index) * sizeof(tree_key));
+    memmove(parent->children + index + 2, parent->children + index + 1,
+            (parent->count - index) * sizeof(btree_node *));
+    parent->keys[index] = separator;
+    parent->children[index + 1] = right;
+    parent->count++;
+}
+
+static void btree_free(btree_node *node)
+{
+    if (!node->leaf)
+    {
+        for (int i = 0; i <= node->count; i++)
+            btree_free(node->children[i]);
+    }
+    pthread_rwlock_destroy(&node->lock);
+    free(node);
+}
+
+/**
+ * keys in [lo, hi) in order, where the bounds are given, and all leaves
+ * at the same depth
+ */
+static bool btree_check(btree_node *node, const tree_key *lo, const tree_key *hi,
+                        int depth, int *leaf_depth)
+{
+    for (int i = 0; i < node->count; i++)
+    {
+        if ((i > 0 && !TREE_KEY_LESS(node->keys[i - 1], node->keys[i])) ||
+            (lo != NULL && TREE_KEY_LESS(node->keys[i], *lo)) ||
+            (hi != NULL && !TREE_KEY_LESS(node->keys[i], *hi)))
+            return false;
+    }
+    if (node->leaf)
+    {
+        if (*leaf_depth < 0)
+            *leaf_depth = depth;
+        return *leaf_depth == depth;
+    }
+    for (int i = 0; i <= node->count; i++)
+    {
+        if (!btree_check(node->children[i], i > 0 ? &node->keys[i - 1] : lo,
+                         i < node->count ? &node->keys[i] : hi, depth + 1, leaf_depth))
+            return false;
+    }
+    return true;
+}
+
+class BTreeSet : public BenchSet
+{
+public:
+    BTreeSet() : root(btree_new(true))
+    {
+        pthread_rwlock_init(&root_lock, NULL);
+    }
+    ~BTreeSet()
+    {
+        btree_free(root);
+        pthread_rwlock_destroy(&root_lock);
+    }
+
+    const char *name(void) { return "btree"; }
+
+    void build(const tree_key *keys, long n)
+    {
+        for (long i = 0; i < n; i++)
+            insert(keys[i]);
+    }
+
+    bool insert(tree_key key)
+    {
+        btree_node *leaf = find_leaf(key, true);
+        if (leaf->count < BTREE_KEYS || btree_leaf_has(leaf, key))
+        {
+            bool inserted = btree_leaf_insert(leaf, key);
+            pthread_rwlock_unlock(&leaf->lock);
+            return inserted;
+        }
+        pthread_rwlock_unlock(&leaf->lock);
+        return insert_split(key);
+    }
+
+    void remove(tree_key key)
+    {
+        btree_node *leaf = find_leaf(key, true);
+        int i = btree_position(leaf, key);
+        if (i < leaf->count && TREE_KEY_EQUAL(leaf->keys[i], key))
+        {
+            memmove(leaf->keys + i, leaf->keys + i + 1, (leaf->count - i - 1) * sizeof(tree_key));
+            leaf->count--;
+        }
+        pthread_rwlock_unlock(&leaf->lock);
+    }
+
+    bool find(tree_key key)
+    {
+        btree_node *leaf = find_leaf(key, false);
+        bool found = btree_leaf_has(leaf, key);
+        pthread_rwlock_unlock(&leaf->lock);
+        return found;
+    }
+
+    long size(void) { return count(root, false); }
+    long memory(void) { return count(root, true); }
+    bool check(void)
+    {
+        int leaf_depth = -1;
+        return btree_check(root, NULL, NULL, 0, &leaf_depth);
+    }
+
+private:
+    pthread_rwlock_t root_lock; // guards the root pointer
+    btree_node *root;
+
+    static void lock(btree_node *node, bool write)
+    {
+        if (write)
+            pthread_rwlock_wrlock(&node->lock);
+        else
+            pthread_rwlock_rdlock(&node->lock);
+    }
+
+    /**
+     * descend to the leaf of key with read locks, the leaf is locked for
+     * writing if write is set; leaf never changes once a node exists
+     */
+    btree_node *find_leaf(tree_key key, bool write)
+    {
+        pthread_rwlock_rdlock(&root_lock);
+        btree_node *node = root;
+        lock(node, write && node->leaf);
+        pthread_rwlock_unlock(&root_lock);
+        while (!node->leaf)
+        {
+            btree_node *child = node->children[btree_child(node, key)];
+            lock(child, write && child->leaf);
+            pthread_rwlock_unlock(&node->lock);
+            node = child;
+        }
+        return node;
+    }
+
+    /**
+     * insert with write locks all the way, splitting full nodes on the way
+     */
+    bool insert_split(tree_key key)
+    {
+        pthread_rwlock_wrlock(&root_lock);
+        btree_node *node = root;
+        pthread_rwlock_wrlock(&node->lock);
+        if (node->count == BTREE_KEYS)
+        {
+            btree_node *top = btree_new(false);
+            top->children[0] = node;
+            btree_split(top, 0, node);
+            pthread_rwlock_wrlock(&top->lock);
+            pthread_rwlock_unlock(&node->lock);
+            root = node = top;
+        }
+        pthread_rwlock_unlock(&root_lock);
+
+        while (!node->leaf)
+        {
+            int i = btree_child(node, key);
+            btree_node *child = node->children[i];
+            pthread_rwlock_wrlock(&child->lock);
+            if (child->count == BTREE_KEYS)
+            {
+                btree_split(node, i, child);
+                if (!TREE_KEY_LESS(key, node->keys[i]))
+                {
+                    pthread_rwlock_unlock(&child->lock);
+                    child = node->children[i + 1];
+                    pthread_rwlock_wrlock(&child->lock);
+                }
+            }
+            pthread_rwlock_unlock(&node->lock);
+            node = child;
+        }
+        bool inserted = btree_leaf_insert(node, key);
+        pthread_rwlock_unlock(&node->lock);
+        return inserted;
+    }
+
+    static long count(btree_node *node, bool bytes)
+    {
+        long total = bytes ? (long)btree_bytes(node->leaf) : (node->leaf ? node->count : 0);
+        if (!node->leaf)
+        {
+            for (int i = 0; i <= node->count; i++)
+                total += count(node->children[i], bytes);
+        }
+        return total;
+    }
+};
+
+/******************
+ * lock-free skiplist
+ ******************/
+
+/**
+ * The skiplist of Fraser, as in Herlihy and Shavit: a node is in the set
+ * while its level 0 link is unmarked. remove() marks the links of a node
+ * from the top down, the one that marks level 0 has removed the key, and
+ * every search unlinks the marked nodes it passes. An insert links level
+ * 0 first and then the levels above, and gives up on them when the node
+ * is removed meanwhile. The low bit of a link is the mark.
+ *
+ * Nothing is reclaimed while the list is in use: removed nodes go to a
+ * retired list and are freed with the list, so readers need no epochs.
+ * That leaves the skiplist without the cost the tree pays for
+ * reclamation, but memory() only counts the nodes still in the list.
+ * print_stats() says so in the output, with what the retired list holds.
+ */
+
+#define SKIP_LEVELS 24 // a node gets one more level with probability 1/4
+
+typedef struct skip_node_t
+{
+    tree_key key;
+    int height;
+    struct skip_node_t *retired_next;
+    atomic<uintptr_t> next[1]; // height links
+} skip_node;
+
+static thread_local unsigned int skip_seed = 0;
+
+static size_t skip_bytes(int height)
+{
+    return offsetof(skip_node, next) + height * sizeof(atomic<uintptr_t>);
+}
+
+static skip_node *skip_new(tree_key key, int height)
+{
+    skip_node *node = (skip_node *)malloc(skip_bytes(height));
+    node->key = key;
+    node->height = height;
+    node->retired_next = NULL;
+    for (int level = 0; level < height; level++)
+        node->next[level].store(0, memory_order_relaxed);
+    return node;
+}
+
+static inline skip_node *skip_ptr(uintptr_t link)
+{
+    return (skip_node *)(link & ~(uintptr_t)1);
+}
+
+static inline bool skip_marked(uintptr_t link)
+{
+    return link & 1;
+}
+
+static int skip_height(void)
+{
+    if (skip_seed == 0)
+        skip_seed = (unsigned int)(uintptr_t)&skip_seed | 1;
+    int height = 1;
+    while (height < SKIP_LEVELS)
+    {
+        skip_seed ^= skip_seed << 13;
+        skip_seed ^= skip_seed >> 17;
+        skip_seed ^= skip_seed << 5;
+        if ((skip_seed & 3) != 0)
+            break;
+        height++;
+    }
+    return height;
+}
+
+class SkipListSet : public BenchSet
+{
+public:
+    SkipListSet() : head(skip_new(tree_key(), SKIP_LEVELS)), retired(NULL) {}
+    ~SkipListSet()
+    {
+        skip_node *node = skip_ptr(head->next[0].load());
+        while (node != NULL)
+        {
+            skip_node *next = skip_ptr(node->next[0].load());
+            free(node);
+            node = next;
+        }
+        node = retired.load();
+        while (node != NULL)
+        {
+            skip_node *next = node->retired_next;
+            free(node);
+            node = next;
+        }
+        free(head);
+    }
+
+    const char *name(void) { return "skiplist"; }
+
+    void build(const tree_key *keys, long n)
+    {
+        for (long i = 0; i < n; i++)
+            insert(keys[i]);
+    }
+
+    bool insert(tree_key key)
+    {
+        skip_node *preds[SKIP_LEVELS], *succs[SKIP_LEVELS];
+        skip_node *node = NULL;
+        int height = skip_height();
+        while (true)
+        {
+            if (search(key, preds, succs))
+            {
+                free(node);
+                return false;
+            }
+            if (node == NULL)
+                node = skip_new(key, height);
+            for (int level = 0; level < height; level++)
+                node->next[level].store((uintptr_t)succs[level], memory_order_relaxed);
+            uintptr_t expect = (uintptr_t)succs[0];
+            if (preds[0]->next[0].compare_exchange_strong(expect, (uintptr_t)node))
+                break;
+        }
+
+        for (int level = 1; level < height; level++)
+        {
+            while (true)
+            {
+                uintptr_t link = node->next[level].load();
+                if (skip_marked(link))
+                    return true; // being removed
+                // only a remover changes the link besides us, and it marks it
+                if (skip_ptr(link) != succs[level] &&
+                    !node->next[level].compare_exchange_strong(link, (uintptr_t)succs[level]))
+                    return true;
+                uintptr_t expect = (uintptr_t)succs[level];
+                if (preds[level]->next[level].compare_exchange_strong(expect, (uintptr_t)node))
+                    break;
+                search(key, preds, succs);
+                if (succs[0] != node)
+                    return true; // removed already
+            }
+        }
+        return true;
+    }
+
+    void remove(tree_key key)
+    {
+        skip_node *preds[SKIP_LEVELS], *succs[SKIP_LEVELS];
+        if (!search(key, preds, succs))
+            return;
+        skip_node *node = succs[0];
+        for (int level = node->height - 1; level >= 1; level--)
+        {
+            uintptr_t link = node->next[level].load();
+            while (!skip_marked(link))
+                node->next[level].compare_exchange_weak(link, link | 1);
+        }
+
+        uintptr_t link = node->next[0].load();
+        while (!skip_marked(link))
+        {
+            if (node->next[0].compare_exchange_weak(link, link | 1))
+            {
+                search(key, preds, succs); // unlinks it
+                retire(node);
+                return;
+            }
+        }
+    }
+
+    /**
+     * no unlinking and no retries, a marked node is skipped at level 0
+     */
+    bool find(tree_key key)
+    {
+        skip_node *pred = head, *curr = NULL;
+        for (int level = SKIP_LEVELS - 1; level >= 0; level--)
+        {
+            curr = skip_ptr(pred->next[level].load(memory_order_acquire));
+            while (curr != NULL && TREE_KEY_LESS(curr->key, key))
+            {
+                pred = curr;
+                curr = skip_ptr(curr->next[level].load(memory_order_acquire));
+            }
+        }
+        return curr != NULL && TREE_KEY_EQUAL(curr->key, key) &&
+               !skip_marked(curr->next[0].load(memory_order_acquire));
+    }
+
+    long size(void)
+    {
+        long n = 0;
+        for (skip_node *node = skip_ptr(head->next[0].load()); node != NULL;
+             node = skip_ptr(node->next[0].load()))
+            n++;
+        return n;
+    }
+
+    long memory(void)
+    {
+        long bytes = 0;
+        for (skip_node *node = skip_ptr(head->next[0].load()); node != NULL;
+             node = skip_ptr(node->next[0].load()))
+            bytes += skip_bytes(node->height);
+        return bytes;
+    }
+
+    void print_stats(void)
+    {
+        long nodes = 0, bytes = 0;
+        for (skip_node *node = retired.load(); node != NULL; node = node->retired_next)
+        {
+            nodes++;
+            bytes += skip_bytes(node->height);
+        }
+        printf("    removed nodes are never reclaimed: %ld held, %.1fMB, not counted in memory\n",
+               nodes, bytes / 1048576.0);
+    }
+
+    /**
+     * every level in order and nothing marked left at level 0
+     */
+    bool check(void)
+    {
+        for (int level = 0; level < SKIP_LEVELS; level++)
+        {
+            skip_node *prev = NULL;
+            for (skip_node *node = skip_ptr(head->next[level].load()); node != NULL;
+                 node = skip_ptr(node->next[level].load()))
+            {
+                if (level == 0 && skip_marked(node->next[0].load()))
+                    return false;
+                if (prev != NULL && !TREE_KEY_LESS(prev->key, node->key))
+                    return false;
+                prev = node;
+            }
+        }
+        return true;
+    }
+
+private:
+    skip_node *head;
+    atomic<skip_node *> retired;
+
+    /**
+     * the nodes around key at every level, unlinking marked nodes on the
+     * way; true if key is in the list, then it is succs[0]
+     */
+    bool search(tree_key key, skip_node **preds, skip_node **succs)
+    {
+    retry:
+        skip_node *pred = head, *curr = NULL;
+        for (int level = SKIP_LEVELS - 1; level >= 0; level--)
+        {
+            curr = skip_ptr(pred->next[level].load(memory_order_acquire));
+            while (curr != NULL)
+            {
+                uintptr_t succ = curr->next[level].load(memory_order_acquire);
+                if (skip_marked(succ))
+                {
+                    uintptr_t expect = (uintptr_t)curr;
+                    if (!pred->next[level].compare_exchange_strong(expect, (uintptr_t)skip_ptr(succ)))
+                        goto retry;
+                    curr = skip_ptr(succ);
+                    continue;
+                }
+                if (!TREE_KEY_LESS(curr->key, key))
+                    break;
+                pred = curr;
+                curr = skip_ptr(succ);
+            }
+            preds[level] = pred;
+            succs[level] = curr;
+        }
+        return curr != NULL && TREE_KEY_EQUAL(curr->key, key);
+    }
+
+    void retire(skip_node *node)
+    {
+        skip_node *top = retired.load();
+        do {
+            node->retired_next = top;
+        } while (!retired.compare_exchange_weak(top, node));
+    }
+};
+
+BenchSet *bench_set_create(const char *name)
+{
+    if (strcmp(name, "lockfree") == 0)
+        return new LockFreeSet();
+    if (strcmp(name, "mutex") == 0)
+        return new MutexSet();
+    if (strcmp(name, "rwlock") == 0)
+        return new RwLockSet();
+    if (strcmp(name, "btree") == 0)
+        return new BTreeSet();
+    if (strcmp(name, "skiplist") == 0)
+        return new SkipListSet();
+    if (strcmp(name, "sharded") == 0)
+        return new ShardedSet(name, SHARDED_DEFAULT);
+    if (strncmp(name, "sharded:", 8) == 0 && strlen(name) < 32)
+    {
+        char *end;
+        long shards = strtol(name + 8, &end, 10);
+        if (end != name + 8 && *end == '\0' && shards >= 1 && shards <= 1024)
+            return new ShardedSet(name, (int)shards);
+    }
+    return NULL;
+}
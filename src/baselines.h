@@ -0,0 +1,50 @@
+#ifndef BASELINES_H
+#define BASELINES_H
+
+#include "tree.h"
+
+/**
+ * set interface for the benchmark driver
+ *
+ * test_parallel runs the lock-free tree and the baselines it is compared
+ * with through this interface, so all of them see the same workload and
+ * pay the same virtual call per operation. Keys only, inserting a key
+ * that is there already changes nothing. Structures, by name:
+ *
+ *   lockfree  this tree, through rb_insert()/rb_remove()/rb_lookup()
+ *   mutex     std::set behind one pthread mutex
+ *   rwlock    std::set behind one pthread reader-writer lock
+ *   btree     B+ tree with a reader-writer lock per node and lock coupling
+ *   skiplist  lock-free skiplist (Fraser, Herlihy and Shavit)
+ *   sharded   this tree split by range into 16 shards, see ShardedRBTree,
+ *             sharded:N for N shards
+ */
+class BenchSet
+{
+public:
+    virtual ~BenchSet() {}
+
+    virtual const char *name(void) = 0;
+    /* once in every thread before its first operation */
+    virtual void thread_init(long index) {}
+    /* fill an empty set with n sorted keys, no other thread may run */
+    virtual void build(const tree_key *keys, long n) = 0;
+    virtual bool insert(tree_key key) = 0; // false if key was there
+    virtual void remove(tree_key key) = 0;
+    virtual bool find(tree_key key) = 0;
+    /* a lookup that takes flags like an update, tree_search() for the
+       tree; find() for the structures that have none */
+    virtual bool search(tree_key key) { return find(key); }
+    /* the following only while no update runs */
+    virtual long size(void) = 0;
+    virtual long memory(void) = 0; // bytes allocated for nodes, see each structure
+    virtual bool check(void) = 0;
+    /* counters of its own after a run, if any */
+    virtual void print_stats(void) {}
+};
+
+extern const char *BENCH_SET_NAMES[]; // NULL terminated
+
+BenchSet *bench_set_create(const char *name); // NULL for an unknown name
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/resource.h>
+
+/* helpers shared by the benchmark programs */
+
+/**
+ * monotonic time in seconds
+ */
+inline double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * monotonic time in nanoseconds, for timing single operations
+ */
+inline unsigned long bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * peak resident set size of the process in KB
+ */
+inline long bench_peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/**
+ * current resident set size of the process in KB
+ */
+inline long bench_rss_kb(void)
+{
+    long pages = 0, resident = 0;
+    FILE *fd = fopen("/proc/self/statm", "r");
+    if (fd == NULL)
+        return 0;
+    if (fscanf(fd, "%ld %ld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(fd);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+/**
+ * latency histogram
+ *
+ * Log-bucketed like HdrHistogram: values below 2^HIST_SUB_BITS have a
+ * bucket each, above that every power of two is split into
+ * 2^HIST_SUB_BITS buckets, so a bucket is at most 12.5% wide. Recording
+ * is an index computation and an increment. Every thread fills its own
+ * histogram and they are merged after the run.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+typedef struct latency_histogram_t
+{
+    unsigned long count[HIST_BUCKETS];
+    unsigned long total; // values recorded
+    unsigned long max;
+} latency_histogram;
+
+inline void hist_clear(latency_histogram *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+inline int hist_bucket(unsigned long value)
+{
+    if (value < HIST_SUB_COUNT)
+        return (int)value;
+    int shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (int)((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+/**
+ * largest value that falls into a bucket
+ */
+inline unsigned long hist_bucket_high(int bucket)
+{
+    if (bucket < HIST_SUB_COUNT)
+        return bucket;
+    int shift = (bucket >> HIST_SUB_BITS) - 1;
+    unsigned long low = (unsigned long)(HIST_SUB_COUNT + (bucket & (HIST_SUB_COUNT - 1))) << shift;
+    return low + (1UL << shift) - 1;
+}
+
+inline void hist_record(latency_histogram *h, unsigned long value)
+{
+    h->count[hist_bucket(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+inline void hist_merge(latency_histogram *into, const latency_histogram *from)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        into->count[i] += from->count[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+/**
+ * the value below which percent of the recorded values are, rounded up
+ * to the end of its bucket but never above the maximum
+ */
+inline unsigned long hist_percentile(const latency_histogram *h, double percent)
+{
+    if (h->total == 0)
+        return 0;
+    unsigned long rank = (unsigned long)(h->total * percent / 100);
+    if (rank >= h->total)
+        rank = h->total - 1;
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->count[i];
+        if (seen > rank)
+            return hist_bucket_high(i) < h->max ? hist_bucket_high(i) : h->max;
+    }
+    return h->max;
+}
+
+/**
+ * one line of tail percentiles in microseconds for nanosecond values,
+ * nothing if nothing was recorded
+ */
+inline void hist_print(const char *name, const latency_histogram *h)
+{
+    if (h->total == 0)
+        return;
+    printf("    %s latency p50 %.2fus p90 %.2fus p99 %.2fus p99.9 %.2fus max %.2fus\n", name,
+           hist_percentile(h, 50) * 1e-3, hist_percentile(h, 90) * 1e-3,
+           hist_percentile(h, 99) * 1e-3, hist_percentile(h, 99.9) * 1e-3, h->max * 1e-3);
+}
+
+#endif
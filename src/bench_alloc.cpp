@@ -0,0 +1,102 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+/**
+ * allocator benchmark
+ *
+ * every thread inserts its share of a shuffled key set, then every thread
+ * removes the share of its neighbour, so most nodes are freed by a thread
+ * that did not allocate them. Insert and remove throughput are reported
+ * separately.
+ *
+ * usage: ./bench_alloc [slab|malloc] [threads] [keys per thread]
+ */
+
+using namespace std;
+
+tree_node *root;
+int thread_count = 4;
+long keys_per_thread = 100000;
+vector<int> keys;
+pthread_barrier_t phase_barrier;
+double phase_start, insert_end, remove_end;
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_phases(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index);
+    int *mine = keys.data() + index * keys_per_thread;
+    int *neighbour = keys.data() + ((index + 1) % thread_count) * keys_per_thread;
+
+    pthread_barrier_wait(&phase_barrier);
+    if (index == 0)
+        phase_start = bench_now();
+    for (long i = 0; i < keys_per_thread; i++)
+        rb_insert(root, mine[i]);
+
+    pthread_barrier_wait(&phase_barrier);
+    if (index == 0)
+        insert_end = bench_now();
+    for (long i = 0; i < keys_per_thread; i++)
+        rb_remove(root, neighbour[i]);
+
+    pthread_barrier_wait(&phase_barrier);
+    if (index == 0)
+        remove_end = bench_now();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int mode = NODE_ALLOC_SLAB;
+    if (argc > 1 && strcmp(argv[1], "malloc") == 0)
+        mode = NODE_ALLOC_MALLOC;
+    if (argc > 2)
+        thread_count = atoi(argv[2]);
+    if (argc > 3)
+        keys_per_thread = atol(argv[3]);
+
+    node_alloc_init(mode);
+    root = rb_init();
+
+    long total = keys_per_thread * thread_count;
+    keys.resize(total);
+    for (long i = 0; i < total; i++)
+        keys[i] = i + 1;
+    shuffle(keys.begin(), keys.end(), mt19937(1));
+
+    pthread_barrier_init(&phase_barrier, NULL, thread_count);
+    pthread_t tid[thread_count];
+    for (long i = 0; i < thread_count; i++)
+        pthread_create(&tid[i], NULL, run_phases, (void *)i);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(tid[i], NULL);
+
+    double insert_time = insert_end - phase_start;
+    double remove_time = remove_end - insert_end;
+    node_alloc_stats stats;
+    node_alloc_get_stats(&stats);
+    bool empty = count_nodes(root) == 0;
+
+    printf("alloc %s, %d threads, %ld keys\n",
+           mode == NODE_ALLOC_SLAB ? "slab" : "malloc", thread_count, total);
+    printf("insert: %.3fsec, %.0f ops/sec\n", insert_time, total / insert_time);
+    printf("remove: %.3fsec, %.0f ops/sec\n", remove_time, total / remove_time);
+    printf("peak rss: %ld KB\n", bench_peak_rss_kb());
+    if (mode == NODE_ALLOC_SLAB)
+        printf("heaps: %lu slabs: %lu remote frees: %lu slabs bound to their node: %lu\n",
+               stats.heaps, stats.slabs, stats.remote_frees, stats.bound_slabs);
+    printf("tree: %s\n", empty ? "empty" : "NOT EMPTY");
+
+    return empty ? 0 : 1;
+}
@@ -0,0 +1,95 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <vector>
+
+/**
+ * bulk build benchmark
+ *
+ * fills a tree with the sorted keys 1 .. keys once by rb_insert() in a
+ * loop and once by rb_build() with 1, 2, 4, ... threads up to the given
+ * maximum, and reports the time of each. Every tree is checked for the
+ * red-black properties, its size and its parent links before it is freed.
+ *
+ * usage: ./bench_build [keys] [max threads]
+ */
+
+using namespace std;
+
+bool remove_dbg = false; // dbg_printf
+
+/**
+ * true if every child below node points back to its parent
+ */
+bool check_parents(tree_node *node)
+{
+    vector<tree_node *> stack(1, node);
+    while (!stack.empty())
+    {
+        node = stack.back();
+        stack.pop_back();
+        tree_node *children[2] = {node->left_child, node->right_child};
+        for (auto child : children)
+        {
+            if (get_parent(child) != node)
+                return false;
+            if (!is_leaf(child))
+                stack.push_back(child);
+        }
+    }
+    return true;
+}
+
+bool check(tree_node *root, long keys)
+{
+    if (is_leaf(root->left_child))
+        return keys == 0;
+    return get_parent(root->left_child) == root && check_parents(root->left_child) &&
+           check_tree_dfs(root->left_child) && count_nodes(root) == keys;
+}
+
+int main(int argc, char **argv)
+{
+    long key_count = 1000000;
+    int max_threads = 8;
+    if (argc > 1)
+        key_count = atol(argv[1]);
+    if (argc > 2)
+        max_threads = atoi(argv[2]);
+
+    printf("%ld keys\n", key_count);
+
+    vector<int> keys(key_count);
+    for (long i = 0; i < key_count; i++)
+        keys[i] = i + 1;
+
+    thread_index_init(0);
+    bool valid = true;
+
+    tree_node *root = rb_init();
+    double start = bench_now();
+    for (long i = 0; i < key_count; i++)
+        rb_insert(root, keys[i]);
+    double insert_time = bench_now() - start;
+    bool ok = check(root, key_count);
+    valid = valid && ok;
+    rb_destroy(root);
+    printf("rb_insert loop:      %.3f sec %s\n", insert_time, ok ? "" : "INVALID TREE");
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        root = rb_init();
+        start = bench_now();
+        ok = rb_build(root, keys.data(), key_count, threads);
+        double build_time = bench_now() - start;
+        ok = ok && check(root, key_count);
+        valid = valid && ok;
+        rb_destroy(root);
+        printf("rb_build %2d threads: %.3f sec, %.1fx %s\n", threads, build_time,
+               insert_time / build_time, ok ? "" : "INVALID TREE");
+    }
+
+    return valid ? 0 : 1;
+}
@@ -0,0 +1,142 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+
+/**
+ * contention policy benchmark
+ *
+ * runs an update-heavy mix on a small tree with every contention policy,
+ * once for each computation time of test_parallel (the time a thread
+ * sleeps between two operations, from 0 to 1ms, so contention goes from
+ * high to low). Reports the throughput and the 99th percentile and
+ * maximum latency of a single operation. The keys congruent to the
+ * thread index belong to that thread, so the final size is checked.
+ *
+ * usage: ./bench_contention [threads] [keys] [ops per thread]
+ *                           [update percent]
+ */
+
+using namespace std;
+
+vector<float> COMPUTATION_TIME_LIST = {0, 0.000001, 0.00001, 0.0001, 0.001};
+int POLICIES[] = {CONTENTION_SPIN, CONTENTION_SLEEP, CONTENTION_BACKOFF,
+                  CONTENTION_YIELD, CONTENTION_ADAPTIVE};
+
+tree_node *root;
+int thread_count = 16;
+long key_range = 1000;
+long ops_per_thread = 2000;
+int update_percent = 50;
+int sleep_time;
+pthread_barrier_t start_barrier;
+double run_start;
+vector<double> latencies[1024];
+long own_keys[1024];
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_mixed(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index);
+
+    long keys_per_thread = key_range / thread_count;
+    vector<char> present(keys_per_thread);
+    for (long k = 0; k < keys_per_thread; k++)
+        present[k] = ((k * thread_count + index + 1) % 2) == 0;
+    unsigned int seed = index + 1;
+    latencies[index].clear();
+
+    pthread_barrier_wait(&start_barrier);
+    if (index == 0)
+        run_start = bench_now();
+
+    for (long i = 0; i < ops_per_thread; i++)
+    {
+        double start = bench_now();
+        if ((int)(rand_r(&seed) % 100) >= update_percent)
+            rb_lookup(root, rand_r(&seed) % key_range + 1);
+        else
+        {
+            long k = rand_r(&seed) % keys_per_thread;
+            int value = k * thread_count + index + 1;
+            if (present[k])
+                rb_remove(root, value);
+            else
+                rb_insert(root, value);
+            present[k] = !present[k];
+        }
+        latencies[index].push_back(bench_now() - start);
+        if (sleep_time > 0)
+            usleep(sleep_time);
+    }
+
+    own_keys[index] = 0;
+    for (auto key : present)
+        own_keys[index] += key;
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        thread_count = atoi(argv[1]);
+    if (argc > 2)
+        key_range = atol(argv[2]);
+    if (argc > 3)
+        ops_per_thread = atol(argv[3]);
+    if (argc > 4)
+        update_percent = atoi(argv[4]);
+
+    printf("%d threads, %ld keys, %ld ops per thread, %d%% updates\n",
+           thread_count, key_range, ops_per_thread, update_percent);
+
+    bool valid = true;
+    for (auto comp_time : COMPUTATION_TIME_LIST)
+    {
+        sleep_time = comp_time * 1000000;
+        printf("computation time %dus\n", sleep_time);
+        for (auto policy : POLICIES)
+        {
+            contention_init(policy);
+            thread_index_init(0);
+            root = rb_init();
+            long owned_range = key_range / thread_count * thread_count;
+            for (long value = 2; value <= owned_range; value += 2)
+                rb_insert(root, value);
+
+            pthread_barrier_init(&start_barrier, NULL, thread_count);
+            pthread_t tid[thread_count];
+            for (long i = 0; i < thread_count; i++)
+                pthread_create(&tid[i], NULL, run_mixed, (void *)i);
+            for (int i = 0; i < thread_count; i++)
+                pthread_join(tid[i], NULL);
+            double run_time = bench_now() - run_start;
+            pthread_barrier_destroy(&start_barrier);
+
+            vector<double> all;
+            long expected = 0;
+            for (int i = 0; i < thread_count; i++)
+            {
+                all.insert(all.end(), latencies[i].begin(), latencies[i].end());
+                expected += own_keys[i];
+            }
+            sort(all.begin(), all.end());
+            bool ok = check_tree_dfs(root->left_child) && count_nodes(root) == expected;
+            valid = valid && ok;
+            rb_destroy(root);
+
+            printf("  %-8s %9.0f ops/sec, p99 %8.1fus, max %9.1fus %s\n",
+                   contention_name(policy), thread_count * ops_per_thread / run_time,
+                   all[all.size() * 99 / 100] * 1e6, all.back() * 1e6,
+                   ok ? "" : "WRONG RESULTS");
+        }
+    }
+
+    return valid ? 0 : 1;
+}
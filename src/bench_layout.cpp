@@ -0,0 +1,120 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * node layout benchmark
+ *
+ * runs a mixed lookup/update workload for 1, 2, 4, ... threads up to the
+ * given maximum on a fresh tree each time. Lookups hit random keys of the
+ * whole range, updates insert or remove a random key owned by the thread,
+ * so the tree stays at about half the range. The layout is fixed at
+ * compile time, compare bench_layout_packed, bench_layout_line and
+ * bench_layout_split, and bench_layout_index for 32 bit links.
+ *
+ * usage: ./bench_layout_<layout> [max threads] [keys] [ops per thread]
+ *                                [update percent]
+ */
+
+using namespace std;
+
+const char *layout_names[] = {"packed", "line", "split"};
+
+tree_node *root;
+int thread_count;
+long key_range = 100000;
+long ops_per_thread = 20000;
+int update_percent = 10;
+pthread_barrier_t start_barrier;
+double run_start;
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_mixed(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index);
+
+    // the keys congruent to index belong to this thread, even ones start in the tree
+    long keys_per_thread = key_range / thread_count;
+    vector<char> present(keys_per_thread);
+    for (long k = 0; k < keys_per_thread; k++)
+        present[k] = ((k * thread_count + index + 1) % 2) == 0;
+    unsigned int seed = index + 1;
+
+    pthread_barrier_wait(&start_barrier);
+    if (index == 0)
+        run_start = bench_now();
+
+    for (long i = 0; i < ops_per_thread; i++)
+    {
+        if ((int)(rand_r(&seed) % 100) >= update_percent)
+        {
+            tree_node *node = tree_search(root, rand_r(&seed) % key_range + 1);
+            if (node != NULL)
+                release_flag(node); // tree_search() hands the node over flagged
+            continue;
+        }
+
+        long k = rand_r(&seed) % keys_per_thread;
+        int value = k * thread_count + index + 1;
+        if (present[k])
+            rb_remove(root, value);
+        else
+            rb_insert(root, value);
+        present[k] = !present[k];
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = 64;
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        key_range = atol(argv[2]);
+    if (argc > 3)
+        ops_per_thread = atol(argv[3]);
+    if (argc > 4)
+        update_percent = atoi(argv[4]);
+
+#ifdef NODE_REF_INDEX
+    const char *links = "index";
+#else
+    const char *links = "pointer";
+#endif
+    printf("layout %s, %s links, sizeof(tree_node) %lu, alignof(tree_node) %lu\n",
+           layout_names[NODE_LAYOUT], links, sizeof(tree_node), alignof(tree_node));
+    printf("%ld keys, %ld ops per thread, %d%% updates\n",
+           key_range, ops_per_thread, update_percent);
+
+    bool valid = true;
+    for (thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+    {
+        thread_index_init(0);
+        root = rb_init();
+        for (long value = 2; value <= key_range; value += 2)
+            rb_insert(root, value);
+
+        pthread_barrier_init(&start_barrier, NULL, thread_count);
+        pthread_t tid[thread_count];
+        for (long i = 0; i < thread_count; i++)
+            pthread_create(&tid[i], NULL, run_mixed, (void *)i);
+        for (int i = 0; i < thread_count; i++)
+            pthread_join(tid[i], NULL);
+        double run_time = bench_now() - run_start;
+        pthread_barrier_destroy(&start_barrier);
+
+        bool ok = check_tree_dfs(root->left_child);
+        valid = valid && ok;
+        printf("threads %2d: %.3fsec, %.0f ops/sec %s\n", thread_count, run_time,
+               thread_count * ops_per_thread / run_time, ok ? "" : "INVALID");
+    }
+
+    return valid ? 0 : 1;
+}
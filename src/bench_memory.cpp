@@ -0,0 +1,76 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+/**
+ * memory per key benchmark
+ *
+ * inserts a shuffled key set and reports how much memory the tree took
+ * per key, both as resident memory and as slab memory handed out by the
+ * node allocator.
+ *
+ * usage: ./bench_memory [keys] [threads]
+ */
+
+using namespace std;
+
+tree_node *root;
+int thread_count = 1;
+long key_count = 1000000;
+vector<int> keys;
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_insert(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index);
+    long per_thread = key_count / thread_count;
+    for (long i = index * per_thread; i < (index + 1) * per_thread; i++)
+        rb_insert(root, keys[i]);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        key_count = atol(argv[1]);
+    if (argc > 2)
+        thread_count = atoi(argv[2]);
+    key_count -= key_count % thread_count;
+
+    keys.resize(key_count);
+    for (long i = 0; i < key_count; i++)
+        keys[i] = i + 1;
+    shuffle(keys.begin(), keys.end(), mt19937(1));
+
+    root = rb_init();
+    node_alloc_stats before, after;
+    node_alloc_get_stats(&before);
+    long rss_before = bench_rss_kb();
+
+    pthread_t tid[thread_count];
+    for (long i = 0; i < thread_count; i++)
+        pthread_create(&tid[i], NULL, run_insert, (void *)i);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(tid[i], NULL);
+
+    long rss_after = bench_rss_kb();
+    node_alloc_get_stats(&after);
+    long found = count_nodes(root);
+
+    printf("%ld keys, %d threads, sizeof(tree_node) %lu\n",
+           key_count, thread_count, sizeof(tree_node));
+    printf("rss: %.1f bytes/key\n", (rss_after - rss_before) * 1024.0 / key_count);
+    printf("slabs: %.1f bytes/key\n",
+           (after.slabs - before.slabs) * (double)NODE_SLAB_SIZE / key_count);
+    printf("tree: %ld keys (expected %ld)\n", found, key_count);
+
+    return found == key_count ? 0 : 1;
+}
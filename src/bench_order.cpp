@@ -0,0 +1,203 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+#include <limits.h>
+
+/**
+ * order statistics benchmark, built with -DRB_ORDER_STATS
+ *
+ * builds the tree from the even keys 2 .. 2 * keys, then runs rb_rank(),
+ * rb_select() and, for comparison, rb_lookup() and a rank counted by a
+ * scan from the smallest key, while writer threads insert and remove
+ * random odd keys like in bench_scan. Every writer keeps at most 1000
+ * odd keys, so the rank of an even key is known up to the odd keys
+ * below it and the sizes not yet updated, and every result is checked
+ * against those bounds. Once the writers stopped, rank and select have
+ * to be exact for every key in the tree.
+ *
+ * usage: ./bench_order [writers] [keys] [queries]
+ */
+
+using namespace std;
+
+#define WRITER_KEYS 1000 // odd keys a writer keeps at most
+
+tree_node *root;
+long key_count = 1000000;
+long queries = 200000;
+int writers = 4;
+atomic<bool> stop(false);
+long writer_ops[1024];
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_writer(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index + 1);
+    unsigned int seed = index + 1;
+    vector<int> inserted;
+
+    while (!stop.load(memory_order_relaxed))
+    {
+        if (inserted.size() > 0 &&
+            (inserted.size() >= WRITER_KEYS || rand_r(&seed) % 2 == 0))
+        {
+            long i = rand_r(&seed) % inserted.size();
+            rb_remove(root, inserted[i]);
+            inserted[i] = inserted.back();
+            inserted.pop_back();
+        }
+        else
+        {
+            // odd keys congruent to the writer index, so no two writers share one
+            long k = rand_r(&seed) % (key_count / 1024 + 1);
+            int value = 2 * (k * 1024 + index) + 1;
+            if (rb_insert(root, value))
+                inserted.push_back(value);
+        }
+        writer_ops[index]++;
+    }
+    return NULL;
+}
+
+bool count_key(int key, void *arg)
+{
+    (*(long *)arg)++;
+    return true;
+}
+
+/**
+ * rank by counting the keys from the smallest one, what a tree without
+ * subtree sizes has to do
+ */
+long scan_rank(int key)
+{
+    long count = 0;
+    rb_scan(root, 0, key - 1, count_key, &count);
+    return count;
+}
+
+long writer_ops_now(void)
+{
+    long ops = 0;
+    for (int i = 0; i < writers; i++)
+        ops += writer_ops[i];
+    return ops;
+}
+
+typedef struct check_order_t
+{
+    long index; // rank the next key should have
+    bool exact;
+} check_order;
+
+bool check_key(int key, void *arg)
+{
+    check_order *check = (check_order *)arg;
+    int selected;
+    if (rb_rank(root, key) != check->index ||
+        !rb_select(root, check->index, &selected) || selected != key)
+        check->exact = false;
+    check->index++;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        writers = atoi(argv[1]);
+    if (argc > 2)
+        key_count = atol(argv[2]);
+    if (argc > 3)
+        queries = atol(argv[3]);
+
+    printf("%ld keys, %d writers, %ld queries\n", key_count, writers, queries);
+
+    thread_index_init(0);
+    root = rb_init();
+    vector<int> keys(key_count);
+    for (long i = 0; i < key_count; i++)
+        keys[i] = 2 * i + 2;
+    rb_build(root, keys.data(), key_count, 1);
+
+    pthread_t tid[writers];
+    for (long i = 0; i < writers; i++)
+        pthread_create(&tid[i], NULL, run_writer, (void *)i);
+    // let the writers get going
+    while (writer_ops_now() < 100 * writers)
+        usleep(1000);
+
+    // the odd keys in the tree, and the updates whose sizes are on the way
+    long odd_bound = (long)writers * WRITER_KEYS + writers;
+    bool valid = true;
+    unsigned int seed = 1;
+    const char *names[] = {"rank", "select", "lookup", "scan rank"};
+    for (int op = 0; op < 4; op++)
+    {
+        // counting by a scan is O(n), a few are enough
+        long n = op == 3 ? 2 : queries;
+        long ops_before = writer_ops_now();
+        double start = bench_now();
+        for (long q = 0; q < n; q++)
+        {
+            long i = rand_r(&seed) % key_count; // even key 2i + 2 has i below it
+            long rank;
+            int key;
+            switch (op)
+            {
+            case 0:
+                rank = rb_rank(root, 2 * i + 2);
+                valid = valid && rank >= i - writers && rank <= i + odd_bound;
+                break;
+            case 1:
+                // between the evens of rank i - odd_bound and i + writers
+                if (rb_select(root, i, &key))
+                    valid = valid && key >= 2 * (i - odd_bound) && key <= 2 * (i + writers) + 3;
+                else
+                    valid = valid && i >= key_count - writers;
+                break;
+            case 2:
+                valid = valid && rb_lookup(root, 2 * i + 2);
+                break;
+            case 3:
+                rank = scan_rank(2 * i + 2);
+                valid = valid && rank >= i && rank <= i + odd_bound;
+                break;
+            }
+        }
+        double run_time = bench_now() - start;
+        long ops_after = writer_ops_now();
+
+        printf("%-10s %11.1f ops/sec, writers %.0f ops/sec %s\n", names[op],
+               n / run_time, (ops_after - ops_before) / run_time,
+               valid ? "" : "WRONG RESULTS");
+    }
+
+    stop = true;
+    for (int i = 0; i < writers; i++)
+        pthread_join(tid[i], NULL);
+
+    // no update runs any more, every size is exact
+    bool ok = check_tree_dfs(root->left_child);
+    if (!ok)
+        printf("INVALID TREE\n");
+    check_order check = {0, true};
+    rb_scan(root, 0, INT_MAX, check_key, &check);
+    int key;
+    if (!check.exact || check.index != count_nodes(root) ||
+        rb_select(root, check.index, &key) || rb_rank(root, INT_MAX) != check.index)
+    {
+        printf("WRONG ORDER STATISTICS\n");
+        ok = false;
+    }
+    else
+        printf("rank and select exact for all %ld keys\n", check.index);
+
+    rb_destroy(root);
+    return valid && ok ? 0 : 1;
+}
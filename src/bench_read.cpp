@@ -0,0 +1,144 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * read-heavy benchmark
+ *
+ * runs a lookup-heavy mix for 1, 2, 4, ... threads up to the given
+ * maximum, once with lookups through tree_search(), which takes flags
+ * hand over hand, and once through rb_lookup(), which takes none.
+ * Updates insert or remove a random key owned by the thread, lookups hit
+ * random keys of the whole range. A thread knows which of its own keys
+ * are in the tree, so every lookup of an own key is checked.
+ *
+ * usage: ./bench_read [max threads] [keys] [ops per thread]
+ *                     [update percent]
+ */
+
+using namespace std;
+
+tree_node *root;
+int thread_count;
+long key_range = 100000;
+long ops_per_thread = 20000;
+int update_percent = 10;
+bool optimistic;
+pthread_barrier_t start_barrier;
+double run_start;
+long wrong[1024];
+
+bool remove_dbg = false; // dbg_printf
+
+bool lookup(int value)
+{
+    if (optimistic)
+        return rb_lookup(root, value);
+
+    tree_node *node = tree_search(root, value);
+    if (node == NULL)
+        return false;
+    release_flag(node); // tree_search() hands the node over flagged
+    return true;
+}
+
+void *run_mixed(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index);
+
+    // the keys congruent to index belong to this thread, even ones start in the tree
+    long keys_per_thread = key_range / thread_count;
+    vector<char> present(keys_per_thread);
+    for (long k = 0; k < keys_per_thread; k++)
+        present[k] = ((k * thread_count + index + 1) % 2) == 0;
+    unsigned int seed = index + 1;
+    wrong[index] = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    if (index == 0)
+        run_start = bench_now();
+
+    for (long i = 0; i < ops_per_thread; i++)
+    {
+        if ((int)(rand_r(&seed) % 100) >= update_percent)
+        {
+            int value = rand_r(&seed) % key_range + 1;
+            bool found = lookup(value);
+            long k = (value - 1) / thread_count;
+            if ((value - 1) % thread_count == index && k < keys_per_thread &&
+                found != (bool)present[k])
+                wrong[index]++;
+            continue;
+        }
+
+        long k = rand_r(&seed) % keys_per_thread;
+        int value = k * thread_count + index + 1;
+        if (present[k])
+            rb_remove(root, value);
+        else
+            rb_insert(root, value);
+        present[k] = !present[k];
+    }
+    return NULL;
+}
+
+/**
+ * run the mix on a fresh tree, returns ops/sec
+ */
+double run(bool opt, long *errors)
+{
+    optimistic = opt;
+    thread_index_init(0);
+    root = rb_init();
+    for (long value = 2; value <= key_range; value += 2)
+        rb_insert(root, value);
+
+    pthread_barrier_init(&start_barrier, NULL, thread_count);
+    pthread_t tid[thread_count];
+    for (long i = 0; i < thread_count; i++)
+        pthread_create(&tid[i], NULL, run_mixed, (void *)i);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(tid[i], NULL);
+    double run_time = bench_now() - run_start;
+    pthread_barrier_destroy(&start_barrier);
+
+    *errors = check_tree_dfs(root->left_child) ? 0 : 1;
+    for (int i = 0; i < thread_count; i++)
+        *errors += wrong[i];
+    return thread_count * ops_per_thread / run_time;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = 64;
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        key_range = atol(argv[2]);
+    if (argc > 3)
+        ops_per_thread = atol(argv[3]);
+    if (argc > 4)
+        update_percent = atoi(argv[4]);
+
+    printf("%ld keys, %ld ops per thread, %d%% updates\n",
+           key_range, ops_per_thread, update_percent);
+
+    long errors = 0;
+    for (thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+    {
+        long flag_errors, opt_errors;
+        double flag_ops = run(false, &flag_errors);
+        double opt_ops = run(true, &opt_errors);
+        errors += flag_errors + opt_errors;
+        printf("threads %2d: tree_search %.0f ops/sec, rb_lookup %.0f ops/sec %s\n",
+               thread_count, flag_ops, opt_ops,
+               flag_errors + opt_errors ? "WRONG RESULTS" : "");
+    }
+
+    return errors == 0 ? 0 : 1;
+}
@@ -0,0 +1,130 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * churn benchmark for memory reclamation
+ *
+ * every thread owns the keys congruent to its index and randomly inserts
+ * or removes them for a fixed number of operations, so the tree keeps
+ * shrinking and growing while nodes are retired all the time.
+ *
+ * with 'stall' one more thread enters an operation and sleeps through the
+ * whole run, like a descheduled reader would.
+ *
+ * usage: ./bench_reclaim [epoch|hazard|none] [threads] [ops per thread]
+ *                        [keys] [stall]
+ */
+
+using namespace std;
+
+tree_node *root;
+int thread_count = 4;
+long ops_per_thread = 200000;
+long key_range = 1000000;
+long live_keys[1024];
+volatile bool churn_done = false;
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_churn(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index);
+
+    long keys_per_thread = key_range / thread_count;
+    vector<char> present(keys_per_thread, 0);
+    unsigned int seed = index + 1;
+
+    for (long i = 0; i < ops_per_thread; i++)
+    {
+        long k = rand_r(&seed) % keys_per_thread;
+        int value = k * thread_count + index + 1;
+        if (present[k])
+            rb_remove(root, value);
+        else
+            rb_insert(root, value);
+        present[k] = !present[k];
+    }
+
+    live_keys[index] = 0;
+    for (auto in_tree : present)
+        live_keys[index] += in_tree;
+    return NULL;
+}
+
+void *run_stall(void *p)
+{
+    reclaim_enter();
+    while (!churn_done)
+        usleep(1000);
+    reclaim_exit();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode_names[] = {"none", "epoch", "hazard"};
+    int mode = RECLAIM_EPOCH;
+    if (argc > 1 && strcmp(argv[1], "none") == 0)
+        mode = RECLAIM_NONE;
+    if (argc > 1 && strcmp(argv[1], "hazard") == 0)
+        mode = RECLAIM_HAZARD;
+    if (argc > 2)
+        thread_count = atoi(argv[2]);
+    if (argc > 3)
+        ops_per_thread = atol(argv[3]);
+    if (argc > 4)
+        key_range = atol(argv[4]);
+    bool stall = argc > 5 && strcmp(argv[5], "stall") == 0;
+
+    reclaim_init(mode);
+    root = rb_init();
+
+    pthread_t tid[thread_count], stall_tid;
+    if (stall)
+        pthread_create(&stall_tid, NULL, run_stall, NULL);
+
+    double start = bench_now();
+    for (long i = 0; i < thread_count; i++)
+        pthread_create(&tid[i], NULL, run_churn, (void *)i);
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(tid[i], NULL);
+    double elapsed_time = bench_now() - start;
+
+    // counters before the stalled thread lets go
+    reclaim_stats stats;
+    reclaim_get_stats(&stats);
+
+    churn_done = true;
+    if (stall)
+        pthread_join(stall_tid, NULL);
+
+    long expected = 0;
+    for (int i = 0; i < thread_count; i++)
+        expected += live_keys[i];
+    long found = count_nodes(root);
+    bool valid = check_tree_dfs(root->left_child);
+
+    double total_ops = (double)ops_per_thread * thread_count;
+    printf("reclaim %s%s, %d threads, %ld ops: %.3fsec, %.0f ops/sec\n",
+           mode_names[mode], stall ? " (stalled thread)" : "", thread_count,
+           (long)total_ops, elapsed_time, total_ops / elapsed_time);
+    printf("peak rss: %ld KB\n", bench_peak_rss_kb());
+    printf("retired: %lu freed: %lu pending: %lu\n",
+           stats.retired, stats.freed, stats.pending);
+    if (stats.bound)
+        printf("largest retire list: %lu (bound %lu)\n",
+               stats.peak_pending, stats.bound);
+    else
+        printf("largest retire list: %lu\n", stats.peak_pending);
+    printf("tree: %ld keys (expected %ld) %s\n",
+           found, expected, valid ? "valid" : "INVALID");
+
+    return (found == expected && valid) ? 0 : 1;
+}
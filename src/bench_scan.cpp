@@ -0,0 +1,154 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * range scan benchmark
+ *
+ * fills the tree with the even keys 2 .. 2 * keys, then scans ranges of
+ * 1K, 10K, ... keys up to the whole tree while writer threads insert and
+ * remove random odd keys. Writers never touch even keys, so every scan
+ * must report all even keys of its range; it also checks that keys come
+ * in increasing order and stay within the range.
+ *
+ * usage: ./bench_scan [writers] [keys] [scans per length]
+ */
+
+using namespace std;
+
+tree_node *root;
+long key_count = 1000000;
+int scans_per_length = 3;
+atomic<bool> stop(false);
+long writer_ops[1024];
+
+bool remove_dbg = false; // dbg_printf
+
+typedef struct scan_check_t
+{
+    long last;   // last key seen, lo - 1 before the first
+    long stable; // even keys seen
+    bool ordered;
+} scan_check;
+
+bool check_key(int key, void *arg)
+{
+    scan_check *check = (scan_check *)arg;
+    if (key <= check->last)
+        check->ordered = false;
+    check->last = key;
+    if (key % 2 == 0)
+        check->stable++;
+    return true;
+}
+
+void *run_writer(void *p)
+{
+    long index = (long)p;
+    thread_index_init(index + 1);
+    unsigned int seed = index + 1;
+    vector<int> inserted;
+
+    while (!stop.load(memory_order_relaxed))
+    {
+        // keep the number of odd keys in the tree bounded
+        if (inserted.size() > 0 && (inserted.size() > 1000 || rand_r(&seed) % 2 == 0))
+        {
+            long i = rand_r(&seed) % inserted.size();
+            rb_remove(root, inserted[i]);
+            inserted[i] = inserted.back();
+            inserted.pop_back();
+        }
+        else
+        {
+            // odd keys congruent to the writer index, so no two writers share one
+            long k = rand_r(&seed) % (key_count / 1024 + 1);
+            int value = 2 * (k * 1024 + index) + 1;
+            bool present = false;
+            for (auto key : inserted)
+                present = present || key == value;
+            if (present)
+                continue;
+            rb_insert(root, value);
+            inserted.push_back(value);
+        }
+        writer_ops[index]++;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int writers = 4;
+    if (argc > 1)
+        writers = atoi(argv[1]);
+    if (argc > 2)
+        key_count = atol(argv[2]);
+    if (argc > 3)
+        scans_per_length = atoi(argv[3]);
+
+    printf("%ld keys, %d writers, %d scans per length\n",
+           key_count, writers, scans_per_length);
+
+    thread_index_init(0);
+    root = rb_init();
+    for (long value = 2; value <= 2 * key_count; value += 2)
+        rb_insert(root, value);
+
+    pthread_t tid[writers];
+    for (long i = 0; i < writers; i++)
+        pthread_create(&tid[i], NULL, run_writer, (void *)i);
+    // let the writers get going
+    for (long ops = 0; ops < 100 * writers; usleep(1000))
+    {
+        ops = 0;
+        for (int i = 0; i < writers; i++)
+            ops += writer_ops[i];
+    }
+
+    bool valid = true;
+    unsigned int seed = 1;
+    for (long length = 1000; ; length *= 10)
+    {
+        if (length > key_count)
+            length = key_count;
+
+        long keys = 0;
+        long ops_before = 0, ops_after = 0;
+        for (int i = 0; i < writers; i++)
+            ops_before += writer_ops[i];
+        double start = bench_now();
+        for (int s = 0; s < scans_per_length; s++)
+        {
+            // length even keys, starting at a random one
+            long first = rand_r(&seed) % (key_count - length + 1);
+            long lo = 2 * first + 2, hi = 2 * (first + length);
+            scan_check check = {lo - 1, 0, true};
+            keys += rb_scan(root, lo, hi, check_key, &check);
+            if (!check.ordered || check.last > hi || check.stable != length)
+                valid = false;
+        }
+        double run_time = bench_now() - start;
+        for (int i = 0; i < writers; i++)
+            ops_after += writer_ops[i];
+
+        printf("length %7ld: %.0f keys/sec, %.1f scans/sec, writers %.0f ops/sec %s\n",
+               length, keys / run_time, scans_per_length / run_time,
+               (ops_after - ops_before) / run_time, valid ? "" : "WRONG RESULTS");
+        if (length == key_count)
+            break;
+    }
+
+    stop = true;
+    for (int i = 0; i < writers; i++)
+        pthread_join(tid[i], NULL);
+
+    bool ok = check_tree_dfs(root->left_child);
+    if (!ok)
+        printf("INVALID TREE\n");
+    return valid && ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <vector>
+#include <algorithm>
+
+/**
+ * snapshot restart benchmark
+ *
+ * builds a tree from the even keys 2 .. 2 * keys, saves it to a
+ * snapshot image and restores a new tree from it, dropping the image
+ * from the page cache first so the restore reads it from disk. Reports
+ * the time until the restored tree answered its first lookup and until
+ * it was built, and the lookups it answered from the image meanwhile.
+ * For comparison it times refilling a tree by rb_insert() of the keys in
+ * random order, on at most 1M keys and scaled up to all of them. Every
+ * lookup is checked, and the restored tree is checked for size and the
+ * red-black properties.
+ *
+ * usage: ./bench_snapshot [keys] [threads] [image path]
+ */
+
+using namespace std;
+
+#define INSERT_SAMPLE 1000000 // keys refilled by rb_insert() at most
+
+bool remove_dbg = false; // dbg_printf
+
+/**
+ * drop the clean pages of the file from the page cache
+ */
+void drop_cache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    long key_count = 10000000;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    const char *path = "bench_snapshot.img";
+    if (argc > 1)
+        key_count = atol(argv[1]);
+    if (argc > 2)
+        threads = atoi(argv[2]);
+    if (argc > 3)
+        path = argv[3];
+
+    printf("%ld keys, %d threads, image %s\n", key_count, threads, path);
+
+    vector<int> keys(key_count);
+    for (long i = 0; i < key_count; i++)
+        keys[i] = 2 * i + 2;
+    bool valid = true;
+
+    // what a restart without an image costs
+    long sample = min(key_count, (long)INSERT_SAMPLE);
+    vector<int> shuffled(keys.begin(), keys.begin() + sample);
+    unsigned int seed = 1;
+    for (long i = sample - 1; i > 0; i--)
+        swap(shuffled[i], shuffled[rand_r(&seed) % (i + 1)]);
+    double insert_time;
+    {
+        LockFreeRBTree tree;
+        double start = bench_now();
+        for (long i = 0; i < sample; i++)
+            tree.insert(shuffled[i]);
+        insert_time = (bench_now() - start) * key_count / sample;
+    }
+    printf("rb_insert refill:      %9.3f sec%s\n", insert_time,
+           sample < key_count ? " (scaled from 1M keys)" : "");
+
+    long saved;
+    {
+        LockFreeRBTree tree;
+        tree.build(keys.data(), key_count, threads);
+        double start = bench_now();
+        saved = tree.save(path);
+        double save_time = bench_now() - start;
+        if (saved != key_count)
+        {
+            perror("[ERROR] save");
+            return 1;
+        }
+        printf("save:                  %9.3f sec, %.1f MB\n", save_time,
+               (double)saved * sizeof(tree_key) / 1048576);
+    }
+    drop_cache(path);
+
+    LockFreeRBTree tree;
+    long image_lookups = 0;
+    double start = bench_now();
+    if (!tree.restore(path, threads))
+    {
+        perror("[ERROR] restore");
+        return 1;
+    }
+    valid = valid && tree.find(keys[rand_r(&seed) % key_count]);
+    double first_time = bench_now() - start;
+    while (!tree.restored())
+    {
+        long i = rand_r(&seed) % key_count;
+        valid = valid && tree.find(keys[i]) && !tree.find(keys[i] + 1);
+        image_lookups += 2;
+    }
+    double restore_time = bench_now() - start;
+    if (!tree.wait_restored())
+    {
+        fprintf(stderr, "[ERROR] building the tree from the image failed.\n");
+        return 1;
+    }
+    printf("first lookup:          %9.6f sec, %.0fx faster than the refill\n", first_time,
+           insert_time / first_time);
+    printf("restored:              %9.3f sec, %.1fx faster than the refill, "
+           "%ld lookups from the image meanwhile\n",
+           restore_time, insert_time / restore_time, image_lookups);
+
+    for (long q = 0; q < 100000; q++)
+    {
+        long i = rand_r(&seed) % key_count;
+        valid = valid && tree.find(keys[i]) && !tree.find(keys[i] + 1);
+    }
+    bool ok = tree.size() == key_count && tree.check();
+    if (!valid)
+        printf("WRONG RESULTS\n");
+    if (!ok)
+        printf("INVALID TREE\n");
+    unlink(path);
+    return valid && ok ? 0 : 1;
+}
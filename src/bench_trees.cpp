@@ -0,0 +1,147 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <iostream>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+
+/**
+ * many trees benchmark
+ *
+ * runs a mixed lookup/update workload on many small LockFreeRBTree
+ * objects at once, for 1, 2, 4, ... threads up to the given maximum.
+ * Every operation picks a random tree, so each thread works on all the
+ * trees and keeps a context in each. In every tree the keys congruent to
+ * the thread index belong to that thread; it knows which of them are in
+ * the tree, so lookups of own keys and the final sizes are checked. The
+ * trees are built and destroyed again for every thread count.
+ *
+ * usage: ./bench_trees [max threads] [trees] [keys per tree]
+ *                      [ops per thread] [update percent]
+ */
+
+using namespace std;
+
+vector<LockFreeRBTree *> trees;
+int thread_count;
+long tree_count = 1000;
+long key_range = 1000;
+long ops_per_thread = 20000;
+int update_percent = 10;
+pthread_barrier_t start_barrier;
+double run_start;
+long wrong[1024];
+long own_keys[1024];
+
+bool remove_dbg = false; // dbg_printf
+
+void *run_mixed(void *p)
+{
+    long index = (long)p;
+
+    // even keys start in every tree
+    long keys_per_thread = key_range / thread_count;
+    vector<char> present(tree_count * keys_per_thread);
+    for (long t = 0; t < tree_count; t++)
+        for (long k = 0; k < keys_per_thread; k++)
+            present[t * keys_per_thread + k] = ((k * thread_count + index + 1) % 2) == 0;
+    unsigned int seed = index + 1;
+    wrong[index] = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    if (index == 0)
+        run_start = bench_now();
+
+    for (long i = 0; i < ops_per_thread; i++)
+    {
+        long t = rand_r(&seed) % tree_count;
+        LockFreeRBTree *tree = trees[t];
+        if ((int)(rand_r(&seed) % 100) >= update_percent)
+        {
+            int value = rand_r(&seed) % key_range + 1;
+            bool found = tree->find(value);
+            long k = (value - 1) / thread_count;
+            if ((value - 1) % thread_count == index && k < keys_per_thread &&
+                found != (bool)present[t * keys_per_thread + k])
+                wrong[index]++;
+            continue;
+        }
+
+        long k = rand_r(&seed) % keys_per_thread;
+        int value = k * thread_count + index + 1;
+        if (present[t * keys_per_thread + k])
+            tree->remove(value);
+        else
+            tree->insert(value);
+        present[t * keys_per_thread + k] = !present[t * keys_per_thread + k];
+    }
+
+    own_keys[index] = 0;
+    for (auto key : present)
+        own_keys[index] += key;
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int max_threads = 64;
+    if (argc > 1)
+        max_threads = atoi(argv[1]);
+    if (argc > 2)
+        tree_count = atol(argv[2]);
+    if (argc > 3)
+        key_range = atol(argv[3]);
+    if (argc > 4)
+        ops_per_thread = atol(argv[4]);
+    if (argc > 5)
+        update_percent = atoi(argv[5]);
+
+    printf("%ld trees, %ld keys per tree, %ld ops per thread, %d%% updates\n",
+           tree_count, key_range, ops_per_thread, update_percent);
+
+    bool valid = true;
+    for (thread_count = 1; thread_count <= max_threads; thread_count *= 2)
+    {
+        // keys past the last full round of owners stay out of the tree
+        long owned_range = key_range / thread_count * thread_count;
+        for (long t = 0; t < tree_count; t++)
+        {
+            trees.push_back(new LockFreeRBTree());
+            for (long value = 2; value <= owned_range; value += 2)
+                trees[t]->insert(value);
+        }
+
+        pthread_barrier_init(&start_barrier, NULL, thread_count);
+        pthread_t tid[thread_count];
+        for (long i = 0; i < thread_count; i++)
+            pthread_create(&tid[i], NULL, run_mixed, (void *)i);
+        for (int i = 0; i < thread_count; i++)
+            pthread_join(tid[i], NULL);
+        double run_time = bench_now() - run_start;
+        pthread_barrier_destroy(&start_barrier);
+
+        long errors = 0, keys = 0, expected = 0;
+        for (auto tree : trees)
+        {
+            if (!tree->check())
+                errors++;
+            keys += tree->size();
+            delete tree;
+        }
+        trees.clear();
+        for (int i = 0; i < thread_count; i++)
+        {
+            errors += wrong[i];
+            expected += own_keys[i];
+        }
+        if (keys != expected)
+            errors++;
+
+        valid = valid && errors == 0;
+        printf("threads %2d: %.0f ops/sec %s\n", thread_count,
+               thread_count * ops_per_thread / run_time, errors ? "WRONG RESULTS" : "");
+    }
+
+    return valid ? 0 : 1;
+}
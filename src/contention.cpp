@@ -0,0 +1,156 @@
+#include "tree.h"
+
+#include <sched.h>
+
+/******************
+ * contention manager
+ ******************/
+
+/**
+ * Every place that fails to get a flag and has to try again calls
+ * contention_wait() with a counter of the failures in a row at that
+ * place, which starts at 0. What the thread does before the next try
+ * depends on the policy:
+ *
+ *   CONTENTION_SPIN      nothing, the retry comes at once
+ *   CONTENTION_SLEEP     usleep(100) each time, what par_find() used to do
+ *   CONTENTION_BACKOFF   a random number of pause instructions below
+ *                        2^failures, capped at 2^CONTENTION_MAX_SHIFT
+ *   CONTENTION_YIELD     CONTENTION_SPIN_TRIES pauses, then sched_yield()
+ *   CONTENTION_ADAPTIVE  backoff for the first spin_limit failures, then
+ *                        sched_yield(); each thread tunes its spin_limit
+ *
+ * Flags are held for a handful of instructions, so a short backoff is
+ * enough while the holder is running. When the holder has been preempted
+ * (more threads than cores) no amount of spinning helps and the waiter
+ * should give the core away. The adaptive policy learns which case it is
+ * in from the previous wait: if that wait got its flag within the spin
+ * phase the limit goes up by one, if it had to yield the limit goes down
+ * by one. It starts in the middle.
+ */
+
+#define CONTENTION_MAX_SHIFT 10 // at most 2047 pauses per wait, see backoff()
+#define CONTENTION_SPIN_TRIES 64
+
+static int contention_mode = CONTENTION_DEFAULT_MODE;
+
+typedef struct contention_thread_t
+{
+    unsigned int seed;         // xorshift state, 0 until first use
+    unsigned int spin_limit;   // adaptive: backoff rounds before yielding
+    unsigned int last_failures; // failures of the current or last wait
+} contention_thread;
+
+static thread_local contention_thread contention_thread_state = {
+    0, CONTENTION_MAX_SHIFT / 2, 0};
+
+/**
+ * choose the contention policy, must be called before any tree is used
+ */
+void contention_init(int mode)
+{
+    contention_mode = mode;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#else
+    atomic_signal_fence(memory_order_seq_cst);
+#endif
+}
+
+static unsigned int next_random(contention_thread *ct)
+{
+    if (ct->seed == 0)
+        ct->seed = (unsigned int)(uintptr_t)ct | 1;
+    ct->seed ^= ct->seed << 13;
+    ct->seed ^= ct->seed >> 17;
+    ct->seed ^= ct->seed << 5;
+    return ct->seed;
+}
+
+/**
+ * pause a random number of times below 2 << failures, with failures
+ * capped at CONTENTION_MAX_SHIFT
+ */
+static void backoff(contention_thread *ct, unsigned int failures)
+{
+    unsigned int shift = failures < CONTENTION_MAX_SHIFT ? failures : CONTENTION_MAX_SHIFT;
+    unsigned int pauses = next_random(ct) & ((2u << shift) - 1);
+    for (unsigned int i = 0; i < pauses; i++)
+        cpu_relax();
+}
+
+/**
+ * back off after a failed attempt, *failures counts the failures in a row
+ * and is incremented
+ */
+void contention_wait(unsigned int *failures)
+{
+    contention_thread *ct = &contention_thread_state;
+    unsigned int n = (*failures)++;
+
+    switch (contention_mode)
+    {
+    case CONTENTION_SPIN:
+        break;
+    case CONTENTION_SLEEP:
+        usleep(100);
+        break;
+    case CONTENTION_BACKOFF:
+        backoff(ct, n);
+        break;
+    case CONTENTION_YIELD:
+        if (n == 0)
+        {
+            for (int i = 0; i < CONTENTION_SPIN_TRIES; i++)
+                cpu_relax();
+        }
+        else
+            sched_yield();
+        break;
+    case CONTENTION_ADAPTIVE:
+        if (n == 0)
+        {
+            // a new wait, learn from how the last one ended
+            if (ct->last_failures > ct->spin_limit)
+            {
+                if (ct->spin_limit > 1)
+                    ct->spin_limit--;
+            }
+            else if (ct->last_failures > 0 && ct->spin_limit < CONTENTION_MAX_SHIFT)
+                ct->spin_limit++;
+        }
+        ct->last_failures = n + 1;
+        if (n < ct->spin_limit)
+            backoff(ct, n);
+        else
+            sched_yield();
+        break;
+    }
+}
+
+/**
+ * name of a contention policy, for reports
+ */
+const char *contention_name(int mode)
+{
+    switch (mode)
+    {
+    case CONTENTION_SPIN:
+        return "spin";
+    case CONTENTION_SLEEP:
+        return "sleep";
+    case CONTENTION_BACKOFF:
+        return "backoff";
+    case CONTENTION_YIELD:
+        return "yield";
+    case CONTENTION_ADAPTIVE:
+        return "adaptive";
+    }
+    return "unknown";
+}
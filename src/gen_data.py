@@ -1,10 +1,23 @@
 import random
+import struct
+import sys
+from array import array
 
-total_size = 100000
-with open("data.txt", 'w') as f:
-    l = [i for i in range(1, total_size+1)]
-    random.shuffle(l)
-    for num in l[:total_size]:
-        f.write("%d\n" % num)
+# usage: python3 src/gen_data.py [keys] [file]
+# a shuffle of 1..keys (100000) into file (data.txt), one number per line,
+# or as a binary key file of int keys if the name ends in .bin, see
+# src/key_file.h
+total_size = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+path = sys.argv[2] if len(sys.argv) > 2 else "data.txt"
 
-f.close()
+l = [i for i in range(1, total_size+1)]
+random.shuffle(l)
+if path.endswith(".bin"):
+    with open(path, 'wb') as f:
+        header = struct.pack("=QIIQ", 0x315359454b425254, 1, 4, total_size)
+        f.write(header + bytes(64 - len(header)))
+        array('i', l).tofile(f)
+else:
+    with open(path, 'w') as f:
+        for num in l[:total_size]:
+            f.write("%d\n" % num)
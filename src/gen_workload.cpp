@@ -0,0 +1,420 @@
+#include "key_file.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <limits>
+#include <atomic>
+
+/**
+ * workload generator
+ *
+ * Writes a binary key file (see key_file.h) of keys from one of the
+ * distributions below, or with -m an operation trace with a lookup,
+ * insert or remove for every key, for test_parallel -S -f or -T. The
+ * entries are cut into blocks of GEN_BLOCK and every block draws from
+ * a generator seeded by the seed and its number, so threads fill the
+ * mapped file in parallel and the output only depends on the options,
+ * never on the number of threads.
+ *
+ *   shuffle     every key of 1..KEYS once in random order, by a keyed
+ *               Feistel permutation instead of an array, so it needs no
+ *               memory; COUNT above KEYS starts over
+ *   uniform     any key with the same chance
+ *   zipf        zipfian over the keys with skew theta (0.99), the hot
+ *               keys are the smallest ones like in test_parallel, or
+ *               spread over the range by the shuffle permutation with -x
+ *   sequential  1, 2, 3, ... KEYS, then again from 1
+ *   hotspot     a share of the accesses (80%) goes to a share of the
+ *               keys (20%), split into a number of clusters (1) at
+ *               random places; the rest go to any key
+ *   shifting    every access is to a window of the keys (10%) that
+ *               jumps to a random place a number of times (10) over the
+ *               trace, a working set that moves
+ *
+ * usage: ./gen_workload [options] FILE
+ *   -n COUNT   keys to write (default 1000000)
+ *   -k KEYS    keys are 1..KEYS (default COUNT)
+ *   -d DIST    shuffle (default), uniform, zipf[:theta], sequential,
+ *              hotspot[:key%:access%:clusters] or shifting[:window%:phases]
+ *   -x         zipf: spread the hot keys over the range
+ *   -m R:I:D   write a trace with R% lookups, I% inserts, D% removes
+ *   -s SEED    (default 1)
+ *   -t N       threads (default all cores)
+ */
+
+using namespace std;
+
+#define GEN_BLOCK 65536 // entries of one generator seed
+#define ZIPF_EXACT 10000000 // ranks summed up for zeta, the rest estimated
+
+#define GEN_SHUFFLE 0
+#define GEN_UNIFORM 1
+#define GEN_ZIPF 2
+#define GEN_SEQUENTIAL 3
+#define GEN_HOTSPOT 4
+#define GEN_SHIFTING 5
+
+typedef struct gen_options_t
+{
+    long count;
+    long keys;
+    int dist;
+    double theta;
+    bool scatter;
+    double hot_keys, hot_access;
+    long clusters;
+    double window;
+    long phases;
+    int percent[3]; // lookups, inserts, removes; all 0 for keys only
+    unsigned long long seed;
+    int threads;
+} gen_options;
+
+gen_options opt = {1000000, -1, GEN_SHUFFLE, 0.99, false, 0.2, 0.8, 1, 0.1, 10, {0, 0, 0}, 1, 0};
+
+/* zipf constants, see zipf_init() */
+double zipf_zetan, zipf_eta, zipf_alpha, zipf_two;
+
+/* shuffle permutation, see permute() */
+int perm_half_bits;
+unsigned long long perm_half_mask;
+
+/* hotspot cluster starts */
+vector<long> cluster_start;
+long cluster_size;
+
+key_file out;
+atomic<long> next_block(0);
+
+/**
+ * the splitmix64 finalizer, a good 64 bit mix
+ */
+static inline unsigned long long mix64(unsigned long long x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+typedef struct gen_rng_t
+{
+    unsigned long long state;
+} gen_rng;
+
+static inline unsigned long long next64(gen_rng *rng)
+{
+    rng->state += 0x9e3779b97f4a7c15ULL;
+    return mix64(rng->state);
+}
+
+/**
+ * uniform in [0, n)
+ */
+static inline long below(gen_rng *rng, long n)
+{
+    return (long)(((unsigned __int128)next64(rng) * (unsigned long long)n) >> 64);
+}
+
+/**
+ * uniform in [0, 1)
+ */
+static inline double unit(gen_rng *rng)
+{
+    return (next64(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * a bijection of [0, keys): four Feistel rounds on the smallest even
+ * number of bits that holds keys, walking the cycle until the result
+ * is in range, which takes fewer than four steps on average
+ */
+static long permute(long x)
+{
+    unsigned long long v = x;
+    do
+    {
+        unsigned long long left = v >> perm_half_bits, right = v & perm_half_mask;
+        for (int round = 0; round < 4; round++)
+        {
+            unsigned long long f = mix64(right ^ mix64(opt.seed + round)) & perm_half_mask;
+            unsigned long long next = left ^ f;
+            left = right;
+            right = next;
+        }
+        v = (left << perm_half_bits) | right;
+    } while (v >= (unsigned long long)opt.keys);
+    return (long)v;
+}
+
+static void permute_init(void)
+{
+    int bits = 2;
+    while (bits < 62 && (1ULL << bits) < (unsigned long long)opt.keys)
+        bits += 2;
+    perm_half_bits = bits / 2;
+    perm_half_mask = (1ULL << perm_half_bits) - 1;
+}
+
+/**
+ * the zipfian generator of Gray et al. like test_parallel's; above
+ * ZIPF_EXACT keys the tail of zeta(n) is its integral, off by far less
+ * than the sampling error of a billion draws
+ */
+static void zipf_init(void)
+{
+    double theta = opt.theta;
+    long n = opt.keys;
+    long exact = min(n, (long)ZIPF_EXACT);
+    zipf_zetan = 0;
+    for (long i = 1; i <= exact; i++)
+        zipf_zetan += 1 / pow((double)i, theta);
+    if (n > exact)
+        zipf_zetan += (pow(n + 0.5, 1 - theta) - pow(exact + 0.5, 1 - theta)) / (1 - theta);
+    double zeta2 = 1 + 1 / pow(2.0, theta);
+    zipf_alpha = 1 / (1 - theta);
+    zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+    zipf_two = zeta2;
+}
+
+static inline long zipf_rank(gen_rng *rng)
+{
+    double u = unit(rng);
+    double uz = u * zipf_zetan;
+    if (uz < 1)
+        return 0;
+    if (uz < zipf_two)
+        return 1;
+    long rank = (long)(opt.keys * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha));
+    return min(rank, opt.keys - 1);
+}
+
+/**
+ * clusters of equal size at random places, one in every equal share of
+ * the keys so they do not overlap
+ */
+static void hotspot_init(void)
+{
+    long hot = max(1L, (long)(opt.keys * opt.hot_keys));
+    long clusters = min(opt.clusters, hot);
+    cluster_size = hot / clusters;
+    gen_rng rng = {mix64(opt.seed ^ 0x686f74ULL)};
+    long share = opt.keys / clusters;
+    for (long c = 0; c < clusters; c++)
+        cluster_start.push_back(c * share + below(&rng, share - cluster_size + 1));
+}
+
+/**
+ * key i of the file, 0 based, with rng the generator of its block
+ */
+static inline long next_key(gen_rng *rng, long i)
+{
+    switch (opt.dist)
+    {
+    case GEN_SHUFFLE:
+        return permute(i % opt.keys);
+    case GEN_ZIPF:
+    {
+        long rank = zipf_rank(rng);
+        return opt.scatter ? permute(rank) : rank;
+    }
+    case GEN_SEQUENTIAL:
+        return i % opt.keys;
+    case GEN_HOTSPOT:
+        if (unit(rng) < opt.hot_access)
+            return cluster_start[below(rng, cluster_start.size())] + below(rng, cluster_size);
+        return below(rng, opt.keys);
+    case GEN_SHIFTING:
+    {
+        long size = max(1L, (long)(opt.keys * opt.window));
+        long phase = (long)((double)i * opt.phases / opt.count);
+        gen_rng at = {mix64(opt.seed ^ mix64(phase + 1))};
+        return below(&at, opt.keys - size + 1) + below(rng, size);
+    }
+    }
+    return below(rng, opt.keys);
+}
+
+static void *fill_blocks(void *arg)
+{
+    long blocks = (opt.count + GEN_BLOCK - 1) / GEN_BLOCK;
+    int lookup_below = opt.percent[0];
+    int insert_below = lookup_below + opt.percent[1];
+    long block;
+    while ((block = next_block.fetch_add(1)) < blocks)
+    {
+        gen_rng rng = {mix64(opt.seed) ^ mix64(block + 1)};
+        long end = min(opt.count, (block + 1) * GEN_BLOCK);
+        for (long i = block * GEN_BLOCK; i < end; i++)
+        {
+            out.out_keys[i] = (tree_key)(next_key(&rng, i) + 1);
+            if (out.out_ops != NULL)
+            {
+                int op = (int)(unit(&rng) * 100);
+                out.out_ops[i] = op < lookup_below   ? KEY_OP_LOOKUP
+                                 : op < insert_below ? KEY_OP_INSERT
+                                                     : KEY_OP_REMOVE;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * -d argument, the numbers after the name are optional
+ */
+static bool parse_dist(const char *arg)
+{
+    double a, b, c;
+    if (strcmp(arg, "shuffle") == 0)
+        opt.dist = GEN_SHUFFLE;
+    else if (strcmp(arg, "uniform") == 0)
+        opt.dist = GEN_UNIFORM;
+    else if (strcmp(arg, "sequential") == 0)
+        opt.dist = GEN_SEQUENTIAL;
+    else if (strncmp(arg, "zipf", 4) == 0)
+    {
+        opt.dist = GEN_ZIPF;
+        if (arg[4] == ':')
+            opt.theta = atof(arg + 5);
+        else if (arg[4] != '\0')
+            return false;
+        return opt.theta > 0 && opt.theta < 1;
+    }
+    else if (strncmp(arg, "hotspot", 7) == 0)
+    {
+        opt.dist = GEN_HOTSPOT;
+        if (arg[7] == ':')
+        {
+            int n = sscanf(arg + 8, "%lf:%lf:%lf", &a, &b, &c);
+            if (n < 2)
+                return false;
+            opt.hot_keys = a / 100;
+            opt.hot_access = b / 100;
+            if (n == 3)
+                opt.clusters = (long)c;
+        }
+        else if (arg[7] != '\0')
+            return false;
+        return opt.hot_keys > 0 && opt.hot_keys <= 1 && opt.hot_access >= 0 &&
+               opt.hot_access <= 1 && opt.clusters >= 1;
+    }
+    else if (strncmp(arg, "shifting", 8) == 0)
+    {
+        opt.dist = GEN_SHIFTING;
+        if (arg[8] == ':')
+        {
+            int n = sscanf(arg + 9, "%lf:%lf", &a, &b);
+            if (n < 1)
+                return false;
+            opt.window = a / 100;
+            if (n == 2)
+                opt.phases = (long)b;
+        }
+        else if (arg[8] != '\0')
+            return false;
+        return opt.window > 0 && opt.window <= 1 && opt.phases >= 1;
+    }
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    const char *names[] = {"shuffle", "uniform", "zipf", "sequential", "hotspot", "shifting"};
+    int c;
+    while ((c = getopt(argc, argv, "n:k:d:xm:s:t:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            opt.count = atol(optarg);
+            break;
+        case 'k':
+            opt.keys = atol(optarg);
+            break;
+        case 'd':
+            if (!parse_dist(optarg))
+            {
+                fprintf(stderr, "[ERROR] bad distribution %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'x':
+            opt.scatter = true;
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &opt.percent[0], &opt.percent[1], &opt.percent[2]) != 3 ||
+                opt.percent[0] < 0 || opt.percent[1] < 0 || opt.percent[2] < 0 ||
+                opt.percent[0] + opt.percent[1] + opt.percent[2] != 100)
+            {
+                fprintf(stderr, "[ERROR] lookup, insert and remove percent must add up to 100.\n");
+                return 1;
+            }
+            break;
+        case 's':
+            opt.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            opt.threads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n count] [-k keys] "
+                            "[-d shuffle|uniform|zipf[:theta]|sequential|"
+                            "hotspot[:keys%%:access%%:clusters]|shifting[:window%%:phases]] "
+                            "[-x] [-m lookup%%:insert%%:remove%%] [-s seed] [-t threads] FILE\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "[ERROR] no output file.\n");
+        return 1;
+    }
+    const char *path = argv[optind];
+    if (opt.keys < 0)
+        opt.keys = opt.count;
+    if (opt.count < 0 || opt.keys < 1 ||
+        (unsigned long long)opt.keys > (unsigned long long)numeric_limits<tree_key>::max())
+    {
+        fprintf(stderr, "[ERROR] bad count or key range.\n");
+        return 1;
+    }
+    if (opt.threads < 1)
+        opt.threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool trace = opt.percent[0] + opt.percent[1] + opt.percent[2] > 0;
+
+    double start = bench_now();
+    permute_init();
+    if (opt.dist == GEN_ZIPF)
+        zipf_init();
+    if (opt.dist == GEN_HOTSPOT)
+        hotspot_init();
+    if (!key_file_create(&out, path, opt.count, trace))
+    {
+        fprintf(stderr, "[ERROR] cannot write %s: %s.\n", path, strerror(errno));
+        return 1;
+    }
+
+    vector<pthread_t> tid(opt.threads);
+    for (int i = 1; i < opt.threads; i++)
+        pthread_create(&tid[i], NULL, fill_blocks, NULL);
+    fill_blocks(NULL);
+    for (int i = 1; i < opt.threads; i++)
+        pthread_join(tid[i], NULL);
+    size_t bytes = out.map_size;
+    key_file_close(&out);
+    double elapsed = bench_now() - start;
+
+    printf("%s: %ld %s keys of 1..%ld%s, %.1f MB in %.3f sec, %.1fM keys/sec\n", path,
+           opt.count, names[opt.dist], opt.keys, trace ? " with ops" : "",
+           bytes / 1048576.0, elapsed, opt.count / elapsed / 1e6);
+    return 0;
+}
@@ -0,0 +1,314 @@
+#include "key_file.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits>
+#include <type_traits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************
+ * key files for the benchmark driver
+ ******************/
+
+typedef struct key_file_header_t
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t key_size;
+    uint64_t count;
+    uint32_t op_size;
+} key_file_header;
+
+/**
+ * offset of the ops of a trace of count keys, and the file size
+ */
+static size_t ops_offset(long count)
+{
+    size_t end = KEY_FILE_HEADER + count * sizeof(tree_key);
+    return (end + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+static size_t file_size(long count, bool with_ops)
+{
+    if (with_ops)
+        return ops_offset(count) + count;
+    return KEY_FILE_HEADER + count * sizeof(tree_key);
+}
+
+static void clear(key_file *file)
+{
+    file->keys = NULL;
+    file->ops = NULL;
+    file->count = 0;
+    file->map = NULL;
+    file->map_size = 0;
+    file->parsed = NULL;
+    file->out_keys = NULL;
+    file->out_ops = NULL;
+}
+
+/**
+ * a stretch of whole lines of a text file and the keys parsed from it
+ */
+typedef struct text_chunk_t
+{
+    const char *begin, *end;
+    tree_key *out; // room for one key per line
+    long lines;
+    long count;
+} text_chunk;
+
+static long count_lines(const char *begin, const char *end)
+{
+    long lines = 0;
+    for (const char *p = begin; p < end; p++)
+    {
+        p = (const char *)memchr(p, '\n', end - p);
+        if (p == NULL)
+            return lines + 1; // the last line has no newline
+        lines++;
+    }
+    return lines;
+}
+
+static void *count_chunk(void *arg)
+{
+    text_chunk *chunk = (text_chunk *)arg;
+    chunk->lines = count_lines(chunk->begin, chunk->end);
+    return NULL;
+}
+
+/**
+ * the keys of a chunk, like strtol() on every line did: leading blanks,
+ * an optional +, digits; lines whose number is not positive or does not
+ * fit a key are skipped
+ */
+static void *parse_chunk(void *arg)
+{
+    text_chunk *chunk = (text_chunk *)arg;
+    const unsigned long long max = (unsigned long long)numeric_limits<tree_key>::max();
+    const char *p = chunk->begin;
+    chunk->count = 0;
+    while (p < chunk->end)
+    {
+        while (p < chunk->end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < chunk->end && *p == '+')
+            p++;
+        unsigned long long value = 0;
+        bool fits = true;
+        while (p < chunk->end && *p >= '0' && *p <= '9')
+        {
+            value = value * 10 + (*p++ - '0');
+            fits = fits && value <= max;
+        }
+        if (fits && value > 0)
+            chunk->out[chunk->count++] = (tree_key)value;
+        const char *eol = (const char *)memchr(p, '\n', chunk->end - p);
+        p = eol == NULL ? chunk->end : eol + 1;
+    }
+    return NULL;
+}
+
+/**
+ * run fn on every chunk, one thread each
+ */
+static void run_chunks(vector<text_chunk> &chunks, void *(*fn)(void *))
+{
+    vector<pthread_t> tid(chunks.size());
+    for (size_t i = 1; i < chunks.size(); i++)
+        pthread_create(&tid[i], NULL, fn, &chunks[i]);
+    fn(&chunks[0]);
+    for (size_t i = 1; i < chunks.size(); i++)
+        pthread_join(tid[i], NULL);
+}
+
+/**
+ * parse the mapped text file with threads threads
+ */
+static bool parse_text(key_file *file, int threads)
+{
+    if (!is_integral<tree_key>::value)
+    {
+        errno = EINVAL; // no text form for other keys
+        return false;
+    }
+    const char *text = (const char *)file->map;
+    const char *end = text + file->map_size;
+
+    // cut at the newline after every even share
+    vector<text_chunk> chunks;
+    const char *begin = text;
+    for (int i = 1; i <= threads && begin < end; i++)
+    {
+        const char *cut = i == threads ? end : text + file->map_size * i / threads;
+        if (cut < begin)
+            cut = begin;
+        const char *eol = (const char *)memchr(cut, '\n', end - cut);
+        cut = eol == NULL ? end : eol + 1;
+        text_chunk chunk;
+        chunk.begin = begin;
+        chunk.end = cut;
+        chunks.push_back(chunk);
+        begin = cut;
+    }
+    if (chunks.empty())
+    {
+        file->count = 0;
+        return true;
+    }
+
+    run_chunks(chunks, count_chunk);
+    long lines = 0;
+    for (auto &chunk : chunks)
+        lines += chunk.lines;
+    file->parsed = new tree_key[lines > 0 ? lines : 1];
+    lines = 0;
+    for (auto &chunk : chunks)
+    {
+        chunk.out = file->parsed + lines;
+        lines += chunk.lines;
+    }
+    run_chunks(chunks, parse_chunk);
+
+    // close the gaps of skipped lines
+    long count = 0;
+    for (auto &chunk : chunks)
+    {
+        if (chunk.out != file->parsed + count)
+            memmove(file->parsed + count, chunk.out, chunk.count * sizeof(tree_key));
+        count += chunk.count;
+    }
+    file->count = count;
+    file->keys = file->parsed;
+    return true;
+}
+
+/**
+ * map the key file at path, parsing it with threads threads if it is
+ * text; false with errno set if it cannot be read
+ */
+bool key_file_open(key_file *file, const char *path, int threads)
+{
+    clear(file);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    file->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (file->map == MAP_FAILED)
+    {
+        file->map = NULL;
+        return false;
+    }
+    file->map_size = st.st_size;
+
+    key_file_header *header = (key_file_header *)file->map;
+    if (file->map_size < KEY_FILE_HEADER || header->magic != KEY_FILE_MAGIC)
+    {
+        // read once from start to end
+        madvise(file->map, file->map_size, MADV_SEQUENTIAL);
+        if (threads < 1)
+            threads = 1;
+        bool parsed = parse_text(file, threads);
+        // the keys are copied out, the text is no longer needed
+        int saved_errno = errno;
+        munmap(file->map, file->map_size);
+        file->map = NULL;
+        file->map_size = 0;
+        errno = saved_errno;
+        return parsed;
+    }
+
+    if (header->version != KEY_FILE_VERSION || header->key_size != sizeof(tree_key) ||
+        header->op_size > 1 ||
+        header->count > (file->map_size - KEY_FILE_HEADER) / sizeof(tree_key) ||
+        file_size(header->count, header->op_size == 1) > file->map_size)
+    {
+        key_file_close(file);
+        errno = EINVAL;
+        return false;
+    }
+    file->keys = (const tree_key *)((char *)file->map + KEY_FILE_HEADER);
+    file->count = (long)header->count;
+    if (header->op_size == 1)
+    {
+        file->ops = (const uint8_t *)file->map + ops_offset(file->count);
+        for (long i = 0; i < file->count; i++)
+        {
+            if (file->ops[i] >= KEY_OP_KINDS)
+            {
+                key_file_close(file);
+                errno = EINVAL;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * create a binary key file of count keys at path, with an op for each
+ * if with_ops, and map it for out_keys and out_ops to be filled in
+ * false with errno set if it cannot be written
+ */
+bool key_file_create(key_file *file, const char *path, long count, bool with_ops)
+{
+    clear(file);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    size_t size = file_size(count, with_ops);
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    file->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED)
+    {
+        file->map = NULL;
+        return false;
+    }
+    file->map_size = size;
+
+    key_file_header *header = (key_file_header *)file->map;
+    header->magic = KEY_FILE_MAGIC;
+    header->version = KEY_FILE_VERSION;
+    header->key_size = sizeof(tree_key);
+    header->count = count;
+    header->op_size = with_ops ? 1 : 0;
+    file->out_keys = (tree_key *)((char *)file->map + KEY_FILE_HEADER);
+    file->keys = file->out_keys;
+    file->count = count;
+    if (with_ops)
+    {
+        file->out_ops = (uint8_t *)file->map + ops_offset(count);
+        file->ops = file->out_ops;
+    }
+    return true;
+}
+
+void key_file_close(key_file *file)
+{
+    if (file->map != NULL)
+        munmap(file->map, file->map_size);
+    delete[] file->parsed;
+    clear(file);
+}
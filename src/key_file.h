@@ -0,0 +1,56 @@
+#ifndef KEY_FILE_H
+#define KEY_FILE_H
+
+#include "tree.h"
+
+/**
+ * key files for the benchmark driver
+ *
+ * A binary key file is a header of one cache line followed by the keys
+ * as they are in memory, in native byte order:
+ *
+ *   uint64_t magic      KEY_FILE_MAGIC
+ *   uint32_t version    KEY_FILE_VERSION
+ *   uint32_t key_size   sizeof(tree_key)
+ *   uint64_t count      keys after the header
+ *   uint32_t op_size    1 for an operation trace, 0 for keys only
+ *   zeros up to 64 bytes
+ *
+ * An operation trace has one KEY_OP_ byte per key after the keys, from
+ * the next cache line on; a reader that only wants keys ignores them.
+ * key_file_open() reads them all once and turns the file down if one
+ * is not a KEY_OP_ kind.
+ *
+ * key_file_open() maps such a file and hands out the keys in the
+ * mapping, so billions of keys cost no copy and only the pages the
+ * threads touch are read. Any other file is read as text, one positive
+ * integer per line, other lines skipped, and parsed by a number of
+ * threads, each on its own stretch of lines.
+ */
+
+#define KEY_FILE_MAGIC 0x315359454b425254UL // "TRBKEYS1"
+#define KEY_FILE_VERSION 1
+#define KEY_FILE_HEADER 64
+
+#define KEY_OP_LOOKUP 0
+#define KEY_OP_INSERT 1
+#define KEY_OP_REMOVE 2
+#define KEY_OP_KINDS 3 // a trace with any other op byte is not opened
+
+typedef struct key_file_t
+{
+    const tree_key *keys; // in file order
+    const uint8_t *ops;   // KEY_OP_ of every key, NULL if not a trace
+    long count;
+    void *map;      // the whole file
+    size_t map_size;
+    tree_key *parsed; // the keys of a text file, NULL for a binary one
+    tree_key *out_keys; // key_file_create(): fill these in
+    uint8_t *out_ops;
+} key_file;
+
+bool key_file_open(key_file *file, const char *path, int threads);
+bool key_file_create(key_file *file, const char *path, long count, bool with_ops);
+void key_file_close(key_file *file);
+
+#endif
@@ -10,16 +10,16 @@
  ******************/
 
 /* thread-local variables */
-thread_local vector<tree_node *> nodes_own_flag;
-thread_local long thread_index;
+thread_local tree_context thread_context;
+thread_local tree_context *current_context = &thread_context;
 
 /**
- * cannot find a 'extern' way to use thread_local variables
- * across files
+ * set the marker index of the calling thread for the free functions,
+ * every thread working on the same tree needs a different one
  */
 void thread_index_init(long i)
 {
-    thread_index = i;
+    thread_context.index = i;
 }
 
 /**
@@ -27,15 +27,15 @@ void thread_index_init(long i)
  */
 void clear_local_area(void)
 {   
-    if (nodes_own_flag.size() == 0) return;
+    if (current_context->own_flag.size == 0) return;
     dbg_printf("[Flag] Clear\n");
-    for (auto node : nodes_own_flag)
+    for (auto node : current_context->own_flag)
     {
-        node->flag = false;
+        release_flag(node);
         dbg_printf("[Flag]      %d, 0x%lx, %d\n",
-                   node->value, (unsigned long)node, (int)node->flag);
+                   node->key, (unsigned long)node, (int)has_flag(node));
     }
-    nodes_own_flag.clear();
+    current_context->own_flag.clear();
 }
 
 /**
@@ -43,30 +43,107 @@ void clear_local_area(void)
  */
 bool is_in_local_area(tree_node *target_node)
 {
-    for (auto node : nodes_own_flag)
-    {
-        if (node == target_node) return true;        
-    }
-    
-    return false;
+    return current_context->own_flag.contains(target_node);
+}
+
+/**
+ * the fixup lock of a tree
+ *
+ * A fixup that moves up the tree, or that takes nodes next to its local
+ * area, waits for flags while it holds others. Two of them could wait
+ * for each other, so only the holder of this lock does that; any other
+ * update takes the lock when it is free, or gives back what it holds and
+ * comes again with the lock, see insert_from() and rb_remove(). Updates
+ * that move up are not lock-free any more: they run one at a time. The
+ * lock is the flag of a spare dummy right of the topmost one, where no
+ * walk ever goes.
+ */
+static tree_node *fixup_lock_node(tree_node *root)
+{
+    tree_node *top = root;
+    while (top->parent != NULL)
+        top = top->parent;
+    return top->right_child;
+}
+
+/**
+ * wait for the fixup lock of the tree, holding no flag and no marker
+ */
+void fixup_lock(tree_node *root)
+{
+    unsigned int failures = 0;
+    while (!try_flag(fixup_lock_node(root)))
+        contention_wait(&failures);
+    current_context->fixup_lock = true;
+    RB_STAT(STAT_FIXUP_LOCK);
+}
+
+/**
+ * take the fixup lock if it is free, without waiting
+ * an update may do this while it holds its local area: it takes over
+ * the lock as if it had come with it, and nobody waits for it meanwhile
+ */
+bool fixup_try_lock(tree_node *root)
+{
+    if (!try_flag(fixup_lock_node(root)))
+        return false;
+    current_context->fixup_lock = true;
+    RB_STAT(STAT_FIXUP_LOCK);
+    return true;
+}
+
+/**
+ * give back the fixup lock if we hold it
+ */
+void fixup_unlock(tree_node *root)
+{
+    if (!current_context->fixup_lock)
+        return;
+    current_context->fixup_lock = false;
+    release_flag(fixup_lock_node(root));
 }
 
 /**
  * return true if the node has no other's marker
  * 
- * z - the node returned by par_find()
+ * z, the node returned by par_find(), is not spared: a remove that
+ * holds it must not take it over from an update below it either
  */
-bool has_no_others_marker(tree_node *t, tree_node *z,
-                                int TID_to_ignore)
+bool has_no_others_marker(tree_node *t, int TID_to_ignore)
 {
-    // We hold flags on both t and z.
+    // We hold the flag of t.
     // check that t has no marker set
-    if (t != z && t->marker != DEFAULT_MARKER && t->marker != TID_to_ignore) 
+    if (get_marker(t) != DEFAULT_MARKER && get_marker(t) != TID_to_ignore) 
+    {
+        RB_STAT(STAT_MARKER_CONFLICTS);
         return false;
+    }
     
     return true;
 }
 
+/**
+ * true if none of the nodes of a local area we hold the flags of has
+ * another thread's marker, a NULL node is skipped
+ *
+ * Markers keep four nodes between the local areas of two threads, and
+ * a node with a marker is never removed, so its thread can take the
+ * marker off without a flag, see release_setup_markers(). An area set
+ * up within another's markers would break both.
+ */
+static bool area_has_no_others_marker(tree_node *a, tree_node *b, tree_node *c,
+                                      tree_node *d = NULL, tree_node *e = NULL,
+                                      tree_node *f = NULL)
+{
+    tree_node *area[] = {a, b, c, d, e, f};
+    for (auto node : area)
+    {
+        if (node != NULL && !has_no_others_marker(node, current_context->index))
+            return false;
+    }
+    return true;
+}
+
 /**
  * try to get four markers above by getting flags first
  * 
@@ -75,229 +152,224 @@ bool has_no_others_marker(tree_node *t, tree_node *z,
  */
 bool get_markers_above(tree_node *start, tree_node *z, bool release)
 {
-    bool expect;
 
     // Now get marker(s) above
     tree_node *pos1, *pos2, *pos3, *pos4;
 
-    pos1 = start->parent;
+    pos1 = reclaim_protect(HP_MARKER_1, &start->parent);
     if (pos1 != z)
     {
-        expect = false;
-        if (!pos1->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(pos1))
             return false;
     }
     
     if ((pos1 != start->parent) 
-        || (!has_no_others_marker(pos1, z, thread_index)))
+        || (!has_no_others_marker(pos1, current_context->index)))
     {
         if (pos1 != z) 
-            pos1->flag = false;
+            release_flag(pos1);
         return false;
     }
 
-    pos2 = pos1->parent;
+    pos2 = reclaim_protect(HP_MARKER_2, &pos1->parent);
     if (pos2 != z)
     {
-        expect = false;
-        if (!pos2->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(pos2))
         {
             if (pos1 != z)
-                pos1->flag = false;
+                release_flag(pos1);
             return false;
         }
     }
 
     if ((pos2 != pos1->parent) 
-        || (!has_no_others_marker(pos2, z, thread_index)))
+        || (!has_no_others_marker(pos2, current_context->index)))
     {
         if (pos1 != z)
-            pos1->flag = false;
+            release_flag(pos1);
         if (pos2 != z)
-            pos2->flag = false;
+            release_flag(pos2);
         return false;
     }
 
-    pos3 = pos2->parent;
+    pos3 = reclaim_protect(HP_MARKER_3, &pos2->parent);
     if (pos3 != z)
     {
-        expect = false;
-        if (!pos3->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(pos3))
         {
             if (pos1 != z)
-                pos1->flag = false;
+                release_flag(pos1);
             if (pos2 != z)
-                pos2->flag = false;
+                release_flag(pos2);
             return false;
         }
     }
 
     if ((pos3 != pos2->parent) 
-        || (!has_no_others_marker(pos3, z, thread_index)))
+        || (!has_no_others_marker(pos3, current_context->index)))
     {
         if (pos1 != z)
-            pos1->flag = false;
+            release_flag(pos1);
         if (pos2 != z)
-            pos2->flag = false;
+            release_flag(pos2);
         if (pos3 != z)
-            pos3->flag = false;
+            release_flag(pos3);
         return false;
     }
 
-    pos4 = pos3->parent;
+    pos4 = reclaim_protect(HP_MARKER_4, &pos3->parent);
     if (pos4 != z)
     {
-        expect = false;
-        if (!pos4->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(pos4))
         {
             if (pos1 != z)
-                pos1->flag = false;
+                release_flag(pos1);
             if (pos2 != z)
-                pos2->flag = false;
+                release_flag(pos2);
             if (pos3 != z)
-                pos3->flag = false;
+                release_flag(pos3);
             return false;
         }
     }
     
     if ((pos4 != pos3->parent) 
-        || (!has_no_others_marker(pos4, z, thread_index)))
+        || (!has_no_others_marker(pos4, current_context->index)))
     {
         if (pos1 != z)
-            pos1->flag = false;
+            release_flag(pos1);
         if (pos2 != z)
-            pos2->flag = false;
+            release_flag(pos2);
         if (pos3 != z)
-            pos3->flag = false;
+            release_flag(pos3);
         if (pos4 != z)
-            pos4->flag = false;
+            release_flag(pos4);
         return false;
     }
 
     // successfully get the four markers
-    pos1->marker = thread_index;
-    pos2->marker = thread_index;
-    pos3->marker = thread_index;
-    pos4->marker = thread_index;
+    set_marker(pos1, current_context->index);
+    set_marker(pos2, current_context->index);
+    set_marker(pos3, current_context->index);
+    set_marker(pos4, current_context->index);
+    current_context->marker[0] = pos1;
+    current_context->marker[1] = pos2;
+    current_context->marker[2] = pos3;
+    current_context->marker[3] = pos4;
 
     if (release)
     {
         if (pos1 != z)
-            pos1->flag = false;
+            release_flag(pos1);
         if (pos2 != z)
-            pos2->flag = false;
+            release_flag(pos2);
         if (pos3 != z)
-            pos3->flag = false;
+            release_flag(pos3);
         if (pos4 != z)
-            pos4->flag = false;
+            release_flag(pos4);
     }
 
     dbg_printf("[Flag] get for marker: %d %d %d %d\n",
-               pos1->value, pos2->value, pos3->value, pos4->value);
+               pos1->key, pos2->key, pos3->key, pos4->key);
 
     return true;
 }
 
 /**
  * @params
- *  z: target node (replace value)
+ *  z: target node (replace key)
  *  y: actually delete node
  */
 bool setup_local_area_for_delete(tree_node *y, tree_node *z)
 {
-    bool expect;
     // the replace child, the actual target node
     tree_node *x = y->left_child;
-    if (y->left_child->is_leaf)
+    if (is_leaf(y->left_child))
         x = y->right_child;
     
-    expect = false;
     // Try to get flags for the rest of the local area
-    if (!x->flag.compare_exchange_weak(expect, true)) return false;
+    if (!try_flag(x)) return false;
     
     tree_node *yp = y->parent; // keep a copy of our parent pointer
-    expect = false;
-    if ((yp != z) && (!yp->flag.compare_exchange_weak(expect, true)))
+    if ((yp != z) && (!try_flag(yp)))
     {
-        x->flag = false;
+        release_flag(x);
         return false;
     }
     if (yp != y->parent) // verify that parent is unchanged
     {  
-        x->flag = false; 
-        if (yp!=z) yp->flag = false;
+        release_flag(x); 
+        if (yp!=z) release_flag(yp);
         return false;
     }
     tree_node *w = y->parent->left_child;
     if (is_left(y))
         w = y->parent->right_child;
     
-    expect = false;
-    if (!w->flag.compare_exchange_weak(expect, true))
+    if (!try_flag(w))
     {
-        x->flag = false;
+        release_flag(x);
         if (yp != z)
-            yp->flag = false;
+            release_flag(yp);
         return false;
     }
 
-    tree_node *wlc, *wrc;
-    if (!w->is_leaf)
+    tree_node *wlc = NULL, *wrc = NULL;
+    if (!is_leaf(w))
     {
         wlc = w->left_child;
         wrc = w->right_child;
 
-        expect = false;
-        if (!wlc->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(wlc))
         {
-            x->flag = false;
-            w->flag = false;
+            release_flag(x);
+            release_flag(w);
             if (yp != z)
-                yp->flag = false;
+                release_flag(yp);
             return false;
         }
-        expect = false;
-        if (!wrc->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(wrc))
         {
-            x->flag = false;
-            w->flag = false;
-            wlc->flag = false;
+            release_flag(x);
+            release_flag(w);
+            release_flag(wlc);
             if (yp != z)
-                yp->flag = false;
+                release_flag(yp);
             return false;
         }
     }
 
-    // get four markers above to keep distance with other threads
-    if (!get_markers_above(yp, z, true))
+    // get four markers above to keep distance with other threads, the
+    // local area itself must not be within another thread's markers
+    if (!area_has_no_others_marker(y, x, yp, w, wlc, wrc) ||
+        !get_markers_above(yp, z, true))
     {
-        x->flag = false;
-        w->flag = false;
-        if (!w->is_leaf)
+        release_flag(x);
+        release_flag(w);
+        if (!is_leaf(w))
         {
-            wlc->flag = false;
-            wrc->flag = false;
+            release_flag(wlc);
+            release_flag(wrc);
         }
         if (yp != z)
-            yp->flag = false;
+            release_flag(yp);
         return false;
     }
 
     // local area setup
-    nodes_own_flag.push_back(x);
-    nodes_own_flag.push_back(w);
-    nodes_own_flag.push_back(yp);
-    if (!w->is_leaf)
+    current_context->own_flag.push_back(x);
+    current_context->own_flag.push_back(w);
+    current_context->own_flag.push_back(yp);
+    if (!is_leaf(w))
     {
-        nodes_own_flag.push_back(wlc);
-        nodes_own_flag.push_back(wrc);
+        current_context->own_flag.push_back(wlc);
+        current_context->own_flag.push_back(wrc);
         dbg_printf("[Flag] local area: %d %d %d %d %d\n",
-                   x->value, w->value, yp->value, wlc->value, wrc->value);
+                   x->key, w->key, yp->key, wlc->key, wrc->key);
     }
     else
     {
         dbg_printf("[Flag] local area: %d %d %d\n",
-                   x->value, w->value, yp->value);
+                   x->key, w->key, yp->key);
     }
 
     return true;
@@ -321,7 +393,6 @@ bool get_flags_and_markers_above(tree_node *start, int numAdditional)
     if (!get_markers_above(start, NULL, false))
         return false;
 
-    bool expect;
     tree_node *pos1 = start->parent;
     tree_node *pos2 = pos1->parent;
     tree_node *pos3 = pos2->parent;
@@ -331,76 +402,74 @@ bool get_flags_and_markers_above(tree_node *start, int numAdditional)
     //     return false;
 
     // Now get additional marker(s) above
-    tree_node *firstnew = pos4->parent;
-    expect = false;
-    if (!firstnew->flag.compare_exchange_weak(expect, true))
-    {
-        pos1->flag = false;
-        pos2->flag = false;
-        pos3->flag = false;
-        pos4->flag = false;
+    tree_node *firstnew = reclaim_protect(HP_MARKER_5, &pos4->parent);
+    if (!try_flag(firstnew))
+    {
+        release_flag(pos1);
+        release_flag(pos2);
+        release_flag(pos3);
+        release_flag(pos4);
         return false;
     }
 
     if ((firstnew != pos4->parent) 
-        || (!has_no_others_marker(firstnew, start, thread_index)))
+        || (!has_no_others_marker(firstnew, current_context->index)))
     {
-        firstnew->flag = false;
-        pos1->flag = false;
-        pos2->flag = false;
-        pos3->flag = false;
-        pos4->flag = false;
+        release_flag(firstnew);
+        release_flag(pos1);
+        release_flag(pos2);
+        release_flag(pos3);
+        release_flag(pos4);
         return false;
     }
 
     dbg_printf("[Flag] firstnew: %d\n",
-               firstnew->value);
+               firstnew->key);
 
     tree_node *secondnew = NULL;
     if (numAdditional == 2) // insertion so need another marker
     {  
-        secondnew = firstnew->parent;
-        expect = false;
-        if (!secondnew->flag.compare_exchange_weak(expect, true))
+        secondnew = reclaim_protect(HP_MARKER_6, &firstnew->parent);
+        if (!try_flag(secondnew))
         {
-            firstnew->flag = false;
-            pos1->flag = false;
-            pos2->flag = false;
-            pos3->flag = false;
-            pos4->flag = false;
+            release_flag(firstnew);
+            release_flag(pos1);
+            release_flag(pos2);
+            release_flag(pos3);
+            release_flag(pos4);
             return false;
         }
 
         if ((secondnew != firstnew->parent) 
-            || (!has_no_others_marker(secondnew, start, thread_index)))
+            || (!has_no_others_marker(secondnew, current_context->index)))
         {
-            secondnew->flag = false;
-            firstnew->flag = false;
-            pos1->flag = false;
-            pos2->flag = false;
-            pos3->flag = false;
-            pos4->flag = false;
+            release_flag(secondnew);
+            release_flag(firstnew);
+            release_flag(pos1);
+            release_flag(pos2);
+            release_flag(pos3);
+            release_flag(pos4);
             return false;
         }
         dbg_printf("[Flag] second new: %d\n",
-                   secondnew->value);
+                   secondnew->key);
     }
 
-    firstnew->marker = thread_index;
+    set_marker(firstnew, current_context->index);
     if (numAdditional == 2)
-        secondnew->marker = thread_index;
+        set_marker(secondnew, current_context->index);
 
     // release the four topmost flags acquired to extend markers.
     // This leaves flags on nodes now in the new local area.
     if (numAdditional == 2)
-        secondnew->flag = false;
+        release_flag(secondnew);
 
-    firstnew->flag = false;
-    pos4->flag = false;
-    pos3->flag = false;
+    release_flag(firstnew);
+    release_flag(pos4);
+    release_flag(pos3);
 
     if (numAdditional == 1)
-        pos2->flag = false;
+        release_flag(pos2);
     return true;
 }
 
@@ -415,94 +484,107 @@ bool get_flags_and_markers_above(tree_node *start, int numAdditional)
  */
 bool release_markers_above(tree_node *start, tree_node *z)
 {
-    bool expect;
     
     // release 4 marker(s) above start node
     tree_node *pos1, *pos2, *pos3, *pos4;
 
-    pos1 = start->parent;
-    expect = false;
-    if (!pos1->flag.compare_exchange_weak(expect, true))
+    pos1 = reclaim_protect(HP_MARKER_1, &start->parent);
+    if (!try_flag(pos1))
         return false;
     if (pos1 != start->parent) // verify that parent is unchanged
     {  
-        pos1->flag = false;
+        release_flag(pos1);
         return false;
     }
-    pos2 = pos1->parent;
-    expect = false;
-    if (!pos2->flag.compare_exchange_weak(expect, true))
+    pos2 = reclaim_protect(HP_MARKER_2, &pos1->parent);
+    if (!try_flag(pos2))
     {
-        pos1->flag = false;
+        release_flag(pos1);
         return false;
     }
     if (pos2 != pos1->parent) // verify that parent is unchanged
     {
-        pos1->flag = false;
-        pos2->flag = false;
+        release_flag(pos1);
+        release_flag(pos2);
         return false;
     }
-    pos3 = pos2->parent;
-    expect = false;
-    if (!pos3->flag.compare_exchange_weak(expect, true))
+    pos3 = reclaim_protect(HP_MARKER_3, &pos2->parent);
+    if (!try_flag(pos3))
     {
-        pos1->flag = false;
-        pos2->flag = false;
+        release_flag(pos1);
+        release_flag(pos2);
         return false;
     }
     if (pos3 != pos2->parent) // verify that parent is unchanged
     {
-        pos1->flag = false;
-        pos2->flag = false;
-        pos3->flag = false;
+        release_flag(pos1);
+        release_flag(pos2);
+        release_flag(pos3);
         return false;
     }
-    pos4 = pos3->parent;
-    expect = false;
-    if (!pos4->flag.compare_exchange_weak(expect, true))
+    pos4 = reclaim_protect(HP_MARKER_4, &pos3->parent);
+    if (!try_flag(pos4))
     {
-        pos1->flag = false;
-        pos2->flag = false;
-        pos3->flag = false;
+        release_flag(pos1);
+        release_flag(pos2);
+        release_flag(pos3);
         return false;
     }
     if (pos4 != pos3->parent) // verify that parent is unchanged
     {
-        pos1->flag = false;
-        pos2->flag = false;
-        pos3->flag = false;
-        pos4->flag = false;
+        release_flag(pos1);
+        release_flag(pos2);
+        release_flag(pos3);
+        release_flag(pos4);
         return false;
     }
 
     // release these markers
-    if (pos1->marker == thread_index) pos1->marker = DEFAULT_MARKER;
-    if (pos2->marker == thread_index) pos2->marker = DEFAULT_MARKER;
-    if (pos3->marker == thread_index) pos3->marker = DEFAULT_MARKER;
-    if (pos4->marker == thread_index) pos4->marker = DEFAULT_MARKER;
+    if (get_marker(pos1) == current_context->index) set_marker(pos1, DEFAULT_MARKER);
+    if (get_marker(pos2) == current_context->index) set_marker(pos2, DEFAULT_MARKER);
+    if (get_marker(pos3) == current_context->index) set_marker(pos3, DEFAULT_MARKER);
+    if (get_marker(pos4) == current_context->index) set_marker(pos4, DEFAULT_MARKER);
 
     dbg_printf("[Marker] release markers %d %d %d %d\n",
-                pos1->value, pos2->value, pos3->value, pos4->value);
+                pos1->key, pos2->key, pos3->key, pos4->key);
     
     // release flags
-    pos1->flag = false;
-    pos2->flag = false;
-    pos3->flag = false;
-    pos4->flag = false;
+    release_flag(pos1);
+    release_flag(pos2);
+    release_flag(pos3);
+    release_flag(pos4);
 
     return true;
 }
 
+/**
+ * take off the four markers of the last get_markers_above() without
+ * getting any flag
+ * Only the holder of the fixup lock moves its markers up, nobody else's
+ * rotations move a node with a marker, and such a node is not removed
+ * either, so the markers are still where the setup put them. The holder
+ * may be waiting for them to go while it holds the flags of these
+ * nodes, see wait_no_others_marker(), so we must not wait for those.
+ */
+void release_setup_markers(void)
+{
+    for (auto &node : current_context->marker)
+    {
+        if (node != NULL)
+            clear_marker(node, current_context->index);
+        node = NULL;
+    }
+}
+
 /**
  * move a deleter up the tree
- * case 2 in deletion
+ * case 2 in deletion, only with the fixup lock held: the flags of the
+ * new local area are waited for while the old one is held
  */
 tree_node *move_deleter_up(tree_node *oldx)
 {
-    bool expect;
-
     // get direct pointers
-    tree_node *oldp = oldx->parent;
+    tree_node *oldp = get_parent(oldx);
     tree_node *oldw = oldp->left_child;
     if (is_left(oldx))
         oldw = oldp->right_child;
@@ -512,119 +594,171 @@ tree_node *move_deleter_up(tree_node *oldx)
 
     // extend intention markers (getting flags to set them)
     // from oldgp to top and one more. Also convert marker on oldgp to a flag
+    unsigned int failures = 0;
     while (!get_flags_and_markers_above(oldp, 1))
-        ;
+    {
+        RB_STAT(STAT_DELETER_RETRIES);
+        contention_wait(&failures);
+    }
     
     // get flags on the rest of new local area (w, wlc, wrc)
     tree_node *newx = oldp;
     tree_node *newp = newx->parent;
     tree_node *neww, *newwlc, *newwrc;
+    failures = 0;
 
 restart:
     neww = newp->left_child;
     if (is_left(newx))
         neww = newp->right_child;
     
-    expect = false;
-    if (!neww->flag.compare_exchange_weak(expect, true))
+    if (!try_flag(neww))
     {
+        contention_wait(&failures);
+        RB_STAT(STAT_DELETER_RETRIES);
         goto restart;
     }
+    // an update whose markers are on w may still rotate below it
+    wait_no_others_marker(neww);
     
     newwlc = neww->left_child;
     newwrc = neww->right_child;
 
-    expect = false;
-    if (!newwlc->flag.compare_exchange_weak(expect, true))
+    if (!try_flag(newwlc))
     {
-        neww->flag = false;
+        release_flag(neww);
+        contention_wait(&failures);
+        RB_STAT(STAT_DELETER_RETRIES);
         goto restart;
     }
 
-    expect = false;
-    if (!newwrc->flag.compare_exchange_weak(expect, true))
+    if (!try_flag(newwrc))
     {
-        newwlc->flag = false;
-        neww->flag = false;
+        release_flag(newwlc);
+        release_flag(neww);
+        contention_wait(&failures);
+        RB_STAT(STAT_DELETER_RETRIES);
         goto restart;
     }
+    wait_no_others_marker(newwlc);
+    wait_no_others_marker(newwrc);
 
     // release flags on old local area
-    oldx->flag = false;
-    oldw->flag = false;
-    oldwlc->flag = false;
-    oldwrc->flag = false;
+    release_flag(oldx);
+    release_flag(oldw);
+    release_flag(oldwlc);
+    release_flag(oldwrc);
 
     dbg_printf("[Flag] release old local area: %d %d %d %d\n",
-                oldx->value, oldw->value, oldwlc->value, oldwrc->value);
+                oldx->key, oldw->key, oldwlc->key, oldwrc->key);
 
-    // clear marker
-    newx->parent->marker = DEFAULT_MARKER;
+    // clear our marker on newp, it is in the local area now
+    if (get_marker(newp) == current_context->index)
+        set_marker(newp, DEFAULT_MARKER);
 
     // new local area
-    nodes_own_flag.clear();
-    nodes_own_flag.push_back(newx);
-    nodes_own_flag.push_back(neww);
-    nodes_own_flag.push_back(newp);
-    nodes_own_flag.push_back(newwlc);
-    nodes_own_flag.push_back(newwrc);
+    current_context->own_flag.clear();
+    current_context->own_flag.push_back(newx);
+    current_context->own_flag.push_back(neww);
+    current_context->own_flag.push_back(newp);
+    current_context->own_flag.push_back(newwlc);
+    current_context->own_flag.push_back(newwrc);
     dbg_printf("[Flag] get new local area: %d %d %d %d %d\n",
-               newx->value, neww->value, newp->value, 
-               newwlc->value, newwrc->value);
+               newx->key, neww->key, newp->key, 
+               newwlc->key, newwrc->key);
+    RB_STAT(STAT_REMOVE_MOVE_UP);
     return newx;
 }
 
 
+/**
+ * try to get the flags of the nodes a delete case 1 or case 3 rotation
+ * brings into the local area, second may be NULL
+ * called before the case changes anything, so on failure the flags are
+ * given back and the case can be tried again. Only the holder of the
+ * fixup lock gets here, see rb_remove().
+ */
+bool get_fix_up_flags(tree_node *first, tree_node *second)
+{
+    if (!try_flag(first))
+        return false;
+    if (second != NULL && !try_flag(second))
+    {
+        release_flag(first);
+        return false;
+    }
+    wait_no_others_marker(first);
+    if (second != NULL)
+        wait_no_others_marker(second);
+    return true;
+}
+
+/**
+ * wait until a node we hold the flag of has no other thread's marker
+ * The holder of the fixup lock takes nodes into its local area that no
+ * setup has checked. A marker on one is that of an update without the
+ * lock, which never waits and takes its markers off when it is done;
+ * rotating the node before that would leave a gap in them.
+ */
+void wait_no_others_marker(tree_node *node)
+{
+    unsigned int failures = 0;
+    while (!has_no_others_marker(node, current_context->index))
+        contention_wait(&failures);
+    // see the other update's rotation below the node
+    atomic_thread_fence(memory_order_acquire);
+}
+
 /**
  * fix the side effect of delete case 1
- * 1. adjust the local area of the process that has done the rotation
- * 2. move any relocated markers from other processes to where 
- *    they belong after the rotation 
- *    --> clear all the 'naughty' markers within old local area
+ * Only the holder of the fixup lock rotates here, and it waited until
+ * the nodes it took had no marker of another update, so no marker but
+ * its own has to move.
+ * 1. the old w went up above x's parent and out of the local area, it
+ *    becomes our lowest marker and its flag goes, with the flag of its
+ *    old right child
+ * 2. the markers are one level lower now, so the topmost one is let go
+ * 3. the new local area is x, its parent, the new w and its children
  */
 void fix_up_case1(tree_node *x, tree_node *w)
 {
-    tree_node *oldw = x->parent->parent;
-    tree_node *oldwlc = x->parent->right_child;
+    tree_node *oldw = get_parent(x)->parent;
     tree_node *oldwrc = oldw->right_child;
 
-    // clear markers
-    if (oldw->marker != DEFAULT_MARKER && oldw->marker == oldwlc->marker)
-    {
-        x->parent->marker = oldw->marker;
-    }
-
-    // set w's marker before releasing its flag
-    oldw->marker = thread_index;
-    oldw->flag = false;
-    oldwrc->flag = false;
-    dbg_printf("[Flag] release %d %d\n", oldw->value, oldwrc->value);
+    // set w's marker before releasing its flag, nobody else has one
+    // in the local area, see wait_no_others_marker()
+    set_marker(oldw, current_context->index);
+    release_flag(oldw);
+    release_flag(oldwrc);
+    dbg_printf("[Flag] release %d %d\n", oldw->key, oldwrc->key);
 
     // release the fifth marker
-    oldw->parent->parent->parent->parent->marker = DEFAULT_MARKER;
+    tree_node *fifth = oldw->parent->parent->parent->parent;
+    if (get_marker(fifth) == current_context->index)
+        set_marker(fifth, DEFAULT_MARKER);
 
-    // get the flag of the new wlc & wrc
-    // this will always be valid because of markers
-    // which means others may hold markers on them, but no flags on them
-    w->left_child->flag = true;
-    w->right_child->flag = true;
+    // the flags of the new wlc & wrc were taken before the rotation,
+    // see get_fix_up_flags()
     dbg_printf("[Flag] get new %d %d\n", 
-                w->left_child->value, w->right_child->value);
+                w->left_child->key, w->right_child->key);
 
     // new local area
-    nodes_own_flag.clear();
-    nodes_own_flag.push_back(x);
-    nodes_own_flag.push_back(x->parent);
-    nodes_own_flag.push_back(w);
-    nodes_own_flag.push_back(w->left_child);
-    nodes_own_flag.push_back(w->right_child);
+    current_context->own_flag.clear();
+    current_context->own_flag.push_back(x);
+    current_context->own_flag.push_back(get_parent(x));
+    current_context->own_flag.push_back(w);
+    current_context->own_flag.push_back(w->left_child);
+    current_context->own_flag.push_back(w->right_child);
 }
 
 /**
  * fix the side effect of delete case 3
- * 1. adjust the local area of the process that has done the rotation
- * 2. move any relocated markers from other processes to where 
- *    they belong after the rotation
+ * The rotation stays within the local area, and the holder of the
+ * fixup lock made sure no other update has a marker in it.
+ * 1. clear our markers within the old local area
+ * 2. the old w's right child left the local area, release its flag
+ * 3. the new local area is x, its parent, the new w, its left child and
+ *    the old w
  * layout:
  *    2
  * 1     3
@@ -637,75 +771,73 @@ void fix_up_case3(tree_node *x, tree_node *w)
     tree_node *oldwrc = oldw->right_child;
 
     // clear all the markers within old local area
-    for (auto node : nodes_own_flag)
-        node->marker = DEFAULT_MARKER;
-
-    // get the flag of the new wlc & wrc
-    // this will always be valid because of markers
-    // which means others may hold markers on them, but no flags on them
-    w->left_child->flag = true;
-    oldwrc->flag = false;
+    for (auto node : current_context->own_flag)
+        set_marker(node, DEFAULT_MARKER);
+
+    // the flag of the new wlc was taken before the rotation,
+    // see get_fix_up_flags()
+    release_flag(oldwrc);
     dbg_printf("[Flag] release %d, get %d\n", 
-                oldwrc->value, w->left_child->value);
+                oldwrc->key, w->left_child->key);
 
     // new local area
-    nodes_own_flag.clear();
-    nodes_own_flag.push_back(x);
-    nodes_own_flag.push_back(x->parent);
-    nodes_own_flag.push_back(w);
-    nodes_own_flag.push_back(w->left_child);
-    nodes_own_flag.push_back(oldw);
+    current_context->own_flag.clear();
+    current_context->own_flag.push_back(x);
+    current_context->own_flag.push_back(get_parent(x));
+    current_context->own_flag.push_back(w);
+    current_context->own_flag.push_back(w->left_child);
+    current_context->own_flag.push_back(oldw);
 }
 
 /**
  * fix the side effect of delete case 1 - mirror case
- * 1. adjust the local area of the process that has done the rotation
- * 2. move any relocated markers from other processes to where 
- *    they belong after the rotation 
- *    --> clear all the 'naughty' markers within old local area
+ * Only the holder of the fixup lock rotates here, and it waited until
+ * the nodes it took had no marker of another update, so no marker but
+ * its own has to move.
+ * 1. the old w went up above x's parent and out of the local area, it
+ *    becomes our lowest marker and its flag goes, with the flag of its
+ *    old left child
+ * 2. the markers are one level lower now, so the topmost one is let go
+ * 3. the new local area is x, its parent, the new w and its children
  */
 void fix_up_case1_r(tree_node *x, tree_node *w)
 {
-    tree_node *oldw = x->parent->parent;
+    tree_node *oldw = get_parent(x)->parent;
     tree_node *oldwlc = oldw->left_child;
-    tree_node *oldwrc = x->parent->left_child;
 
-    // clear markers
-    if (oldw->marker != DEFAULT_MARKER && oldw->marker == oldwrc->marker)
-    {
-        x->parent->marker = oldw->marker;
-    }
-
-    // set w's marker before releasing its flag
-    oldw->marker = thread_index;
-    oldw->flag = false;
-    oldwlc->flag = false;
+    // set w's marker before releasing its flag, nobody else has one
+    // in the local area, see wait_no_others_marker()
+    set_marker(oldw, current_context->index);
+    release_flag(oldw);
+    release_flag(oldwlc);
     dbg_printf("[Flag] release %d %d\n",
-               oldw->value, oldwlc->value);
+               oldw->key, oldwlc->key);
     // release the fifth marker
-    oldw->parent->parent->parent->parent->marker = DEFAULT_MARKER;
+    tree_node *fifth = oldw->parent->parent->parent->parent;
+    if (get_marker(fifth) == current_context->index)
+        set_marker(fifth, DEFAULT_MARKER);
 
-    // get the flag of the new wlc & wrc
-    // this will always be valid because of markers
-    // which means others may hold markers on them, but no flags on them
-    w->left_child->flag = true;
-    w->right_child->flag = true;
+    // the flags of the new wlc & wrc were taken before the rotation,
+    // see get_fix_up_flags()
     dbg_printf("[Flag] get new %d %d\n",
-               w->left_child->value, w->right_child->value);
+               w->left_child->key, w->right_child->key);
     // new local area
-    nodes_own_flag.clear();
-    nodes_own_flag.push_back(x);
-    nodes_own_flag.push_back(x->parent);
-    nodes_own_flag.push_back(w);
-    nodes_own_flag.push_back(w->left_child);
-    nodes_own_flag.push_back(w->right_child);
+    current_context->own_flag.clear();
+    current_context->own_flag.push_back(x);
+    current_context->own_flag.push_back(get_parent(x));
+    current_context->own_flag.push_back(w);
+    current_context->own_flag.push_back(w->left_child);
+    current_context->own_flag.push_back(w->right_child);
 }
 
 /**
  * fix the side effect of delete case 3 - mirror case
- * 1. adjust the local area of the process that has done the rotation
- * 2. move any relocated markers from other processes to where 
- *    they belong after the rotation
+ * The rotation stays within the local area, and the holder of the
+ * fixup lock made sure no other update has a marker in it.
+ * 1. clear our markers within the old local area
+ * 2. the old w's left child left the local area, release its flag
+ * 3. the new local area is x, its parent, the new w, its right child and
+ *    the old w
  */
 void fix_up_case3_r(tree_node *x, tree_node *w)
 {
@@ -713,23 +845,21 @@ void fix_up_case3_r(tree_node *x, tree_node *w)
     tree_node *oldwlc = oldw->left_child;
 
     // clear all the markers within old local area
-    for (auto node : nodes_own_flag)
-        node->marker = DEFAULT_MARKER;
-
-    // get the flag of the new wlc & wrc
-    // this will always be valid because of markers
-    // which means others may hold markers on them, but no flags on them
-    w->right_child->flag = true;
-    oldwlc->flag = false;
+    for (auto node : current_context->own_flag)
+        set_marker(node, DEFAULT_MARKER);
+
+    // the flag of the new wrc was taken before the rotation,
+    // see get_fix_up_flags()
+    release_flag(oldwlc);
     dbg_printf("[Flag] release %d, get %d\n",
-               oldwlc->value, w->right_child->value);
+               oldwlc->key, w->right_child->key);
     // new local area
-    nodes_own_flag.clear();
-    nodes_own_flag.push_back(x);
-    nodes_own_flag.push_back(x->parent);
-    nodes_own_flag.push_back(w);
-    nodes_own_flag.push_back(oldw);
-    nodes_own_flag.push_back(w->right_child);
+    current_context->own_flag.clear();
+    current_context->own_flag.push_back(x);
+    current_context->own_flag.push_back(get_parent(x));
+    current_context->own_flag.push_back(w);
+    current_context->own_flag.push_back(oldw);
+    current_context->own_flag.push_back(w->right_child);
 }
 
 /************************ insert ************************/
@@ -744,8 +874,7 @@ bool setup_local_area_for_insert(tree_node *x)
     if (parent == NULL)
         return true;
 
-    bool expected = false;
-    if (!parent->flag.compare_exchange_weak(expected, true))
+    if (!try_flag(parent))
     {
         dbg_printf("[FLAG] failed getting flag of 0x%lx\n", 
                    (unsigned long)parent);
@@ -760,7 +889,7 @@ bool setup_local_area_for_insert(tree_node *x)
         dbg_printf("[FLAG] parent changed from %lu to 0x%lx\n", 
                    (unsigned long)parent, (unsigned long)parent);
         dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)parent);
-        parent->flag = false;
+        release_flag(parent);
         return false;
     }
 
@@ -773,135 +902,234 @@ bool setup_local_area_for_insert(tree_node *x)
         uncle = x->parent->left_child;
     }
 
-    expected = false;
-    if (!uncle->flag.compare_exchange_weak(expected, true))
+    if (!try_flag(uncle))
     {
         dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)uncle);
-        dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)x->parent);
-        x->parent->flag = false;
+        dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)get_parent(x));
+        release_flag(x->parent);
         return false;
     }
 
     dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)uncle);
 
+    // get four markers above like a delete does, so that no other
+    // update comes close enough to need our flags or we theirs
+    if (!area_has_no_others_marker(x, parent, uncle) ||
+        !get_markers_above(parent, NULL, true))
+    {
+        release_flag(uncle);
+        release_flag(parent);
+        return false;
+    }
+
     // now the process has the flags of x, x's parent and x's uncle
     return true;
 }
 
 /**
- * Move up the target node
+ * Move up the target node, only with the fixup lock held
+ * The markers above go up by two first, which takes the flags of the
+ * new parent and grandparent, then the new uncle is flagged. The old
+ * local area is held all the while.
  */
-tree_node *move_inserter_up(tree_node *oldx, vector<tree_node *> &local_area)
+tree_node *move_inserter_up(tree_node *oldx, insert_area &local_area)
 {
     tree_node *oldp = oldx->parent;
     tree_node *oldgp = oldp->parent;
 
-    bool expected = false;
-
-    tree_node *newx, *newp = NULL, *newgp = NULL, *newuncle = NULL;
+    tree_node *newx, *newp, *newgp, *newuncle;
+    unsigned int failures = 0;
     newx = oldgp;
-    while (true && newx->parent != NULL)
+    while (!get_flags_and_markers_above(newx, 2))
     {
-        newp = newx->parent;
-        expected = false;
-        if (!newp->flag.compare_exchange_weak(expected, true))
-        {
-            dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)newp);
-            continue;
-        }
-
-        dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)newp);
-
-        newgp = newp->parent;
-        if (newgp == NULL)
-            break;
-        expected = false;
-        if (!newgp->flag.compare_exchange_weak(expected, true))
-        {
-            dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)newgp);
-            dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)newp);
-            newp->flag = false;
-            continue;
-        }
+        RB_STAT(STAT_INSERTER_RETRIES);
+        contention_wait(&failures);
+    }
 
-        dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)newgp);
+    newp = newx->parent;
+    newgp = newp->parent;
+    dbg_printf("[FLAG] get flag of 0x%lx and 0x%lx\n", (unsigned long)newp,
+               (unsigned long)newgp);
 
+    failures = 0;
+    while (true)
+    {
         if (newp == newgp->left_child)
-        {
             newuncle = newgp->right_child;
-        }
         else
-        {
             newuncle = newgp->left_child;
-        }
+        if (try_flag(newuncle))
+            break;
+        dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)newuncle);
+        contention_wait(&failures);
+        RB_STAT(STAT_INSERTER_RETRIES);
+    }
 
-        expected = false;
-        if (!newuncle->flag.compare_exchange_weak(expected, true))
-        {
-            dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)newuncle);
-            dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)newgp);
-            dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)newp);
-            newgp->flag = false;
-            newp->flag = false;
-            continue;
-        }
+    dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)newuncle);
+    wait_no_others_marker(newuncle);
 
-        dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)newuncle);
-
-        // now the process has the flags of newp, newgp and newuncle
-        break;
-    }
+    // the new parent and grandparent are in the local area now
+    if (get_marker(newp) == current_context->index)
+        set_marker(newp, DEFAULT_MARKER);
+    if (get_marker(newgp) == current_context->index)
+        set_marker(newgp, DEFAULT_MARKER);
 
     local_area.push_back(newx);
     local_area.push_back(newp);
     local_area.push_back(newgp);
     local_area.push_back(newuncle);
 
+    RB_STAT(STAT_INSERT_MOVE_UP);
     return newx;
 }
 
 /**
- * find a node by getting flag hand over hand
+ * walk down from the root by getting flag hand over hand, the visitor
+ * picks the way
  * restart when conflict happens
+ * returns the node the visitor stopped at with its flag held, or NULL
+ * with no flag held if the walk ended at a nil
  */
-tree_node *par_find(tree_node *root, int value)
+template <typename Visitor>
+static tree_node *par_walk(tree_node *root, Visitor &visitor)
 {
-    bool expect;
     tree_node *root_node;
+    int y_slot, z_slot, slot;
+    unsigned int failures = 0;
 restart:
-    do {
-        root_node = root->left_child;
-        expect = false;
-    } while (!root_node->flag.compare_exchange_weak(expect, true));
+    while (true)
+    {
+        root_node = reclaim_protect(HP_FIND_NODE, &root->left_child);
+        if (try_flag(root_node))
+            break;
+        contention_wait(&failures);
+    }
+
+    if (root_node != root->left_child)
+    {
+        release_flag(root_node); // rotated away from the root meanwhile
+        RB_STAT(STAT_FIND_RESTARTS);
+        goto restart;
+    }
     
     tree_node *y = root_node;
     tree_node *z = NULL;
+    node_link *link;
+    y_slot = HP_FIND_NODE;
+    z_slot = HP_FIND_PREV;
+    visitor.start();
 
-    while (!y->is_leaf)
+    while (!is_leaf(y))
     {
-        z = y; // store old y
-        if (value == y->value)
-            return y; // find the node y
-        else if (value > y->value)
-            y = y->right_child;
+        z = y; // store old y, its hazard slot goes with it
+        slot = z_slot;
+        z_slot = y_slot;
+        y_slot = slot;
+        walk_step step = visitor.visit(y);
+        if (step == WALK_STOP)
+            return y; // the visitor found its node
+        else if (step == WALK_RIGHT)
+            link = &y->right_child;
         else
-            y = y->left_child;
+            link = &y->left_child;
+        y = reclaim_protect(y_slot, link);
         
-        expect = false;
-        if (!y->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(y))
+        {
+            release_flag(z); // release held flag
+            contention_wait(&failures);
+            RB_STAT(STAT_FIND_RESTARTS);
+            goto restart;
+        }
+
+        // a rotation below z may have moved y away before we got its flag,
+        // then y no longer covers the range we are searching
+        if (y != *link)
         {
-            z->flag = false; // release held flag
-            usleep(100);
+            release_flag(y);
+            release_flag(z);
+            RB_STAT(STAT_FIND_RESTARTS);
             goto restart;
         }
-        if (!y->is_leaf)
-            z->flag = false; // release old y's flag
+        if (!is_leaf(y))
+            release_flag(z); // release old y's flag
     }
     
-    dbg_printf("[WARNING] node with value %d not found.\n", value);
-    return NULL; // node not found
+    // release the flags of the last node and the leaf below it
+    release_flag(y);
+    if (z != NULL)
+        release_flag(z);
+    return NULL;
 }
 
+/**
+ * find a node by getting flag hand over hand
+ * the node is returned with its flag held
+ */
+tree_node *par_find(tree_node *root, tree_key key)
+{
+    find_visitor visitor(key);
+    tree_node *node = par_walk(root, visitor);
+    if (node == NULL)
+        dbg_printf("[WARNING] node with key %d not found.\n", key);
+    return node;
+}
+
+/**
+ * find the smallest key greater than key, or equal to it if inclusive,
+ * by getting flag hand over hand like par_find()
+ * returns false if there is none, no flag is held on return
+ */
+bool par_find_next(tree_node *root, tree_key key, bool inclusive,
+                   tree_key *next RB_VALUE_OUT)
+{
+#ifdef TREE_VALUE
+    next_visitor visitor(key, inclusive, next, value);
+#else
+    next_visitor visitor(key, inclusive, next);
+#endif
+    tree_node *node = par_walk(root, visitor);
+    if (node != NULL)
+        release_flag(node);
+    return visitor.found;
+}
+
+#ifdef RB_ORDER_STATS
+/**
+ * count the keys less than key by getting flag hand over hand like
+ * par_find(), no flag is held on return
+ * the children of a flagged node stay in the tree, so their sizes can
+ * be read without flags
+ */
+long par_rank(tree_node *root, tree_key key)
+{
+    rank_visitor visitor(key);
+    tree_node *node = par_walk(root, visitor);
+    if (node != NULL)
+        release_flag(node);
+    return visitor.below;
+}
+
+/**
+ * find the key of the given rank by getting flag hand over hand like
+ * par_rank()
+ * returns false if there is none, no flag is held on return
+ */
+bool par_select(tree_node *root, long rank, tree_key *key RB_VALUE_OUT)
+{
+#ifdef TREE_VALUE
+    select_visitor visitor(rank, key, value);
+#else
+    select_visitor visitor(rank, key);
+#endif
+    tree_node *node = par_walk(root, visitor);
+    if (node == NULL)
+        return false;
+    release_flag(node);
+    return true;
+}
+#endif
+
 /**
  * find a node's successor on the left
  * already make sure that the delete node have two non-leaf children
@@ -910,25 +1138,41 @@ restart:
  */
 tree_node *par_find_successor(tree_node *delete_node)
 {
-    bool expect;
     // we already hold the flag of delete_node
 
-    tree_node *y = delete_node->right_child;
+    tree_node *y = reclaim_protect(HP_SUCC_NODE, &delete_node->right_child);
     tree_node *z = NULL;
+    int y_slot = HP_SUCC_NODE, z_slot = HP_SUCC_PREV, slot;
+
+    if (!try_flag(y))
+        return NULL; // restart outside
+    if (y != delete_node->right_child)
+    {
+        release_flag(y); // moved by a rotation, see par_find()
+        return NULL;
+    }
 
-    while (!y->left_child->is_leaf)
+    while (!is_leaf(y->left_child))
     {
-        z = y; // store old y
-        y = y->left_child;
+        z = y; // store old y, its hazard slot goes with it
+        slot = z_slot;
+        z_slot = y_slot;
+        y_slot = slot;
+        y = reclaim_protect(y_slot, &y->left_child);
 
-        expect = false;
-        if (!y->flag.compare_exchange_weak(expect, true))
+        if (!try_flag(y))
         {
-            z->flag = false; // release held flag
+            release_flag(z); // release held flag
             return NULL; // restart outside
         }
+        if (y != z->left_child)
+        {
+            release_flag(y); // moved by a rotation, see par_find()
+            release_flag(z);
+            return NULL;
+        }
         
-        z->flag = false; // release old y's flag
+        release_flag(z); // release old y's flag
     }
     
     return y; // successor found
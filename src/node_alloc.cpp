@@ -0,0 +1,323 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <sys/mman.h>
+
+/******************
+ * node allocator
+ ******************/
+
+/**
+ * Every insert allocates a node and every node that is retired comes
+ * back through reclaim.cpp, so tree nodes go through a per-thread slab
+ * allocator instead of malloc. Nodes are carved at sizeof(tree_node)
+ * steps from an aligned slab, which keeps the two low address bits free
+ * for the nil tags and keeps every node on its own cache lines in the
+ * cache line layouts (see NODE_LAYOUT).
+ *
+ * A thread owns a heap. The heap carves nodes out of NODE_SLAB_SIZE
+ * slabs that are aligned to their size, so the slab (and its owner) of
+ * any node is found by masking the node address. Nodes freed by the
+ * owner go to its local free list without any atomic operation. Nodes
+ * freed by another thread, which is the common case because the thread
+ * that retires a node is rarely the one that created it, are pushed on
+ * the owner's remote stack with a CAS. The owner takes the whole remote
+ * stack with one exchange when its local list runs dry, so the stack is
+ * never popped one node at a time and cannot suffer from ABA.
+ *
+ * Heaps of exited threads stay on the global list and are adopted by
+ * the next new thread, together with their slabs and free nodes. Slabs
+ * are never given back to the system.
+ *
+ * A heap belongs to the NUMA node its thread runs on (see topology.cpp)
+ * and a thread adopts a heap of its own node before any other. With
+ * more than one node every new slab is bound to the heap's node, so the
+ * nodes a thread inserts are local to it however the allocator happened
+ * to touch the memory before; a node freed by a thread on another node
+ * still goes back to its owner's heap.
+ *
+ * With NODE_REF_INDEX the slabs are cut from the node arena instead, so
+ * every node has a 32 bit index, and malloc mode is not available.
+ */
+
+typedef struct slab_free_t
+{
+    // nodes may be only 4 byte aligned with 32 bit links
+    struct slab_free_t *next __attribute__((packed, aligned(4)));
+} slab_free;
+
+struct node_heap_t;
+
+typedef struct node_slab_t
+{
+    struct node_heap_t *owner;
+} node_slab;
+
+typedef struct node_heap_t
+{
+    atomic<slab_free *> remote; // freed by other threads
+    atomic<bool> in_use;        // owned by a live thread
+    struct node_heap_t *next;
+    int node;                   // NUMA node of the owner
+
+    slab_free *local;           // freed by the owner
+    char *bump;                 // unused part of the newest slab
+    char *bump_end;
+
+    // statistics
+    atomic<unsigned long> allocs;      // written by the owner only
+    atomic<unsigned long> local_frees; // written by the owner only
+    atomic<unsigned long> slabs;
+    atomic<unsigned long> remote_frees;
+    atomic<unsigned long> bound_slabs;
+} node_heap;
+
+static int alloc_mode = NODE_ALLOC_DEFAULT_MODE;
+static atomic<node_heap *> heaps(NULL);
+static atomic<long> malloc_in_use(0); // nodes in malloc mode
+
+/**
+ * count an event on a counter only the owner of the heap writes, no
+ * atomic read-modify-write needed
+ */
+static inline void owner_count(atomic<unsigned long> &counter)
+{
+    counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+#ifdef NODE_REF_INDEX
+/**
+ * reserve the address space of the arena, pages are only backed when a
+ * slab is first touched
+ */
+static char *arena_reserve(void)
+{
+    size_t size = NODE_ARENA_SIZE + NODE_SLAB_SIZE;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        perror("node arena");
+        exit(1);
+    }
+    uintptr_t base = ((uintptr_t)mem + NODE_SLAB_SIZE - 1) & ~(uintptr_t)(NODE_SLAB_SIZE - 1);
+    return (char *)base;
+}
+
+char *node_arena = arena_reserve();
+static atomic<size_t> arena_used(0);
+#endif
+
+/**
+ * give the heap back when its thread exits
+ */
+struct node_heap_thread_t
+{
+    node_heap *heap = NULL;
+
+    ~node_heap_thread_t()
+    {
+        if (heap != NULL)
+            heap->in_use = false;
+    }
+};
+
+static thread_local node_heap_thread_t heap_thread;
+
+/**
+ * choose the allocator, must be called before any tree is built
+ */
+void node_alloc_init(int mode)
+{
+#ifdef NODE_REF_INDEX
+    mode = NODE_ALLOC_SLAB; // links only reach nodes in the arena
+#endif
+    alloc_mode = mode;
+}
+
+/**
+ * adopt the heap of an exited thread, one of this thread's node first,
+ * or append a new one to the global list
+ */
+static node_heap *get_heap(void)
+{
+    node_heap *heap = heap_thread.heap;
+    if (heap != NULL)
+        return heap;
+
+    int node = topo_current_node();
+    for (int any = 0; any < 2; any++)
+    {
+        for (heap = heaps; heap != NULL; heap = heap->next)
+        {
+            bool expect = false;
+            if ((any || heap->node == node) && !heap->in_use &&
+                heap->in_use.compare_exchange_strong(expect, true))
+            {
+                heap->node = node; // new slabs come from here now
+                heap_thread.heap = heap;
+                return heap;
+            }
+        }
+    }
+
+    heap = new node_heap;
+    heap->remote = NULL;
+    heap->in_use = true;
+    heap->node = node;
+    heap->local = NULL;
+    heap->bump = NULL;
+    heap->bump_end = NULL;
+    heap->allocs = 0;
+    heap->local_frees = 0;
+    heap->slabs = 0;
+    heap->remote_frees = 0;
+    heap->bound_slabs = 0;
+
+    node_heap *head = heaps;
+    do {
+        heap->next = head;
+    } while (!heaps.compare_exchange_weak(head, heap));
+
+    heap_thread.heap = heap;
+    return heap;
+}
+
+/**
+ * get a fresh slab, the first node-sized chunk holds the slab header
+ */
+static bool new_slab(node_heap *heap)
+{
+    void *mem;
+#ifdef NODE_REF_INDEX
+    size_t offset = arena_used.fetch_add(NODE_SLAB_SIZE);
+    if (offset + NODE_SLAB_SIZE > NODE_ARENA_SIZE)
+        return false;
+    mem = node_arena + offset;
+#else
+    if (posix_memalign(&mem, NODE_SLAB_SIZE, NODE_SLAB_SIZE) != 0)
+        return false;
+#endif
+
+    if (topo_bind(mem, NODE_SLAB_SIZE, heap->node))
+        heap->bound_slabs++;
+
+    node_slab *slab = (node_slab *)mem;
+    slab->owner = heap;
+#ifdef NODE_REF_INDEX
+    // a node needs an index, so it must sit a whole number of nodes into
+    // the arena, and slabs are not
+    size_t first = offset + sizeof(node_slab) + sizeof(tree_node) - 1;
+    heap->bump = node_arena + first / sizeof(tree_node) * sizeof(tree_node);
+#else
+    heap->bump = (char *)mem + sizeof(tree_node);
+#endif
+    heap->bump_end = (char *)mem + NODE_SLAB_SIZE;
+    heap->slabs++;
+    return true;
+}
+
+/**
+ * allocate memory for one tree node, the fields are not initialized
+ */
+tree_node *alloc_node(void)
+{
+    if (alloc_mode == NODE_ALLOC_MALLOC)
+    {
+        // the cache line layouts need more than malloc guarantees
+        void *mem = NULL;
+        if (alignof(tree_node) <= alignof(max_align_t))
+            mem = malloc(sizeof(tree_node));
+        else if (posix_memalign(&mem, alignof(tree_node), sizeof(tree_node)) != 0)
+            mem = NULL;
+        if (mem != NULL)
+            malloc_in_use.fetch_add(1, memory_order_relaxed);
+        return (tree_node *)mem;
+    }
+
+    node_heap *heap = get_heap();
+
+    if (heap->local == NULL && heap->remote.load(memory_order_relaxed) != NULL)
+        heap->local = heap->remote.exchange(NULL, memory_order_acquire);
+
+    if (heap->local != NULL)
+    {
+        slab_free *chunk = heap->local;
+        heap->local = chunk->next;
+        owner_count(heap->allocs);
+        return (tree_node *)chunk;
+    }
+
+    if (heap->bump + sizeof(tree_node) > heap->bump_end && !new_slab(heap))
+        return NULL;
+
+    tree_node *node = (tree_node *)heap->bump;
+    heap->bump += sizeof(tree_node);
+    owner_count(heap->allocs);
+    return node;
+}
+
+/**
+ * give a node back to the heap it was carved from
+ * only called once no thread can reach the node any more
+ */
+void dealloc_node(tree_node *node)
+{
+    if (alloc_mode == NODE_ALLOC_MALLOC)
+    {
+        free(node);
+        malloc_in_use.fetch_sub(1, memory_order_relaxed);
+        return;
+    }
+
+    node_slab *slab = (node_slab *)((uintptr_t)node & ~(uintptr_t)(NODE_SLAB_SIZE - 1));
+    node_heap *owner = slab->owner;
+    slab_free *chunk = (slab_free *)node;
+
+    if (owner == heap_thread.heap)
+    {
+        chunk->next = owner->local;
+        owner->local = chunk;
+        owner_count(owner->local_frees);
+        return;
+    }
+
+    slab_free *head = owner->remote.load(memory_order_relaxed);
+    do {
+        chunk->next = head;
+    } while (!owner->remote.compare_exchange_weak(head, chunk,
+                                                  memory_order_release,
+                                                  memory_order_relaxed));
+    owner->remote_frees++;
+}
+
+/**
+ * sum up the counters of all heaps
+ * in_use is exact only while no thread allocates or frees nodes
+ */
+void node_alloc_get_stats(node_alloc_stats *stats)
+{
+    long in_use = malloc_in_use.load(memory_order_relaxed);
+    stats->heaps = 0;
+    stats->slabs = 0;
+    stats->remote_frees = 0;
+    stats->bound_slabs = 0;
+    for (node_heap *heap = heaps; heap != NULL; heap = heap->next)
+    {
+        stats->heaps++;
+        stats->slabs += heap->slabs;
+        stats->remote_frees += heap->remote_frees;
+        stats->bound_slabs += heap->bound_slabs;
+        in_use += heap->allocs - heap->local_frees - heap->remote_frees;
+    }
+    stats->in_use = in_use;
+
+    // a slab header takes the room of one node
+    size_t per_slab = NODE_SLAB_SIZE / sizeof(tree_node) - 1;
+    stats->bytes_in_use = in_use * sizeof(tree_node);
+    if (alloc_mode != NODE_ALLOC_MALLOC)
+        stats->bytes_in_use = in_use * NODE_SLAB_SIZE / per_slab;
+}
@@ -0,0 +1,296 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <atomic>
+
+/******************
+ * tree object
+ ******************/
+
+/**
+ * Every thread that uses a tree object gets a context of its own from
+ * the object's list on first use. The list only grows, by a CAS on its
+ * head, and is freed with the object, so no context outlives its tree.
+ * A thread finds its context again by its thread id; the one of the
+ * last tree it used is cached under the tree's serial. Serials are never
+ * reused, so a cache left behind by a destroyed tree is never picked up
+ * by a new tree at the same address.
+ */
+typedef struct context_entry_t
+{
+    tree_context context;
+    pthread_t owner;
+    struct context_entry_t *next;
+} context_entry;
+
+static atomic<unsigned long> next_serial(1);
+
+static thread_local unsigned long last_serial; // 0 is no tree
+static thread_local tree_context *last_context;
+
+context_list_t::context_list_t() : serial(next_serial.fetch_add(1)), next_index(0), head(NULL)
+{
+}
+
+/**
+ * no thread may be inside a call on the tree any more
+ */
+context_list_t::~context_list_t()
+{
+    context_entry *entry = head.load();
+    while (entry != NULL)
+    {
+        context_entry *next = entry->next;
+        delete entry;
+        entry = next;
+    }
+}
+
+/**
+ * the calling thread's context, created on first use with the next
+ * marker index; a thread that gets the id of one that has exited takes
+ * over its context
+ */
+tree_context *context_list_t::get(void)
+{
+    if (last_serial == serial)
+        return last_context;
+
+    pthread_t self = pthread_self();
+    context_entry *entry = head.load(memory_order_acquire);
+    while (entry != NULL && !pthread_equal(entry->owner, self))
+        entry = entry->next;
+    if (entry == NULL)
+    {
+        long index = next_index.fetch_add(1);
+        if (index > NODE_MARKER_MAX)
+        {
+            fprintf(stderr, "[ERROR] more than %d threads on one tree.\n",
+                    NODE_MARKER_MAX + 1);
+            exit(1);
+        }
+        entry = new context_entry();
+        entry->context.index = index;
+        entry->owner = self;
+        entry->next = head.load();
+        while (!head.compare_exchange_weak(entry->next, entry))
+            ;
+    }
+
+    last_serial = serial;
+    last_context = &entry->context;
+    return last_context;
+}
+
+LockFreeRBTree::LockFreeRBTree()
+    : root_node(rb_init()), image(NULL),
+      restoring(false), restore_ok(true)
+{
+    pthread_mutex_init(&restore_lock, NULL);
+    pthread_cond_init(&restore_done, NULL);
+}
+
+LockFreeRBTree::~LockFreeRBTree()
+{
+    if (image != NULL)
+    {
+        pthread_join(restorer, NULL);
+        rb_snapshot_close(image);
+    }
+    pthread_cond_destroy(&restore_done);
+    pthread_mutex_destroy(&restore_lock);
+    rb_destroy(root_node);
+}
+
+/**
+ * the calling thread's context for this tree, created on first use
+ */
+tree_context *LockFreeRBTree::context(void)
+{
+    return contexts.get();
+}
+
+/**
+ * see rb_insert(), false if the key was there
+ */
+bool LockFreeRBTree::insert(tree_key key RB_VALUE_PARAM)
+{
+    wait_restored();
+    context_scope_t scope(context());
+#ifdef TREE_VALUE
+    return rb_insert(root_node, key, value);
+#else
+    return rb_insert(root_node, key);
+#endif
+}
+
+/**
+ * see rb_insert_batch(), the number of keys inserted
+ */
+long LockFreeRBTree::insert_batch(const tree_key *keys RB_VALUES_PARAM, long n)
+{
+    wait_restored();
+    context_scope_t scope(context());
+#ifdef TREE_VALUE
+    return rb_insert_batch(root_node, keys, values, n);
+#else
+    return rb_insert_batch(root_node, keys, n);
+#endif
+}
+
+/**
+ * see rb_build(), only on a new tree
+ */
+bool LockFreeRBTree::build(const tree_key *keys RB_VALUES_PARAM, long n, int threads)
+{
+    wait_restored();
+#ifdef TREE_VALUE
+    return rb_build(root_node, keys, values, n, threads);
+#else
+    return rb_build(root_node, keys, n, threads);
+#endif
+}
+
+void LockFreeRBTree::remove(tree_key key)
+{
+    wait_restored();
+    context_scope_t scope(context());
+    rb_remove(root_node, key);
+}
+
+bool LockFreeRBTree::find(tree_key key RB_VALUE_OUT)
+{
+    if (restoring.load(memory_order_acquire))
+#ifdef TREE_VALUE
+        return rb_snapshot_find(image, key, value);
+#else
+        return rb_snapshot_find(image, key);
+#endif
+    context_scope_t scope(context());
+#ifdef TREE_VALUE
+    return rb_lookup(root_node, key, value);
+#else
+    return rb_lookup(root_node, key);
+#endif
+}
+
+/**
+ * see rb_scan(), fn may call back into the tree
+ */
+long LockFreeRBTree::scan(tree_key lo, tree_key hi, rb_scan_fn fn, void *arg)
+{
+    wait_restored();
+    context_scope_t scope(context());
+    return rb_scan(root_node, lo, hi, fn, arg);
+}
+
+#ifdef RB_ORDER_STATS
+/**
+ * see rb_rank()
+ */
+long LockFreeRBTree::rank(tree_key key)
+{
+    wait_restored();
+    context_scope_t scope(context());
+    return rb_rank(root_node, key);
+}
+
+/**
+ * see rb_select(), false if there are no more than rank keys
+ */
+bool LockFreeRBTree::select(long rank, tree_key *key RB_VALUE_OUT)
+{
+    wait_restored();
+    context_scope_t scope(context());
+#ifdef TREE_VALUE
+    return rb_select(root_node, rank, key, value);
+#else
+    return rb_select(root_node, rank, key);
+#endif
+}
+#endif
+
+/**
+ * number of keys, only exact while no update runs
+ */
+long LockFreeRBTree::size(void)
+{
+    wait_restored();
+    return count_nodes(root_node);
+}
+
+/**
+ * check the red-black properties, no update may run
+ */
+bool LockFreeRBTree::check(void)
+{
+    wait_restored();
+    return check_tree_dfs(root_node->left_child);
+}
+
+/**
+ * write the tree to a snapshot image at path, see rb_snapshot_save()
+ * no update may run meanwhile
+ */
+long LockFreeRBTree::save(const char *path)
+{
+    wait_restored();
+    return rb_snapshot_save(root_node, path);
+}
+
+/**
+ * fill the new tree from the snapshot image at path
+ * returns at once, see above; false if the image cannot be mapped, the
+ * tree is not new or the thread that builds it cannot be started, and
+ * the tree is left empty then
+ */
+bool LockFreeRBTree::restore(const char *path, int threads)
+{
+    if (image != NULL || !is_leaf(root_node->left_child))
+        return false;
+    image = rb_snapshot_open(path);
+    if (image == NULL)
+        return false;
+    restore_threads = threads;
+    restoring = true;
+    if (pthread_create(&restorer, NULL, restore_thread, this) != 0)
+    {
+        // nothing is built, wake whoever waits for it
+        pthread_mutex_lock(&restore_lock);
+        restoring.store(false, memory_order_release);
+        pthread_cond_broadcast(&restore_done);
+        pthread_mutex_unlock(&restore_lock);
+        rb_snapshot_close(image);
+        image = NULL; // the destructor joins no thread
+        return false;
+    }
+    return true;
+}
+
+void *LockFreeRBTree::restore_thread(void *arg)
+{
+    LockFreeRBTree *tree = (LockFreeRBTree *)arg;
+    bool ok = rb_snapshot_build(tree->root_node, tree->image, tree->restore_threads);
+    pthread_mutex_lock(&tree->restore_lock);
+    tree->restore_ok = ok;
+    tree->restoring.store(false, memory_order_release);
+    pthread_cond_broadcast(&tree->restore_done);
+    pthread_mutex_unlock(&tree->restore_lock);
+    return NULL;
+}
+
+/**
+ * wait while the tree is being built from an image, which takes seconds,
+ * so the thread sleeps instead of spinning
+ * false if building it failed, the tree may hold part of the image then
+ */
+bool LockFreeRBTree::wait_restored(void)
+{
+    if (!restoring.load(memory_order_acquire))
+        return restore_ok;
+    pthread_mutex_lock(&restore_lock);
+    while (restoring.load(memory_order_relaxed))
+        pthread_cond_wait(&restore_done, &restore_lock);
+    pthread_mutex_unlock(&restore_lock);
+    return restore_ok;
+}
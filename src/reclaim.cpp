@@ -0,0 +1,398 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
+/******************
+ * memory reclamation
+ ******************/
+
+/**
+ * Removed nodes cannot be freed right away: other threads may still be
+ * walking through them in par_find() or tree_insert(). free_node() hands
+ * them to retire_node(), which keeps them on a per-thread retire list
+ * until no running operation can hold a reference any more.
+ *
+ * epoch scheme:
+ *   every operation announces the global epoch it started in. A node
+ *   retired in epoch e is unreachable for operations that start after
+ *   the global epoch moved past e, so once the epoch reaches e + 2 every
+ *   operation that could have seen it has finished. The global epoch
+ *   only advances when all active threads have announced the current one.
+ *   A thread that stalls inside an operation stops all reclamation.
+ *
+ * hazard pointer scheme:
+ *   before dereferencing a node reached without holding a flag on it,
+ *   a thread publishes it in one of its RECLAIM_HAZARDS slots and checks
+ *   that the link it came from still points to it. A retired node is
+ *   freed as soon as no slot points to it, so a stalled thread only pins
+ *   the nodes in its own slots.
+ *   A thread scans all T * H slots (T threads, H = RECLAIM_HAZARDS)
+ *   after RECLAIM_SCAN_BATCH = 2H new retires and keeps only the nodes
+ *   it finds published, at most one per slot. Its retire list stays
+ *   below T * H + 2H, but the lists of all threads together only below
+ *   T * (T * H + 2H), O(T^2 * H): a slot that moves on after a scan may
+ *   protect a node on another thread's list at that thread's scan, and
+ *   a node kept by a scan waits for its thread's next one, which does
+ *   not come while the thread retires nothing. Only the nodes published
+ *   right now, T * H, are really held; the rest go with the next scans.
+ */
+
+#define RECLAIM_LIMBO_LISTS 3
+#define RECLAIM_ADVANCE_FREQ 64 // retires between two attempts to advance
+#define RECLAIM_SCAN_BATCH (2 * RECLAIM_HAZARDS) // new retires per hazard scan
+
+typedef struct reclaim_record_t
+{
+    atomic<unsigned long> epoch; // epoch announced by the running operation
+    atomic<bool> active;         // inside an operation
+    atomic<bool> in_use;         // owned by a live thread
+    struct reclaim_record_t *next;
+
+    int nesting;
+    unsigned long retire_count;
+    vector<tree_node *> limbo[RECLAIM_LIMBO_LISTS];
+    unsigned long limbo_epoch[RECLAIM_LIMBO_LISTS];
+
+    // hazard pointer scheme, limbo[0] is the retire list
+    atomic<tree_node *> hazard[RECLAIM_HAZARDS];
+    size_t survivors; // nodes still protected after the last scan
+    vector<tree_node *> protect; // of the last scan, kept for its capacity
+
+    // statistics, only written by the owner
+    atomic<unsigned long> retired;
+    atomic<unsigned long> freed;
+    atomic<unsigned long> peak_pending;
+} reclaim_record;
+
+static int reclaim_mode = RECLAIM_DEFAULT_MODE;
+static atomic<unsigned long> global_epoch(RECLAIM_LIMBO_LISTS);
+static atomic<reclaim_record *> records(NULL);
+static atomic<long> record_count(0);
+
+/**
+ * give the record back when its thread exits,
+ * whatever is still on its limbo lists is adopted by the next owner
+ */
+struct reclaim_thread_t
+{
+    reclaim_record *record = NULL;
+
+    ~reclaim_thread_t()
+    {
+        if (record == NULL)
+            return;
+        for (int i = 0; i < RECLAIM_HAZARDS; i++)
+            record->hazard[i] = NULL;
+        record->active = false;
+        record->nesting = 0;
+        record->in_use = false;
+    }
+};
+
+static thread_local reclaim_thread_t reclaim_thread;
+
+/**
+ * choose the reclamation scheme, must be called before any tree is used
+ */
+void reclaim_init(int mode)
+{
+    reclaim_mode = mode;
+}
+
+/**
+ * find a free record or append a new one to the global list
+ */
+static reclaim_record *get_record(void)
+{
+    reclaim_record *rec = reclaim_thread.record;
+    if (rec != NULL)
+        return rec;
+
+    for (rec = records; rec != NULL; rec = rec->next)
+    {
+        bool expect = false;
+        if (!rec->in_use && rec->in_use.compare_exchange_strong(expect, true))
+        {
+            reclaim_thread.record = rec;
+            return rec;
+        }
+    }
+
+    rec = new reclaim_record;
+    rec->epoch = 0;
+    rec->active = false;
+    rec->in_use = true;
+    rec->nesting = 0;
+    rec->retire_count = 0;
+    for (int i = 0; i < RECLAIM_LIMBO_LISTS; i++)
+        rec->limbo_epoch[i] = 0;
+    for (int i = 0; i < RECLAIM_HAZARDS; i++)
+        rec->hazard[i] = NULL;
+    rec->survivors = 0;
+    rec->retired = 0;
+    rec->freed = 0;
+    rec->peak_pending = 0;
+
+    reclaim_record *head = records;
+    do {
+        rec->next = head;
+    } while (!records.compare_exchange_weak(head, rec));
+    record_count++;
+
+    reclaim_thread.record = rec;
+    return rec;
+}
+
+/**
+ * free every node on one limbo list
+ */
+static void free_limbo(reclaim_record *rec, int i)
+{
+    for (auto node : rec->limbo[i])
+        dealloc_node(node);
+    rec->freed += rec->limbo[i].size();
+    rec->limbo[i].clear();
+}
+
+/**
+ * number of retired nodes of this record that are not freed yet
+ */
+static unsigned long pending_nodes(reclaim_record *rec)
+{
+    return rec->retired - rec->freed;
+}
+
+/**
+ * try to move the global epoch forward,
+ * then free the limbo lists that became safe
+ */
+static void try_advance(reclaim_record *rec)
+{
+    unsigned long epoch = global_epoch;
+
+    for (reclaim_record *r = records; r != NULL; r = r->next)
+    {
+        if (r->active && r->epoch != epoch)
+            goto collect; // someone is still in an older epoch
+    }
+    global_epoch.compare_exchange_strong(epoch, epoch + 1);
+
+collect:
+    epoch = global_epoch;
+    for (int i = 0; i < RECLAIM_LIMBO_LISTS; i++)
+    {
+        if (!rec->limbo[i].empty() && rec->limbo_epoch[i] + 2 <= epoch)
+            free_limbo(rec, i);
+    }
+}
+
+/**
+ * free every retired node of this record that no hazard slot points to
+ */
+static void scan_hazards(reclaim_record *rec)
+{
+    vector<tree_node *> &protect = rec->protect;
+    protect.clear();
+    for (reclaim_record *r = records; r != NULL; r = r->next)
+    {
+        for (int i = 0; i < RECLAIM_HAZARDS; i++)
+        {
+            tree_node *node = r->hazard[i];
+            if (node != NULL)
+                protect.push_back(node);
+        }
+    }
+    sort(protect.begin(), protect.end());
+
+    vector<tree_node *> &retired = rec->limbo[0];
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++)
+    {
+        if (binary_search(protect.begin(), protect.end(), retired[i]))
+            retired[kept++] = retired[i];
+        else
+            dealloc_node(retired[i]);
+    }
+    rec->freed += retired.size() - kept;
+    retired.resize(kept);
+    rec->survivors = kept;
+
+    // room for the most either list can hold, so they do not grow while
+    // the threads stay the same
+    size_t bound = record_count * RECLAIM_HAZARDS;
+    protect.reserve(bound);
+    retired.reserve(bound + RECLAIM_SCAN_BATCH);
+}
+
+/**
+ * announce the start of an operation
+ */
+void reclaim_enter(void)
+{
+    if (reclaim_mode == RECLAIM_HAZARD)
+    {
+        get_record();
+        return;
+    }
+    if (reclaim_mode != RECLAIM_EPOCH)
+        return;
+
+    reclaim_record *rec = get_record();
+    if (rec->nesting++ > 0)
+        return;
+
+    rec->active = true;
+    rec->epoch = global_epoch.load();
+}
+
+/**
+ * announce the end of an operation
+ */
+void reclaim_exit(void)
+{
+    if (reclaim_mode == RECLAIM_HAZARD)
+    {
+        reclaim_record *rec = get_record();
+        for (int i = 0; i < RECLAIM_HAZARDS; i++)
+            rec->hazard[i].store(NULL, memory_order_release);
+        return;
+    }
+    if (reclaim_mode != RECLAIM_EPOCH)
+        return;
+
+    reclaim_record *rec = get_record();
+    if (--rec->nesting > 0)
+        return;
+
+    rec->active = false;
+}
+
+/**
+ * whether every node reached between reclaim_enter() and reclaim_exit()
+ * stays allocated until reclaim_exit() without being protected
+ */
+bool reclaim_keeps_nodes(void)
+{
+    return reclaim_mode != RECLAIM_HAZARD;
+}
+
+/**
+ * read a link to a node that we do not hold a flag on yet and protect it
+ * from being freed until the slot is reused or the operation ends
+ *
+ * @params:
+ *      slot - one of the HP_* hazard slots
+ *      ref - the link to read, e.g. &parent->left_child
+ */
+tree_node *reclaim_protect(int slot, node_link *ref)
+{
+    tree_node *node = load_link(ref, __ATOMIC_ACQUIRE);
+    if (reclaim_mode != RECLAIM_HAZARD)
+        return node;
+
+    reclaim_record *rec = get_record();
+    while (true)
+    {
+        rec->hazard[slot] = node;
+        // the link still points to the node after publishing it,
+        // so it was not retired before the slot became visible
+        tree_node *again = load_link(ref, __ATOMIC_SEQ_CST);
+        if (again == node)
+            return node;
+        node = again;
+    }
+}
+
+/**
+ * defer freeing a node that has been unlinked from the tree
+ */
+void retire_node(tree_node *node)
+{
+    reclaim_record *rec = get_record();
+
+    // nodes are never freed, only count them
+    if (reclaim_mode == RECLAIM_NONE)
+    {
+        rec->retired++;
+        rec->peak_pending = pending_nodes(rec);
+        return;
+    }
+
+    if (reclaim_mode == RECLAIM_HAZARD)
+    {
+        rec->limbo[0].push_back(node);
+        rec->retired++;
+        if (pending_nodes(rec) > rec->peak_pending)
+            rec->peak_pending = pending_nodes(rec);
+        if (rec->limbo[0].size() >= rec->survivors + RECLAIM_SCAN_BATCH)
+            scan_hazards(rec);
+        return;
+    }
+
+    // read the epoch after the node was unlinked
+    unsigned long epoch = global_epoch;
+    int i = epoch % RECLAIM_LIMBO_LISTS;
+
+    // the list still holds nodes from three or more epochs ago
+    if (rec->limbo_epoch[i] != epoch)
+    {
+        free_limbo(rec, i);
+        rec->limbo_epoch[i] = epoch;
+    }
+
+    rec->limbo[i].push_back(node);
+    rec->retired++;
+
+    unsigned long pending = pending_nodes(rec);
+    if (pending > rec->peak_pending)
+        rec->peak_pending = pending;
+
+    if (++rec->retire_count % RECLAIM_ADVANCE_FREQ == 0)
+        try_advance(rec);
+}
+
+/**
+ * free all retired nodes of all threads
+ * only valid when no operation is running
+ */
+void reclaim_drain(void)
+{
+    for (reclaim_record *rec = records; rec != NULL; rec = rec->next)
+    {
+        for (int i = 0; i < RECLAIM_LIMBO_LISTS; i++)
+            free_limbo(rec, i);
+        rec->survivors = 0;
+    }
+}
+
+/**
+ * sum up the counters of all threads
+ */
+void reclaim_get_stats(reclaim_stats *stats)
+{
+    stats->retired = 0;
+    stats->freed = 0;
+    stats->pending = 0;
+    stats->peak_pending = 0;
+    stats->bound = 0;
+    if (reclaim_mode == RECLAIM_HAZARD)
+    {
+        // a scan keeps at most one node per hazard slot of all threads,
+        // on top of that a thread collects one batch before it scans again;
+        // this bounds each list, see above for all of them together
+        stats->bound = record_count * RECLAIM_HAZARDS + RECLAIM_SCAN_BATCH;
+    }
+
+    for (reclaim_record *rec = records; rec != NULL; rec = rec->next)
+    {
+        unsigned long retired = rec->retired, freed = rec->freed;
+        stats->retired += retired;
+        stats->freed += freed;
+        stats->pending += retired - freed;
+        if (rec->peak_pending > stats->peak_pending)
+            stats->peak_pending = rec->peak_pending;
+    }
+}
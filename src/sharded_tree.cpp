@@ -0,0 +1,637 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <new>
+#include <algorithm>
+
+/******************
+ * sharded tree object
+ ******************/
+
+/**
+ * Shard i holds the keys in [bounds[i - 1], bounds[i]). Shard 0 has no
+ * lower bound and shard bounds.size() no upper one; the shards after it
+ * are empty. A new object has no bounds, so all keys are in shard 0
+ * until build() or balancing spreads them.
+ *
+ * A published table of bounds never changes, balancing publishes a new
+ * one. An operation announces the table it routes its key with in a
+ * slot of its own and checks that it is still the current one, like a
+ * hazard pointer, so after publishing a table the balancer can wait for
+ * the operations still on the old one, see wait_readers().
+ *
+ * Moving a boundary hands the keys in [lo, hi) to the neighbour:
+ *   1. publish a table that freezes [lo, hi), operations on those keys
+ *      wait until a later table is published
+ *   2. wait for the operations on the old table, no thread touches a
+ *      key of the range after that
+ *   3. insert the keys of the range into the neighbour, then remove them
+ *      from the shard
+ *   4. publish a table with the new boundary
+ * Only operations on keys being moved ever wait, and a step moves at
+ * most SHARD_MOVE_MAX keys.
+ *
+ * Load is sampled: a thread counts one operation in SHARD_SAMPLE_EVERY
+ * towards the load of its shard and puts the key in the shard's sample
+ * ring. A balance step takes the busiest shard, if it has SHARD_SKEW
+ * times the mean load, and its less busy neighbour, and places the
+ * boundary by the sampled keys so that about half the difference in
+ * load changes sides. It does nothing if the samples say the busier of
+ * the two would not get at least 10% less busy, e.g. when most of the
+ * load is on one key.
+ */
+
+typedef struct shard_table_t
+{
+    unsigned long version;   // published tables before this one
+    vector<tree_key> bounds; // sorted, equal bounds leave a shard empty
+    bool frozen;             // keys in [frozen_lo, frozen_hi) are moving
+    bool frozen_has_hi;      // no upper end otherwise
+    tree_key frozen_lo, frozen_hi;
+} shard_table;
+
+typedef struct alignas(CACHE_LINE_SIZE) shard_t
+{
+    tree_node *root;
+    atomic<unsigned long> load; // operations since the last balance step
+    atomic<unsigned long> sample_next;
+    atomic<tree_key> samples[SHARD_SAMPLES]; // relaxed, only a hint
+} shard;
+
+typedef struct alignas(CACHE_LINE_SIZE) shard_slot_t
+{
+    atomic<shard_table *> table; // NULL outside of an operation
+} shard_slot;
+
+/**
+ * keys and values taken out of a shard
+ */
+typedef struct key_batch_t
+{
+    vector<tree_key> keys;
+#ifdef TREE_VALUE
+    vector<tree_value> values;
+#endif
+} key_batch;
+
+static thread_local unsigned int sample_tick;
+
+/**
+ * the shard key belongs to
+ */
+static int route(shard_table *t, tree_key key)
+{
+    return upper_bound(t->bounds.begin(), t->bounds.end(), key, key_less) - t->bounds.begin();
+}
+
+static bool is_frozen(shard_table *t, tree_key key)
+{
+    return t->frozen && !key_less(key, t->frozen_lo) &&
+           (!t->frozen_has_hi || key_less(key, t->frozen_hi));
+}
+
+/**
+ * the keys of a shard from lo up to hi, excluded, or to the end unless
+ * has_hi; at most max of them, all if max < 0
+ */
+static void collect_keys(tree_node *root, tree_key lo, bool has_hi, tree_key hi,
+                         long max, key_batch *batch)
+{
+    tree_iterator it;
+    rb_iter_init(&it, root, lo);
+    while ((max < 0 || (long)batch->keys.size() < max) && rb_iter_next(&it))
+    {
+        if (has_hi && !key_less(it.key, hi))
+            break;
+        batch->keys.push_back(it.key);
+#ifdef TREE_VALUE
+        batch->values.push_back(it.value);
+#endif
+    }
+}
+
+/**
+ * keep the balancer out, it may be in the middle of a move otherwise
+ */
+static void balancing_lock(atomic<bool> *balancing)
+{
+    bool expect = false;
+    unsigned int failures = 0;
+    while (!balancing->compare_exchange_weak(expect, true))
+    {
+        expect = false;
+        contention_wait(&failures);
+    }
+}
+
+static void *alloc_lines(size_t size)
+{
+    void *mem;
+    if (posix_memalign(&mem, CACHE_LINE_SIZE, size) != 0)
+    {
+        fprintf(stderr, "[ERROR] out of memory.\n");
+        exit(1);
+    }
+    return mem;
+}
+
+/**
+ * shards trees, all keys in the first one, and a thread that balances
+ * them every SHARD_BALANCE_USEC if balance_thread is set
+ */
+ShardedRBTree::ShardedRBTree(int shards, bool balance_thread)
+    : shard_count(shards < 1 ? 1 : shards), tables(1), balancing(false), moves(0), stop(false),
+      has_balancer(balance_thread)
+{
+    shard_list = (shard *)alloc_lines(sizeof(shard) * shard_count);
+    for (int i = 0; i < shard_count; i++)
+    {
+        new (&shard_list[i]) shard;
+        shard_list[i].root = rb_init();
+        shard_list[i].load = 0;
+        shard_list[i].sample_next = 0;
+    }
+    slots = (shard_slot *)alloc_lines(sizeof(shard_slot) * (NODE_MARKER_MAX + 1));
+    for (int i = 0; i <= NODE_MARKER_MAX; i++)
+        new (&slots[i]) shard_slot;
+    for (int i = 0; i <= NODE_MARKER_MAX; i++)
+        slots[i].table = NULL;
+
+    shard_table *t = new shard_table;
+    t->version = 0;
+    t->frozen = false;
+    table = t;
+
+    if (has_balancer)
+        pthread_create(&balancer, NULL, balance_loop, this);
+}
+
+ShardedRBTree::~ShardedRBTree()
+{
+    if (has_balancer)
+    {
+        stop = true;
+        pthread_join(balancer, NULL);
+    }
+    for (int i = 0; i < shard_count; i++)
+        rb_destroy(shard_list[i].root);
+    free(shard_list);
+    free(slots);
+    delete table.load();
+}
+
+tree_context *ShardedRBTree::context(void)
+{
+    return contexts.get();
+}
+
+/**
+ * announce the current table and return the shard of key in it
+ * waits while the key is being moved
+ */
+int ShardedRBTree::enter(tree_context *ctx, tree_key key)
+{
+    shard_slot *slot = &slots[ctx->index];
+    unsigned int failures = 0;
+    shard_table *t = table.load(memory_order_acquire);
+    while (true)
+    {
+        slot->table.store(t);
+        // still current after it became visible, so not freed
+        shard_table *again = table.load();
+        if (again != t)
+        {
+            t = again;
+            continue;
+        }
+        if (!is_frozen(t, key))
+            return route(t, key);
+
+        // out of the way of the balancer while waiting
+        slot->table.store(NULL, memory_order_release);
+        contention_wait(&failures);
+        t = table.load(memory_order_acquire);
+    }
+}
+
+void ShardedRBTree::leave(tree_context *ctx)
+{
+    slots[ctx->index].table.store(NULL, memory_order_release);
+}
+
+/**
+ * wait until no thread works with the table old any more
+ */
+void ShardedRBTree::wait_readers(shard_table *old)
+{
+    // a thread that joins later reads the new table
+    long threads = contexts.next_index.load();
+    for (long i = 0; i < threads && i <= NODE_MARKER_MAX; i++)
+    {
+        unsigned int failures = 0;
+        while (slots[i].table.load() == old)
+            contention_wait(&failures);
+    }
+}
+
+/**
+ * make next the current table and free the one before it
+ * only the balancer publishes tables
+ */
+void ShardedRBTree::publish(shard_table *next)
+{
+    shard_table *old = table.load();
+    next->version = tables.fetch_add(1);
+    table.store(next);
+    wait_readers(old);
+    delete old;
+}
+
+/**
+ * count one operation in SHARD_SAMPLE_EVERY towards the load of a shard
+ */
+void ShardedRBTree::sample(int s, tree_key key)
+{
+    if (++sample_tick % SHARD_SAMPLE_EVERY != 0)
+        return;
+    shard *sh = &shard_list[s];
+    sh->load.fetch_add(SHARD_SAMPLE_EVERY, memory_order_relaxed);
+    sh->samples[sh->sample_next.fetch_add(1, memory_order_relaxed) % SHARD_SAMPLES].store(
+        key, memory_order_relaxed);
+}
+
+/**
+ * see rb_insert(), false if the key was there
+ */
+bool ShardedRBTree::insert(tree_key key RB_VALUE_PARAM)
+{
+    tree_context *ctx = context();
+    context_scope_t scope(ctx);
+    int s = enter(ctx, key);
+#ifdef TREE_VALUE
+    bool inserted = rb_insert(shard_list[s].root, key, value);
+#else
+    bool inserted = rb_insert(shard_list[s].root, key);
+#endif
+    leave(ctx);
+    sample(s, key);
+    return inserted;
+}
+
+void ShardedRBTree::remove(tree_key key)
+{
+    tree_context *ctx = context();
+    context_scope_t scope(ctx);
+    int s = enter(ctx, key);
+    rb_remove(shard_list[s].root, key);
+    leave(ctx);
+    sample(s, key);
+}
+
+bool ShardedRBTree::find(tree_key key RB_VALUE_OUT)
+{
+    tree_context *ctx = context();
+    context_scope_t scope(ctx);
+    int s = enter(ctx, key);
+#ifdef TREE_VALUE
+    bool found = rb_lookup(shard_list[s].root, key, value);
+#else
+    bool found = rb_lookup(shard_list[s].root, key);
+#endif
+    leave(ctx);
+    sample(s, key);
+    return found;
+}
+
+/**
+ * a scan across shards, passes on the keys past the last one reported
+ */
+typedef struct shard_scan_t
+{
+    rb_scan_fn fn;
+    void *arg;
+    tree_key last; // valid if count > 0
+    long count;
+    bool stopped;
+} shard_scan;
+
+static bool scan_step(tree_key key RB_VALUE_PARAM, void *arg)
+{
+    shard_scan *scan = (shard_scan *)arg;
+    if (scan->count > 0 && !key_less(scan->last, key))
+        return true; // reported from the shard it was moved from
+    scan->last = key;
+    scan->count++;
+#ifdef TREE_VALUE
+    if (scan->fn(key, value, scan->arg))
+#else
+    if (scan->fn(key, scan->arg))
+#endif
+        return true;
+    scan->stopped = true;
+    return false;
+}
+
+/**
+ * see rb_scan(), with the same guarantees across shards
+ *
+ * Scans the shards one after the other with rb_scan(), holding no table
+ * meanwhile, so fn may call back into the object. If a boundary moved
+ * while a shard was scanned, keys may have left it before the scan got
+ * to them, so the scan goes on from the last key it reported in
+ * whichever shard holds that key now.
+ */
+long ShardedRBTree::scan(tree_key lo, tree_key hi, rb_scan_fn fn, void *arg)
+{
+    tree_context *ctx = context();
+    context_scope_t scope(ctx);
+    shard_scan state;
+    state.fn = fn;
+    state.arg = arg;
+    state.count = 0;
+    state.stopped = false;
+
+    tree_key from = lo;
+    while (!key_less(hi, from))
+    {
+        int s = enter(ctx, from);
+        shard_table *t = slots[ctx->index].table.load(memory_order_relaxed);
+        bool last_shard = s == (int)t->bounds.size();
+        tree_key upper = last_shard ? hi : t->bounds[s];
+        unsigned long version = t->version;
+        leave(ctx);
+
+        // the upper bound belongs to the next shard
+        rb_scan(shard_list[s].root, from, key_less(upper, hi) ? upper : hi, scan_step, &state);
+        if (state.stopped)
+            break;
+        if (tables.load() != version + 1)
+        {
+            if (state.count > 0)
+                from = state.last;
+            continue;
+        }
+        if (last_shard || key_less(hi, upper))
+            break;
+        from = upper;
+    }
+    return state.count;
+}
+
+/**
+ * fill the empty object from n keys in strictly increasing order, an
+ * equal part in every shard, see rb_build()
+ * nothing else may use the object meanwhile
+ */
+bool ShardedRBTree::build(const tree_key *keys RB_VALUES_PARAM, long n, int threads)
+{
+    for (int i = 0; i < shard_count; i++)
+    {
+        if (!is_leaf(shard_list[i].root->left_child))
+            return false;
+    }
+    for (long i = 1; i < n; i++)
+    {
+        if (!key_less(keys[i - 1], keys[i]))
+            return false;
+    }
+    if (n == 0)
+        return true;
+
+    long parts = n < shard_count ? n : shard_count;
+    shard_table *t = new shard_table;
+    t->frozen = false;
+    for (long i = 1; i < parts; i++)
+        t->bounds.push_back(keys[n * i / parts]);
+    for (long i = 0; i < parts; i++)
+    {
+        long first = n * i / parts, last = n * (i + 1) / parts;
+#ifdef TREE_VALUE
+        rb_build(shard_list[i].root, keys + first, values + first, last - first, threads);
+#else
+        rb_build(shard_list[i].root, keys + first, last - first, threads);
+#endif
+    }
+    balancing_lock(&balancing);
+    publish(t);
+    balancing = false;
+    return true;
+}
+
+/**
+ * move the boundary between shard from and its neighbour to, so the
+ * keys between the old and the new boundary go to the neighbour
+ */
+void ShardedRBTree::move_bound(int from, int to, tree_key bound)
+{
+    shard_table *old = table.load();
+    shard_table *frozen = new shard_table(*old);
+    shard_table *next = new shard_table(*old);
+    frozen->frozen = true;
+    if (to == from + 1)
+    {
+        frozen->frozen_lo = bound;
+        frozen->frozen_has_hi = from < (int)old->bounds.size();
+        if (frozen->frozen_has_hi)
+        {
+            frozen->frozen_hi = old->bounds[from];
+            next->bounds[from] = bound;
+        }
+        else
+            next->bounds.push_back(bound);
+    }
+    else
+    {
+        frozen->frozen_lo = old->bounds[to];
+        frozen->frozen_has_hi = true;
+        frozen->frozen_hi = bound;
+        next->bounds[to] = bound;
+    }
+
+    publish(frozen);
+    key_batch batch;
+    collect_keys(shard_list[from].root, frozen->frozen_lo, frozen->frozen_has_hi,
+                 frozen->frozen_hi, -1, &batch);
+#ifdef TREE_VALUE
+    rb_insert_batch(shard_list[to].root, batch.keys.data(), batch.values.data(),
+                    batch.keys.size());
+#else
+    rb_insert_batch(shard_list[to].root, batch.keys.data(), batch.keys.size());
+#endif
+    for (auto key : batch.keys)
+        rb_remove(shard_list[from].root, key);
+    publish(next);
+    moves++;
+}
+
+/**
+ * one balance step, true if a boundary moved
+ */
+bool ShardedRBTree::balance_step(void)
+{
+    shard_table *t = table.load(); // only we free tables
+    vector<unsigned long> load(shard_count);
+    unsigned long total = 0;
+    for (int i = 0; i < shard_count; i++)
+    {
+        load[i] = shard_list[i].load.load(memory_order_relaxed);
+        total += load[i];
+    }
+    if (total < (unsigned long)SHARD_BALANCE_MIN * shard_count)
+        return false;
+    for (int i = 0; i < shard_count; i++)
+        shard_list[i].load.fetch_sub(load[i], memory_order_relaxed);
+
+    int busy = max_element(load.begin(), load.end()) - load.begin();
+    if (load[busy] < SHARD_SKEW * total / shard_count || busy > (int)t->bounds.size())
+        return false;
+    int to = busy > 0 ? busy - 1 : -1;
+    if (busy + 1 < shard_count && (to < 0 || load[busy + 1] < load[to]))
+        to = busy + 1;
+    if (to < 0)
+        return false;
+
+    // sampled keys that still belong to the busy shard
+    vector<tree_key> keys;
+    unsigned long sampled = shard_list[busy].sample_next.load(memory_order_relaxed);
+    for (unsigned long i = 0; i < sampled && i < SHARD_SAMPLES; i++)
+    {
+        tree_key key = shard_list[busy].samples[i].load(memory_order_relaxed);
+        if (route(t, key) == busy)
+            keys.push_back(key);
+    }
+    size_t m = keys.size();
+    if (m < SHARD_SAMPLES / 4)
+        return false;
+    sort(keys.begin(), keys.end(), key_less);
+
+    // hand over about half the difference, equal keys stay together
+    double share = (double)(load[busy] - load[to]) / (2.0 * load[busy]);
+    size_t first; // first sample that stays, or moves for the right neighbour
+    tree_key bound;
+    if (to == busy + 1)
+    {
+        first = m - (size_t)(share * m);
+        if (first >= m)
+            return false;
+        first = lower_bound(keys.begin(), keys.end(), keys[first], key_less) - keys.begin();
+    }
+    else
+    {
+        first = (size_t)(share * m);
+        if (first == 0)
+            return false;
+        first = upper_bound(keys.begin(), keys.end(), keys[first - 1], key_less) - keys.begin();
+        if (first >= m)
+            return false;
+    }
+    bound = keys[first];
+    double moved = (double)load[busy] * (to == busy + 1 ? m - first : first) / m;
+    if (max(load[busy] - moved, load[to] + moved) > 0.9 * load[busy])
+        return false;
+
+    // keep the keys that have to wait for the move few
+    key_batch batch;
+    if (to == busy + 1)
+    {
+        bool has_hi = busy < (int)t->bounds.size();
+        collect_keys(shard_list[busy].root, bound, has_hi, has_hi ? t->bounds[busy] : bound,
+                     -1, &batch);
+        if (batch.keys.size() > SHARD_MOVE_MAX)
+            bound = batch.keys[batch.keys.size() - SHARD_MOVE_MAX];
+    }
+    else
+    {
+        collect_keys(shard_list[busy].root, t->bounds[to], true, bound,
+                     SHARD_MOVE_MAX + 1, &batch);
+        if (batch.keys.size() > SHARD_MOVE_MAX)
+            bound = batch.keys[SHARD_MOVE_MAX];
+    }
+
+    move_bound(busy, to, bound);
+    return true;
+}
+
+/**
+ * move a boundary if the load is skewed, see above
+ * returns whether one moved; false at once if another thread balances
+ */
+bool ShardedRBTree::balance(void)
+{
+    bool expect = false;
+    if (!balancing.compare_exchange_strong(expect, true))
+        return false;
+    context_scope_t scope(context());
+    bool moved = balance_step();
+    balancing = false;
+    return moved;
+}
+
+void *ShardedRBTree::balance_loop(void *arg)
+{
+    ShardedRBTree *tree = (ShardedRBTree *)arg;
+    while (!tree->stop)
+    {
+        usleep(SHARD_BALANCE_USEC);
+        tree->balance();
+    }
+    return NULL;
+}
+
+/**
+ * number of keys, only exact while no update runs
+ */
+long ShardedRBTree::size(void)
+{
+    long count = 0;
+    balancing_lock(&balancing);
+    for (int i = 0; i < shard_count; i++)
+        count += count_nodes(shard_list[i].root);
+    balancing = false;
+    return count;
+}
+
+typedef struct bound_check_t
+{
+    shard_table *table;
+    int shard;
+    bool ok;
+} bound_check;
+
+static bool check_bound(tree_key key RB_VALUE_PARAM, void *arg)
+{
+    bound_check *check = (bound_check *)arg;
+    check->ok = check->ok && route(check->table, key) == check->shard;
+    return check->ok;
+}
+
+/**
+ * check every shard and that its keys are within its bounds, no update
+ * may run
+ */
+bool ShardedRBTree::check(void)
+{
+    balancing_lock(&balancing);
+    shard_table *t = table.load();
+    bool ok = true;
+    for (int i = 0; ok && i < shard_count; i++)
+    {
+        tree_node *root = shard_list[i].root;
+        ok = check_tree_dfs(root->left_child);
+        if (!ok || is_leaf(root->left_child))
+            continue;
+
+        // from the smallest key, whatever it is
+        tree_node *node = root->left_child;
+        while (!is_leaf(node->left_child))
+            node = node->left_child;
+        tree_node *last = root->left_child;
+        while (!is_leaf(last->right_child))
+            last = last->right_child;
+        bound_check check = {t, i, true};
+        rb_scan(root, node->key, last->key, check_bound, &check);
+        ok = check.ok;
+    }
+    balancing = false;
+    return ok;
+}
@@ -0,0 +1,289 @@
+#include "tree.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/******************
+ * snapshot images
+ ******************/
+
+/**
+ * A snapshot is the keys of a tree in increasing order, and the values
+ * in the same order with TREE_VALUE, behind a header of one cache line:
+ *
+ *   header | keys[count] | padding to a cache line | values[count]
+ *
+ * The image holds no pointers, so it can be mapped anywhere, and a
+ * sorted array is all rb_build() needs to put the tree back together
+ * in O(n) without a single search. Until then rb_snapshot_find() looks
+ * keys up by binary search right in the mapping, so the first lookup
+ * after a restart only waits for the pages it touches. The header
+ * records the key and value sizes, so a program built with other types
+ * refuses the image instead of misreading it; it is native byte order.
+ *
+ * rb_snapshot_save() writes a temporary file next to the image and
+ * renames it over the image once it is on disk, so a crash leaves the
+ * old snapshot or the new one, never a torn one. The directory is synced
+ * after the rename, or the rename itself could be lost in a crash.
+ */
+
+#define SNAPSHOT_MAGIC 0x3150414e53425254UL // "TRBSNAP1"
+#define SNAPSHOT_VERSION 1
+
+typedef struct alignas(CACHE_LINE_SIZE) snapshot_header_t
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t key_size;
+    uint32_t value_size; // 0 without TREE_VALUE
+    uint32_t reserved;
+    uint64_t count;
+} snapshot_header;
+
+#ifdef TREE_VALUE
+static size_t values_offset(uint64_t count)
+{
+    size_t end = sizeof(snapshot_header) + count * sizeof(tree_key);
+    return (end + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+#endif
+
+static size_t image_size(uint64_t count)
+{
+#ifdef TREE_VALUE
+    return values_offset(count) + count * sizeof(tree_value);
+#else
+    return sizeof(snapshot_header) + count * sizeof(tree_key);
+#endif
+}
+
+typedef struct snapshot_writer_t
+{
+    FILE *keys; // the image itself
+#ifdef TREE_VALUE
+    FILE *values; // values go to their own file until the count is known
+#endif
+    uint64_t count;
+    bool failed;
+} snapshot_writer;
+
+/**
+ * write the keys below node in order, with a stack instead of recursion
+ */
+static void write_keys(snapshot_writer *w, tree_node *node)
+{
+    vector<tree_node *> stack;
+    while (!w->failed && (!is_leaf(node) || !stack.empty()))
+    {
+        if (!is_leaf(node))
+        {
+            stack.push_back(node);
+            node = node->left_child;
+            continue;
+        }
+        node = stack.back();
+        stack.pop_back();
+        w->failed = fwrite(&node->key, sizeof(tree_key), 1, w->keys) != 1;
+#ifdef TREE_VALUE
+        w->failed = w->failed || fwrite(&node->value, sizeof(tree_value), 1, w->values) != 1;
+#endif
+        w->count++;
+        node = node->right_child;
+    }
+}
+
+#ifdef TREE_VALUE
+/**
+ * append the values after the keys, at their offset
+ */
+static bool append_values(snapshot_writer *w)
+{
+    static char zero[CACHE_LINE_SIZE];
+    size_t pad = values_offset(w->count) - image_size(0) - w->count * sizeof(tree_key);
+    if (pad > 0 && fwrite(zero, 1, pad, w->keys) != pad)
+        return false;
+    if (fflush(w->values) != 0 || fseek(w->values, 0, SEEK_SET) != 0)
+        return false;
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), w->values)) > 0)
+    {
+        if (fwrite(buf, 1, n, w->keys) != n)
+            return false;
+    }
+    return !ferror(w->values);
+}
+#endif
+
+/**
+ * fsync the directory path is in, false with errno set if that fails
+ */
+static bool sync_dir(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    string dir = slash == NULL ? "." : slash == path ? "/" : string(path, slash - path);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+        return false;
+    int failed = fsync(fd);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return failed == 0;
+}
+
+/**
+ * write the keys of the tree to an image at path, replacing the one
+ * there once the new one is complete
+ * no update may run meanwhile
+ * returns the number of keys written, -1 on an error with errno set;
+ * if only syncing the directory failed, the new image is in place but a
+ * crash may still bring back the old one
+ */
+long rb_snapshot_save(tree_node *root, const char *path)
+{
+    string tmp = string(path) + ".tmp";
+    snapshot_writer w;
+    w.keys = fopen(tmp.c_str(), "wb");
+    if (w.keys == NULL)
+        return -1;
+#ifdef TREE_VALUE
+    w.values = tmpfile();
+    if (w.values == NULL)
+    {
+        fclose(w.keys);
+        unlink(tmp.c_str());
+        return -1;
+    }
+#endif
+    w.count = 0;
+
+    snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    w.failed = fwrite(&header, sizeof(header), 1, w.keys) != 1;
+    write_keys(&w, root->left_child);
+#ifdef TREE_VALUE
+    w.failed = w.failed || !append_values(&w);
+    fclose(w.values);
+#endif
+
+    // the header goes in last, an image without one is never valid
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.key_size = sizeof(tree_key);
+#ifdef TREE_VALUE
+    header.value_size = sizeof(tree_value);
+#endif
+    header.count = w.count;
+    w.failed = w.failed || fflush(w.keys) != 0 || fseek(w.keys, 0, SEEK_SET) != 0 ||
+               fwrite(&header, sizeof(header), 1, w.keys) != 1 || fflush(w.keys) != 0 ||
+               fsync(fileno(w.keys)) != 0;
+    int saved_errno = errno;
+    w.failed = fclose(w.keys) != 0 || w.failed;
+    if (w.failed || rename(tmp.c_str(), path) != 0)
+    {
+        saved_errno = errno ? errno : saved_errno;
+        unlink(tmp.c_str());
+        errno = saved_errno;
+        return -1;
+    }
+    // the new image is in place, but only durable once its directory is
+    if (!sync_dir(path))
+        return -1;
+    return (long)w.count;
+}
+
+/**
+ * map the image at path, NULL if it cannot be read or is not an image
+ * of this build's key and value types
+ */
+rb_snapshot *rb_snapshot_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(snapshot_header))
+    {
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (map == MAP_FAILED)
+        return NULL;
+
+    snapshot_header *header = (snapshot_header *)map;
+#ifdef TREE_VALUE
+    uint32_t value_size = sizeof(tree_value);
+#else
+    uint32_t value_size = 0;
+#endif
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION ||
+        header->key_size != sizeof(tree_key) || header->value_size != value_size ||
+        header->count > (uint64_t)st.st_size || image_size(header->count) != (size_t)st.st_size)
+    {
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    rb_snapshot *snap = new rb_snapshot;
+    snap->map = map;
+    snap->map_size = st.st_size;
+    snap->count = (long)header->count;
+    snap->keys = (const tree_key *)((char *)map + sizeof(snapshot_header));
+#ifdef TREE_VALUE
+    snap->values = (const tree_value *)((char *)map + values_offset(header->count));
+#endif
+    return snap;
+}
+
+void rb_snapshot_close(rb_snapshot *snap)
+{
+    munmap(snap->map, snap->map_size);
+    delete snap;
+}
+
+/**
+ * look key up in the image, by binary search
+ */
+bool rb_snapshot_find(rb_snapshot *snap, tree_key key RB_VALUE_OUT)
+{
+    long lo = 0, hi = snap->count;
+    while (lo < hi)
+    {
+        long mid = lo + (hi - lo) / 2;
+        if (key_less(snap->keys[mid], key))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == snap->count || key_less(key, snap->keys[lo]))
+        return false;
+#ifdef TREE_VALUE
+    *value = snap->values[lo];
+#endif
+    return true;
+}
+
+/**
+ * fill an empty tree from the image with rb_build(), see there
+ */
+bool rb_snapshot_build(tree_node *root, rb_snapshot *snap, int threads)
+{
+    // read once from start to end
+    madvise(snap->map, snap->map_size, MADV_SEQUENTIAL);
+#ifdef TREE_VALUE
+    bool built = rb_build(root, snap->keys, snap->values, snap->count, threads);
+#else
+    bool built = rb_build(root, snap->keys, snap->count, threads);
+#endif
+    madvise(snap->map, snap->map_size, MADV_RANDOM);
+    return built;
+}
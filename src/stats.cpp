@@ -0,0 +1,117 @@
+#include "tree.h"
+
+#include <atomic>
+
+/******************
+ * operation counters
+ ******************/
+
+/**
+ * Every thread counts into a record of its own, so counting is a plain
+ * load and store without any shared cache line. Records are on a global
+ * list that rb_get_stats() sums up. A thread gives its record back when
+ * it exits and the next new thread keeps counting in it, so nothing that
+ * has been counted is lost and the list only grows to the largest
+ * number of threads alive at the same time.
+ */
+
+typedef struct stats_record_t
+{
+    atomic<unsigned long> count[STAT_COUNTERS];
+    atomic<bool> in_use;
+    struct stats_record_t *next;
+} stats_record;
+
+static atomic<stats_record *> records(NULL);
+
+thread_local atomic<unsigned long> *thread_stats = NULL;
+
+struct stats_thread_t
+{
+    stats_record *record = NULL;
+
+    ~stats_thread_t()
+    {
+        if (record == NULL)
+            return;
+        thread_stats = NULL;
+        record->in_use = false;
+    }
+};
+
+static thread_local stats_thread_t stats_thread;
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "flag failures", "insert restarts", "remove restarts", "find restarts",
+    "marker conflicts", "inserter retries", "deleter retries",
+    "insert case 1", "insert case 2", "insert case 3",
+    "remove case 1", "remove case 2", "remove case 3", "remove case 4",
+    "insert exists", "fixup lock", "insert move-ups", "remove move-ups"};
+
+/**
+ * find a free record or append a new one, on the first count of a thread
+ */
+atomic<unsigned long> *stats_register(void)
+{
+    stats_record *rec;
+    for (rec = records; rec != NULL; rec = rec->next)
+    {
+        bool expect = false;
+        if (!rec->in_use && rec->in_use.compare_exchange_strong(expect, true))
+            break;
+    }
+
+    if (rec == NULL)
+    {
+        rec = new stats_record;
+        for (int i = 0; i < STAT_COUNTERS; i++)
+            rec->count[i] = 0;
+        rec->in_use = true;
+
+        stats_record *head = records;
+        do {
+            rec->next = head;
+        } while (!records.compare_exchange_weak(head, rec));
+    }
+
+    stats_thread.record = rec;
+    thread_stats = rec->count;
+    return thread_stats;
+}
+
+/**
+ * sum up the counters of all threads
+ */
+void rb_get_stats(rb_stats *stats)
+{
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        stats->count[i] = 0;
+    for (stats_record *rec = records; rec != NULL; rec = rec->next)
+    {
+        for (int i = 0; i < STAT_COUNTERS; i++)
+            stats->count[i] += rec->count[i].load(memory_order_relaxed);
+    }
+}
+
+/**
+ * set all counters back to 0, counts of operations running meanwhile
+ * may be lost
+ */
+void rb_reset_stats(void)
+{
+    for (stats_record *rec = records; rec != NULL; rec = rec->next)
+    {
+        for (int i = 0; i < STAT_COUNTERS; i++)
+            rec->count[i].store(0, memory_order_relaxed);
+    }
+}
+
+/**
+ * name of a counter, for reports
+ */
+const char *rb_stats_name(int counter)
+{
+    if (counter < 0 || counter >= STAT_COUNTERS)
+        return "unknown";
+    return counter_names[counter];
+}
@@ -23,5 +23,13 @@ int main(int argc, char const *argv[])
     // show_tree(root);
     // rb_remove(root, 3);
     // show_tree(root);
+
+    // the same keys through the template facade, a set of the build's keys
+    LockFreeRBMap<> set;
+    for (tree_key key = 1; key <= 7; key++)
+        set.insert(key);
+    set.remove(3);
+    if (!set.check() || set.size() != 6 || set.find(3) || !set.find(7))
+        return 1;
     return 0;
 }
@@ -0,0 +1,252 @@
+#include "tree.h"
+#include "bench.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+/**
+ * allocation test
+ *
+ * Counts the heap allocations of rb_insert(), rb_remove() and
+ * rb_lookup(), and of the LockFreeRBTree calls, once the tree and the
+ * per-thread state have warmed up, and fails if there is any. malloc()
+ * and friends of this program are counting wrappers around glibc's, so
+ * operator new, the node slabs and the reclamation lists are all seen.
+ *
+ * A tree is prefilled with the even keys; every thread then inserts and
+ * removes the odd keys of its own share over and over, with a lookup
+ * after every update. The first rounds warm up: the slabs fill their
+ * free lists and the retire lists reach their size. The allocations of
+ * the rounds after that are counted per operation kind. This runs once
+ * for each reclamation scheme that frees nodes.
+ *
+ * usage: ./test_alloc [threads] [keys per thread]
+ */
+
+using namespace std;
+
+#define WARMUP_ROUNDS 20
+#define COUNTED_ROUNDS 20
+
+bool remove_dbg = false; // dbg_printf
+
+/* allocations of the calling thread */
+static thread_local long allocations;
+
+extern "C"
+{
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    allocations++;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    allocations++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    allocations++;
+    void *mem = __libc_memalign(alignment, size);
+    if (mem == NULL)
+        return ENOMEM;
+    *ptr = mem;
+    return 0;
+}
+}
+
+#define OP_INSERT 0
+#define OP_REMOVE 1
+#define OP_LOOKUP 2
+#define OP_KINDS 3
+const char *OP_NAMES[] = {"insert", "remove", "lookup"};
+
+typedef struct worker_t
+{
+    alignas(CACHE_LINE_SIZE) long index;
+    long allocs[OP_KINDS];
+    long ops[OP_KINDS];
+    bool valid;
+} worker;
+
+tree_node *root;
+LockFreeRBTree *object; // NULL for the free functions
+long keys_per_thread = 2000;
+int thread_count = 4;
+pthread_barrier_t round_barrier;
+
+/**
+ * key i of thread index, odd, so never one of the prefill
+ */
+static inline tree_key own_key(long index, long i)
+{
+    return (tree_key)(2 * (index * keys_per_thread + i) + 1);
+}
+
+/**
+ * one operation, its allocations added to w if counted
+ */
+static bool run_op(worker *w, int kind, tree_key key, bool counted)
+{
+    long before = allocations;
+    bool done;
+    if (kind == OP_INSERT)
+        done = object != NULL ? object->insert(key) : rb_insert(root, key);
+    else if (kind == OP_REMOVE)
+    {
+        // removes report nothing, the lookup after them checks
+        if (object != NULL)
+            object->remove(key);
+        else
+            rb_remove(root, key);
+        done = true;
+    }
+    else
+        done = object != NULL ? object->find(key) : rb_lookup(root, key);
+    if (counted)
+    {
+        w->allocs[kind] += allocations - before;
+        w->ops[kind]++;
+    }
+    return done;
+}
+
+void *run_worker(void *p)
+{
+    worker *w = (worker *)p;
+    if (object == NULL)
+        thread_index_init(w->index);
+    for (int round = 0; round < WARMUP_ROUNDS + COUNTED_ROUNDS; round++)
+    {
+        bool counted = round >= WARMUP_ROUNDS;
+        pthread_barrier_wait(&round_barrier);
+        for (long i = 0; i < keys_per_thread; i++)
+        {
+            tree_key key = own_key(w->index, i);
+            w->valid = run_op(w, OP_INSERT, key, counted) && w->valid;
+            w->valid = run_op(w, OP_LOOKUP, key, counted) && w->valid;
+        }
+        for (long i = 0; i < keys_per_thread; i++)
+        {
+            tree_key key = own_key(w->index, i);
+            w->valid = run_op(w, OP_REMOVE, key, counted) && w->valid;
+            w->valid = !run_op(w, OP_LOOKUP, key, counted) && w->valid;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * one run on a new tree, false if anything allocated or went wrong
+ */
+bool run(const char *name, bool use_object)
+{
+    long prefill = thread_count * keys_per_thread;
+    vector<tree_key> keys(prefill);
+    for (long i = 0; i < prefill; i++)
+        keys[i] = (tree_key)(2 * i + 2);
+    if (use_object)
+    {
+        object = new LockFreeRBTree;
+        object->build(keys.data(), prefill, 1);
+    }
+    else
+    {
+        object = NULL;
+        root = rb_init();
+        thread_index_init(0);
+        rb_build(root, keys.data(), prefill, 1);
+    }
+
+    vector<worker> workers(thread_count);
+    vector<pthread_t> tid(thread_count);
+    pthread_barrier_init(&round_barrier, NULL, thread_count);
+    for (int i = 0; i < thread_count; i++)
+    {
+        workers[i].index = i;
+        for (int k = 0; k < OP_KINDS; k++)
+            workers[i].allocs[k] = workers[i].ops[k] = 0;
+        workers[i].valid = true;
+        pthread_create(&tid[i], NULL, run_worker, &workers[i]);
+    }
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(tid[i], NULL);
+    pthread_barrier_destroy(&round_barrier);
+
+    bool valid = true;
+    long allocs = 0;
+    printf("%-16s", name);
+    for (int k = 0; k < OP_KINDS; k++)
+    {
+        long kind_allocs = 0, ops = 0;
+        for (auto &w : workers)
+        {
+            kind_allocs += w.allocs[k];
+            ops += w.ops[k];
+        }
+        allocs += kind_allocs;
+        printf(" %s %.4f", OP_NAMES[k], (double)kind_allocs / ops);
+        if (k < OP_KINDS - 1)
+            printf(",");
+    }
+    printf(" allocations per op");
+    for (auto &w : workers)
+        valid = valid && w.valid;
+    if (use_object)
+    {
+        valid = valid && object->size() == prefill && object->check();
+        delete object;
+        object = NULL;
+    }
+    else
+    {
+        valid = valid && count_nodes(root) == prefill && check_tree_dfs(root->left_child);
+        rb_destroy(root);
+    }
+    printf("%s%s\n", valid ? "" : ", WRONG RESULTS", allocs == 0 ? "" : ", ALLOCATES");
+    return valid && allocs == 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        thread_count = atoi(argv[1]);
+    if (argc > 2)
+        keys_per_thread = atol(argv[2]);
+    printf("%d threads, %ld keys each, %d warm-up and %d counted rounds\n", thread_count,
+           keys_per_thread, WARMUP_ROUNDS, COUNTED_ROUNDS);
+
+    bool ok = true;
+    reclaim_init(RECLAIM_EPOCH);
+    ok = run("epoch", false) && ok;
+    ok = run("epoch, object", true) && ok;
+    reclaim_init(RECLAIM_HAZARD);
+    ok = run("hazard pointers", false) && ok;
+    return ok ? 0 : 1;
+}
@@ -1,89 +1,781 @@
 #include "tree.h"
+#include "bench.h"
+#include "baselines.h"
+#include "key_file.h"
 
 #include <iostream>
-#include <fstream>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <time.h>
 #include <unistd.h>
 #include <vector>
 #include <iomanip>
+#include <atomic>
+#include <algorithm>
 
-// #define COMPUTATION_TIME_SEC 0.3  // in sec
-// #define COMPUTATION_TIME_USEC COMPUTATION_TIME_SEC * 1000000    // in usec
+/**
+ * benchmark driver
+ *
+ * Runs a mix of lookups, inserts and removes on a prefilled tree for a
+ * fixed time, once for every thread count, and reports the operations
+ * per second of each kind. The threads wait at a barrier before the
+ * clock starts, so creating them is not timed. Every thread draws its
+ * operations and keys on its own, from the distribution chosen with -k.
+ * Each operation is timed into a per-thread latency histogram, and the
+ * merged percentiles are printed for every operation kind. Lookups are
+ * the optimistic rb_lookup(); -q adds searches through tree_search(),
+ * which takes flags hand over hand like an update, and the sweep times
+ * one of every key between its inserts and removes.
+ *
+ * With -T the threads replay a key file instead, usually one written by
+ * gen_workload: each thread takes its own equal slice of the file and
+ * runs through it from the start again until the time is up. The
+ * operations come from the file if it is a trace, or are drawn with the
+ * percentages as usual; the keys range up to the largest key in it.
+ *
+ * With -P every thread is pinned (see topology.cpp): compact fills the
+ * cpus of one NUMA node before the next, scatter puts the threads on
+ * the nodes in turn, socket gives every node an equal share of them and
+ * lets them move within it. The mixed mode reports how many nodes the
+ * threads of a run were spread over, so runs across sockets can be told
+ * from runs within one.
+ *
+ * Every structure given with -b runs the same workload through the
+ * BenchSet interface (see baselines.h), and each one's throughput and
+ * memory are reported relative to the first.
+ *
+ * usage: ./test_parallel [options]
+ *   -r PCT    lookups in percent (default 80)
+ *   -i PCT    inserts in percent (default 10)
+ *   -d PCT    removes in percent (default 10)
+ *   -q PCT    searches through tree_search() in percent (default 0)
+ *   -k DIST   uniform, zipf[:theta] (0.99), sequential or
+ *             hotspot[:key percent:access percent] (20:80)
+ *   -n KEYS   keys are 1..KEYS (default 1000000)
+ *   -p KEYS   keys in the tree before each run (default KEYS / 2)
+ *   -t LIST   thread counts, comma separated (default 1,2,4,8,16)
+ *   -s SEC    seconds per run (default 1)
+ *   -w USEC   work between two operations, spent spinning (default 0)
+ *   -W SEC    a run whose threads have not stopped SEC seconds after its
+ *             time is up is reported stuck and ends the program with exit
+ *             code 3 (default 10)
+ *   -b LIST   structures, comma separated, or all (default lockfree)
+ *   -S        the insert then remove sweep over a key file instead
+ *   -f FILE   key file of -S, binary or text, see key_file.h (default data.txt)
+ *   -T FILE   replay the keys, and the operations of a trace, of a key file
+ *   -P POLICY none (default), compact, scatter or socket thread pinning
+ *   -N NODES  pin to a simulated topology of that many nodes
+ */
 
 using namespace std;
 
 vector<int> THREADS_NUM_LIST = {1, 2, 4, 8, 16};
 vector<float> COMPUTATION_TIME_LIST = {0, 0.000001, 0.00001, 0.0001, 0.001};
 vector<vector<double>> test_time_list;
+#define INSERT_BATCH_SIZE 1000 // keys per rb_insert_batch() call
+#define BATCH_COMPARE_ROUNDS 5 // best of, the data set is small
 
-int total_size = 0, size_per_thread = 0;
-int numbers[1000001];
-tree_node *root;
+long total_size = 0, size_per_thread = 0;
+const tree_key *numbers; // the keys of the sweep, in the key file
+key_file sweep_keys;
+const char *key_path = "data.txt";
+key_file trace; // -T, count 0 without
+const char *trace_path = NULL;
+tree_node *root; // batch compare
+BenchSet *set;    // the structure under test
+vector<string> STRUCTURES = {"lockfree"};
 int sleep_time = 0;
+int pin_policy = PIN_NONE;
+const char *PIN_NAMES[] = {"none", "compact", "scatter", "socket", NULL};
 
 bool remove_dbg = false; // dbg_printf
 extern pthread_mutex_t show_tree_lock;
 
+/* mixed workload */
+#define DIST_UNIFORM 0
+#define DIST_ZIPF 1
+#define DIST_SEQUENTIAL 2
+#define DIST_HOTSPOT 3
+
+#define OP_LOOKUP 0
+#define OP_INSERT 1
+#define OP_REMOVE 2
+#define OP_SEARCH 3 // tree_search(), see BenchSet::search()
+#define OP_KINDS 4
+
+typedef struct workload_t
+{
+    int percent[OP_KINDS]; // lookups, inserts, removes, searches
+    int dist;
+    double zipf_theta;
+    double hot_keys;   // hotspot: share of the keys that are hot
+    double hot_access; // hotspot: share of the accesses that go to them
+    long key_range;
+    long prefill; // -1 is key_range / 2
+    double duration;
+    double think_time; // seconds
+} workload;
+
+workload mix = {{80, 10, 10, 0}, DIST_UNIFORM, 0.99, 0.2, 0.8, 1000000, -1, 1, 0};
+const char *DIST_NAMES[] = {"uniform", "zipf", "sequential", "hotspot"};
+const char *OP_NAMES[] = {"lookup", "insert", "remove", "search"};
+
+/* zipf constants, see zipf_init() */
+double zipf_zetan, zipf_eta, zipf_alpha, zipf_two;
+
+typedef struct key_gen_t
+{
+    unsigned long long state; // xorshift64*
+    long cursor;              // next sequential key
+} key_gen;
+
+typedef struct worker_result_t
+{
+    alignas(CACHE_LINE_SIZE) long ops[OP_KINDS];
+    long inserted; // inserts of keys that were not there
+    int node;      // NUMA node of the thread
+    latency_histogram latency[OP_KINDS];
+    atomic<int> kind; // the operation under way, see join_workers()
+    atomic<tree_key> key;
+} worker_result;
+
+int run_threads;
+pthread_barrier_t start_barrier;
+atomic<bool> stop_run(false);
+double watchdog = 10; // -W, seconds
+vector<worker_result> results;
+vector<latency_histogram> thread_latency; // sweep, one per thread
+
 /* function headers */
-void load_data_from_txt();
-int run_multi_thread_insert(int thread_count);
-int run_multi_thread_remove(int thread_count);
+bool load_keys(const char *path);
+bool load_trace(const char *path);
+double run_multi_thread_insert(int thread_count);
+double run_multi_thread_insert_batch(int thread_count);
+double run_multi_thread_remove(int thread_count);
+double run_multi_thread_search(int thread_count);
 void *run(void *p);
 void run_serial();
 void run_insert_remove();
+void run_sweep();
+void run_batch_compare(int thread_count);
+bool run_mixed_workload(const string &structure, int thread_count, double *throughput, long *memory);
+bool parse_dist(const char *arg);
+bool parse_threads(char *arg);
+bool parse_structures(char *arg);
+bool parse_pin(const char *arg);
+void print_relative(const char *what, const vector<double> &values, bool lower_better);
+void print_memory();
+void zipf_init();
+void print_reclaim_stats();
+void print_op_stats();
+void print_latency(const char *name);
+const char *latency_name(const string &structure, int kind);
 
 int main(int argc, char **argv)
 {
-    // test settings
-    int num_processes_i = 1;
-    int num_processes_r = 1;
-    if (argc == 2)
+    bool sweep = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:i:d:q:k:n:p:t:s:w:W:b:Sf:T:P:N:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            mix.percent[OP_LOOKUP] = atoi(optarg);
+            break;
+        case 'i':
+            mix.percent[OP_INSERT] = atoi(optarg);
+            break;
+        case 'd':
+            mix.percent[OP_REMOVE] = atoi(optarg);
+            break;
+        case 'q':
+            mix.percent[OP_SEARCH] = atoi(optarg);
+            break;
+        case 'k':
+            if (!parse_dist(optarg))
+            {
+                fprintf(stderr, "[ERROR] unknown key distribution %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'n':
+            mix.key_range = atol(optarg);
+            break;
+        case 'p':
+            mix.prefill = atol(optarg);
+            break;
+        case 't':
+            if (!parse_threads(optarg))
+            {
+                fprintf(stderr, "[ERROR] bad thread counts %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 's':
+            mix.duration = atof(optarg);
+            break;
+        case 'w':
+            mix.think_time = atof(optarg) * 1e-6;
+            break;
+        case 'W':
+            watchdog = atof(optarg);
+            break;
+        case 'b':
+            if (!parse_structures(optarg))
+            {
+                fprintf(stderr, "[ERROR] bad structure list %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'S':
+            sweep = true;
+            break;
+        case 'f':
+            key_path = optarg;
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'P':
+            if (!parse_pin(optarg))
+            {
+                fprintf(stderr, "[ERROR] unknown pinning policy %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'N':
+            topo_init(atoi(optarg));
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r lookup%%] [-i insert%%] [-d remove%%] [-q search%%] "
+                            "[-k uniform|zipf[:theta]|sequential|hotspot[:keys%%:access%%]] "
+                            "[-n keys] [-p prefill] [-t threads,...] [-s seconds] "
+                            "[-w think usec] [-W watchdog seconds] [-b lockfree,mutex,rwlock,btree,skiplist,sharded[:N]|all] "
+                            "[-S] [-f key file] [-T trace file] "
+                            "[-P none|compact|scatter|socket] [-N simulated nodes]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (pin_policy != PIN_NONE)
+        printf("%d NUMA node%s%s, %d cpus, threads pinned %s\n", topo_nodes(),
+               topo_nodes() > 1 ? "s" : "", topo_simulated() ? " (simulated)" : "", topo_cpus(),
+               PIN_NAMES[pin_policy]);
+
+    if (sweep)
+    {
+        if (!load_keys(key_path))
+            return 1;
+        run_sweep();
+        return 0;
+    }
+
+    int percent_sum = 0;
+    bool percent_valid = true;
+    for (int i = 0; i < OP_KINDS; i++)
+    {
+        percent_sum += mix.percent[i];
+        percent_valid = percent_valid && mix.percent[i] >= 0;
+    }
+    if (percent_sum != 100 || !percent_valid)
+    {
+        fprintf(stderr, "[ERROR] lookup, insert, remove and search percent must add up to 100.\n");
+        return 1;
+    }
+    if (mix.key_range < 1)
+    {
+        fprintf(stderr, "[ERROR] need at least 1 key.\n");
+        return 1;
+    }
+    if (trace_path != NULL && !load_trace(trace_path))
+        return 1;
+    if (mix.prefill < 0)
+        mix.prefill = mix.key_range / 2;
+    mix.prefill = min(mix.prefill, mix.key_range);
+    if (mix.dist == DIST_ZIPF)
+        zipf_init();
+
+    if (trace.ops != NULL)
+        printf("operations and keys of %s", trace_path);
+    else
+    {
+        printf("%d%% lookup %d%% insert %d%% remove", mix.percent[OP_LOOKUP],
+               mix.percent[OP_INSERT], mix.percent[OP_REMOVE]);
+        if (mix.percent[OP_SEARCH] > 0)
+            printf(" %d%% search", mix.percent[OP_SEARCH]);
+        if (trace.count > 0)
+            printf(", keys of %s", trace_path);
+        else
+            printf(", %s keys", DIST_NAMES[mix.dist]);
+    }
+    printf(" 1..%ld, prefill %ld, %gs per run\n", mix.key_range, mix.prefill, mix.duration);
+
+    bool valid = true;
+    for (auto thread_num : THREADS_NUM_LIST)
+    {
+        vector<double> throughput(STRUCTURES.size());
+        vector<double> memory(STRUCTURES.size());
+        for (size_t s = 0; s < STRUCTURES.size(); s++)
+        {
+            long bytes;
+            valid = run_mixed_workload(STRUCTURES[s], thread_num, &throughput[s], &bytes) && valid;
+            memory[s] = bytes;
+        }
+        print_relative("throughput", throughput, false);
+        print_relative("memory", memory, true);
+    }
+
+    return valid ? 0 : 1;
+}
+
+/**
+ * -k argument, the numbers after the name are optional
+ */
+bool parse_dist(const char *arg)
+{
+    if (strcmp(arg, "uniform") == 0)
+        mix.dist = DIST_UNIFORM;
+    else if (strcmp(arg, "sequential") == 0)
+        mix.dist = DIST_SEQUENTIAL;
+    else if (strncmp(arg, "zipf", 4) == 0)
+    {
+        mix.dist = DIST_ZIPF;
+        if (arg[4] == ':')
+            mix.zipf_theta = atof(arg + 5);
+        else if (arg[4] != '\0')
+            return false;
+        // the generator divides by 1 - theta
+        return mix.zipf_theta > 0 && mix.zipf_theta < 1;
+    }
+    else if (strncmp(arg, "hotspot", 7) == 0)
+    {
+        mix.dist = DIST_HOTSPOT;
+        double keys, access;
+        if (arg[7] == ':')
+        {
+            if (sscanf(arg + 8, "%lf:%lf", &keys, &access) != 2)
+                return false;
+            mix.hot_keys = keys / 100;
+            mix.hot_access = access / 100;
+        }
+        else if (arg[7] != '\0')
+            return false;
+        return mix.hot_keys > 0 && mix.hot_keys <= 1 &&
+               mix.hot_access >= 0 && mix.hot_access <= 1;
+    }
+    else
+        return false;
+    return true;
+}
+
+/**
+ * -t argument, replaces THREADS_NUM_LIST
+ */
+bool parse_threads(char *arg)
+{
+    THREADS_NUM_LIST.clear();
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        int threads = atoi(tok);
+        if (threads < 1 || threads > NODE_MARKER_MAX + 1)
+            return false;
+        THREADS_NUM_LIST.push_back(threads);
+    }
+    return !THREADS_NUM_LIST.empty();
+}
+
+/**
+ * -P argument
+ */
+bool parse_pin(const char *arg)
+{
+    for (int i = 0; PIN_NAMES[i] != NULL; i++)
+    {
+        if (strcmp(arg, PIN_NAMES[i]) == 0)
+        {
+            pin_policy = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * -b argument, replaces STRUCTURES
+ */
+bool parse_structures(char *arg)
+{
+    STRUCTURES.clear();
+    if (strcmp(arg, "all") == 0)
+    {
+        for (int i = 0; BENCH_SET_NAMES[i] != NULL; i++)
+            STRUCTURES.push_back(BENCH_SET_NAMES[i]);
+        return true;
+    }
+    for (char *tok = strtok(arg, ","); tok != NULL; tok = strtok(NULL, ","))
+    {
+        BenchSet *probe = bench_set_create(tok);
+        if (probe == NULL)
+            return false;
+        delete probe;
+        STRUCTURES.push_back(tok);
+    }
+    return !STRUCTURES.empty();
+}
+
+/**
+ * values of every structure over the value of the first one, nothing
+ * for a single structure
+ */
+void print_relative(const char *what, const vector<double> &values, bool lower_better)
+{
+    if (values.size() < 2)
+        return;
+    printf("    %s relative to %s:", what, STRUCTURES[0].c_str());
+    for (size_t s = 1; s < values.size(); s++)
+        printf(" %s %.2fx", STRUCTURES[s].c_str(), values[0] > 0 ? values[s] / values[0] : 0);
+    printf(lower_better ? " (lower is better)\n" : "\n");
+}
+
+/**
+ * the zipfian generator of Gray et al. ("Quickly generating billion-record
+ * synthetic databases"), as YCSB uses it. Rank 0 is the most popular, so
+ * the hot keys are the smallest ones. zeta(n) is summed up once here.
+ */
+void zipf_init()
+{
+    double theta = mix.zipf_theta;
+    long n = mix.key_range;
+    zipf_zetan = 0;
+    for (long i = 1; i <= n; i++)
+        zipf_zetan += 1 / pow((double)i, theta);
+    double zeta2 = 1 + 1 / pow(2.0, theta);
+    zipf_alpha = 1 / (1 - theta);
+    zipf_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zipf_zetan);
+    zipf_two = zeta2;
+}
+
+/**
+ * uniform in [0, 1)
+ */
+static inline double next_unit(key_gen *gen)
+{
+    gen->state ^= gen->state >> 12;
+    gen->state ^= gen->state << 25;
+    gen->state ^= gen->state >> 27;
+    return ((gen->state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * next key in 1..key_range from the chosen distribution
+ */
+static inline long next_key(key_gen *gen)
+{
+    long n = mix.key_range;
+    switch (mix.dist)
+    {
+    case DIST_ZIPF:
+    {
+        double u = next_unit(gen);
+        double uz = u * zipf_zetan;
+        if (uz < 1)
+            return 1;
+        if (uz < zipf_two)
+            return 2;
+        long rank = (long)(n * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha));
+        return min(rank, n - 1) + 1;
+    }
+    case DIST_SEQUENTIAL:
+        return gen->cursor++ % n + 1;
+    case DIST_HOTSPOT:
+    {
+        long hot = max(1L, (long)(n * mix.hot_keys));
+        if (hot >= n || next_unit(gen) < mix.hot_access)
+            return (long)(next_unit(gen) * hot) + 1;
+        return hot + (long)(next_unit(gen) * (n - hot)) + 1;
+    }
+    }
+    return (long)(next_unit(gen) * n) + 1;
+}
+
+/**
+ * OP_ kind of the next operation, drawn with the percentages
+ */
+static inline int next_kind(key_gen *gen)
+{
+    int op = (int)(next_unit(gen) * 100);
+    if (op < mix.percent[OP_LOOKUP])
+        return OP_LOOKUP;
+    if (op < mix.percent[OP_LOOKUP] + mix.percent[OP_INSERT])
+        return OP_INSERT;
+    if (op < mix.percent[OP_LOOKUP] + mix.percent[OP_INSERT] + mix.percent[OP_REMOVE])
+        return OP_REMOVE;
+    return OP_SEARCH;
+}
+
+/**
+ * stand-in for the work a caller does between operations; spinning keeps
+ * the thread on its core, usleep() would measure the scheduler instead
+ */
+static void think(double seconds)
+{
+    double until = bench_now() + seconds;
+    while (bench_now() < until)
+        ;
+}
+
+void *run_mixed(void *p)
+{
+    long index = (long)p;
+    results[index].node = topo_pin(index, run_threads, pin_policy);
+    set->thread_init(index);
+
+    key_gen gen;
+    gen.state = (unsigned long long)(index + 1) * 0x9E3779B97F4A7C15ULL;
+    gen.cursor = index * (mix.key_range / run_threads); // threads start apart
+    long ops[OP_KINDS] = {0, 0, 0, 0}, inserted = 0;
+    latency_histogram *latency = results[index].latency;
+    // -T: this thread's slice of the trace, all of it if there are more threads than keys
+    long begin = trace.count * index / run_threads;
+    long end = trace.count * (index + 1) / run_threads;
+    if (begin == end)
+    {
+        begin = 0;
+        end = trace.count;
+    }
+    long next = begin;
+
+    pthread_barrier_wait(&start_barrier);
+    while (!stop_run.load(memory_order_relaxed))
+    {
+        int kind;
+        tree_key key;
+        if (trace.count > 0)
+        {
+            // KEY_OP_ and OP_ number the kinds alike
+            kind = trace.ops != NULL ? trace.ops[next] : next_kind(&gen);
+            key = trace.keys[next];
+            if (++next == end)
+                next = begin;
+        }
+        else
+        {
+            kind = next_kind(&gen);
+            key = (tree_key)next_key(&gen);
+        }
+        results[index].key.store(key, memory_order_relaxed);
+        results[index].kind.store(kind, memory_order_relaxed);
+        unsigned long op_start = bench_now_ns();
+        if (kind == OP_LOOKUP)
+            set->find(key);
+        else if (kind == OP_INSERT)
+            inserted += set->insert(key);
+        else if (kind == OP_REMOVE)
+            set->remove(key);
+        else
+            set->search(key);
+        hist_record(&latency[kind], bench_now_ns() - op_start);
+        ops[kind]++;
+        if (mix.think_time > 0)
+            think(mix.think_time);
+    }
+
+    for (int i = 0; i < OP_KINDS; i++)
+        results[index].ops[i] = ops[i];
+    results[index].inserted = inserted;
+    return NULL;
+}
+
+/**
+ * join the threads of a run that was told to stop
+ * A thread still in an operation watchdog seconds later is taken to be
+ * stuck, e.g. in fixups that wait for each other. Instead of hanging the
+ * run is reported with the operation of every such thread and the
+ * program ends with exit code 3; the stuck threads cannot be joined.
+ */
+static void join_workers(vector<pthread_t> &tid)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)watchdog;
+    deadline.tv_nsec += (long)((watchdog - (time_t)watchdog) * 1e9);
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int stuck = 0;
+    for (size_t i = 0; i < tid.size(); i++)
+    {
+        if (pthread_timedjoin_np(tid[i], NULL, &deadline) == 0)
+            continue;
+        if (stuck++ == 0)
+            fprintf(stderr, "[ERROR] run stuck, not stopped %.0fs after its time was up:\n", watchdog);
+        fprintf(stderr, "    thread %zu in %s of key " TREE_KEY_FMT "\n", i,
+                OP_NAMES[results[i].kind.load(memory_order_relaxed)],
+                results[i].key.load(memory_order_relaxed));
+    }
+    if (stuck == 0)
+        return;
+    fprintf(stderr, "[ERROR] %d of %zu threads stuck.\n", stuck, tid.size());
+    fflush(stdout);
+    _exit(3);
+}
+
+/**
+ * a random prefill keys of 1..key_range in order (selection sampling),
+ * built in one go
+ */
+void prefill_tree()
+{
+    vector<tree_key> keys;
+    keys.reserve(mix.prefill);
+    key_gen gen = {0x2545F4914F6CDD1DULL, 0};
+    long needed = mix.prefill;
+    for (long k = 1; k <= mix.key_range && needed > 0; k++)
+    {
+        if (next_unit(&gen) * (mix.key_range - k + 1) < needed)
+        {
+            keys.push_back((tree_key)k);
+            needed--;
+        }
+    }
+    set->thread_init(0);
+    set->build(keys.data(), (long)keys.size());
+}
+
+/**
+ * one timed run of the mix with thread_count threads on a new instance
+ * of structure, false if it is broken afterwards
+ */
+bool run_mixed_workload(const string &structure, int thread_count, double *throughput, long *memory)
+{
+    set = bench_set_create(structure.c_str());
+    prefill_tree();
+
+    run_threads = thread_count;
+    results = vector<worker_result>(thread_count);
+    for (auto &result : results)
     {
-        num_processes_i = atoi(argv[1]);
-        num_processes_r = num_processes_i;
+        for (int i = 0; i < OP_KINDS; i++)
+            hist_clear(&result.latency[i]);
     }
-    else if (argc == 3)
+    stop_run = false;
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+    vector<pthread_t> tid(thread_count);
+    for (long i = 0; i < thread_count; i++)
+        pthread_create(&tid[i], NULL, run_mixed, (void *)i);
+
+    rb_reset_stats();
+    pthread_barrier_wait(&start_barrier);
+    double start = bench_now();
+    usleep((useconds_t)(mix.duration * 1000000));
+    stop_run = true;
+    join_workers(tid);
+    double elapsed = bench_now() - start;
+    pthread_barrier_destroy(&start_barrier);
+
+    long ops[OP_KINDS] = {0, 0, 0, 0}, total = 0, inserted = 0;
+    latency_histogram latency[OP_KINDS];
+    for (int i = 0; i < OP_KINDS; i++)
+        hist_clear(&latency[i]);
+    for (auto &result : results)
     {
-        num_processes_i = atoi(argv[1]);
-        num_processes_r = atoi(argv[2]);
+        inserted += result.inserted;
+        for (int i = 0; i < OP_KINDS; i++)
+        {
+            ops[i] += result.ops[i];
+            hist_merge(&latency[i], &result.latency[i]);
+        }
     }
+    for (int i = 0; i < OP_KINDS; i++)
+        total += ops[i];
 
-    load_data_from_txt();
-    printf("total_size: %d\n", total_size);
+    // a key is in the set at most once
+    long size = set->size();
+    bool valid = set->check() && size <= mix.key_range;
+    *throughput = total / elapsed;
+    *memory = set->memory();
+    printf("%2d threads", thread_count);
+    if (pin_policy != PIN_NONE)
+    {
+        vector<bool> used(topo_nodes());
+        for (auto &result : results)
+            used[result.node] = true;
+        long nodes = count(used.begin(), used.end(), true);
+        printf(" on %ld node%s", nodes, nodes > 1 ? "s" : "");
+    }
+    if (STRUCTURES.size() > 1)
+        printf(" %-8s", structure.c_str());
+    printf(": %10.0f ops/sec", *throughput);
+    for (int i = 0; i < OP_KINDS; i++)
+    {
+        if (i != OP_SEARCH || ops[i] > 0)
+            printf(", %s %10.0f", OP_NAMES[i], ops[i] / elapsed);
+    }
+    if (ops[OP_INSERT] > 0)
+        printf(" (%.0f%% new)", 100.0 * inserted / ops[OP_INSERT]);
+    printf(", size %ld, %.1fMB %s\n", size, *memory / 1048576.0,
+           valid ? "" : "INVALID TREE");
+    for (int i = 0; i < OP_KINDS; i++)
+        hist_print(latency_name(structure, i), &latency[i]);
+    if (structure == "lockfree")
+    {
+        print_reclaim_stats();
+        print_op_stats();
+    }
+    set->print_stats();
+
+    delete set;
+    return valid;
+}
+
+/**
+ * the original test: insert all of the key file, then remove it all,
+ * with every thread count and computation time, then compare batched
+ * inserts
+ */
+void run_sweep()
+{
+    printf("total_size: %ld\n", total_size);
     for (auto comp_time : COMPUTATION_TIME_LIST)
     {
         sleep_time = comp_time * 1000000;
-        
+
         for (auto thread_num : THREADS_NUM_LIST)
         {
-            
-            num_processes_r = num_processes_i = thread_num;
-            // init setup
-            root = rb_init();
-            pthread_mutex_init(&show_tree_lock, NULL); // for print tree
+            vector<double> insert_speed, search_speed, remove_speed, memory;
+            for (auto &structure : STRUCTURES)
+            {
+                // init setup
+                set = bench_set_create(structure.c_str());
+                pthread_mutex_init(&show_tree_lock, NULL); // for print tree
 
-            run_multi_thread_insert(num_processes_i);
+                insert_speed.push_back(1 / run_multi_thread_insert(thread_num));
+                memory.push_back(set->memory());
+                print_memory();
 
-            run_multi_thread_remove(num_processes_r);
+                search_speed.push_back(1 / run_multi_thread_search(thread_num));
+                remove_speed.push_back(1 / run_multi_thread_remove(thread_num));
+                delete set;
+            }
+            print_relative("insert throughput", insert_speed, false);
+            print_relative("search throughput", search_speed, false);
+            print_relative("remove throughput", remove_speed, false);
+            print_relative("memory", memory, true);
         }
 
         cout << endl;
     }
-    
-
-    
-    // root = rb_init();
-    // pthread_mutex_init(&show_tree_lock, NULL);
 
-    // run_serial();
-    // run_multi_thread_insert(num_processes_i);
-    // show_tree(root);
-    // remove_dbg = true;
-    // run_multi_thread_remove(num_processes_r);
-
-    return 0;
+    // batched inserts against a loop of rb_insert
+    sleep_time = 0;
+    for (auto thread_num : THREADS_NUM_LIST)
+        run_batch_compare(thread_num);
 }
 
 void run_serial()
@@ -94,7 +786,7 @@ void run_serial()
 
 
     clock_gettime(CLOCK_MONOTONIC, &start);
-    for (int i = 0; i < total_size; i++)
+    for (long i = 0; i < total_size; i++)
     {
         rb_insert(root, numbers[i]);
     }
@@ -109,7 +801,7 @@ void run_serial()
     dbg_printf("\n\n\n");
 
     clock_gettime(CLOCK_MONOTONIC, &start);
-    for (int i = 0; i < total_size; i++)
+    for (long i = 0; i < total_size; i++)
     {
         rb_remove(root, numbers[i]);
         // show_tree(root);
@@ -124,27 +816,37 @@ void run_serial()
 
 void *run_insert(void *i)
 {
-    int *p = numbers + ((long)i) * size_per_thread;
-    thread_index_init((long) i);
-    int *start = p;
-    int count = size_per_thread;
-    for (int i = 0; i < count; i++)
+    const tree_key *p = numbers + ((long)i) * size_per_thread;
+    topo_pin((long)i, run_threads, pin_policy);
+    set->thread_init((long)i);
+    const tree_key *start = p;
+    long count = size_per_thread;
+    latency_histogram *latency = &thread_latency[(long)i];
+    for (long i = 0; i < count; i++)
     {
-        int element = start[i];
-        rb_insert(root, element);
-        usleep(sleep_time);
+        tree_key element = start[i];
+        unsigned long op_start = bench_now_ns();
+        set->insert(element);
+        hist_record(latency, bench_now_ns() - op_start);
+        if (sleep_time > 0)
+            usleep(sleep_time);
         dbg_printf("[RUN] finish inserting element %d\n", element);
     }
     return NULL;
 }
 
-int run_multi_thread_insert(int thread_count)
+double run_multi_thread_insert(int thread_count)
 {
     pthread_t tid[thread_count];
     size_per_thread = total_size / thread_count;
+    run_threads = thread_count;
+    thread_latency.resize(thread_count);
+    for (auto &latency : thread_latency)
+        hist_clear(&latency);
 
     struct timespec start, end;
 
+    rb_reset_stats();
     clock_gettime(CLOCK_MONOTONIC, &start);
     
     thread_count--; // main thread will also perform insertion
@@ -163,37 +865,127 @@ int run_multi_thread_insert(int thread_count)
     double elapsed_time = (end.tv_sec - start.tv_sec) * 1e9;
     elapsed_time += (end.tv_nsec - start.tv_nsec);
     elapsed_time *= 1e-9;
-    cout << "time taken by insert with " << thread_count + 1 << " threads and sleep " << (float)sleep_time / 1000000 << " seconds: " << fixed << elapsed_time << "sec" << endl;
+    cout << "time taken by " << (STRUCTURES.size() > 1 ? set->name() + string(" ") : "")
+         << "insert with " << thread_count + 1 << " threads and sleep " << (float)sleep_time / 1000000 << " seconds: " << fixed << elapsed_time << "sec" << endl;
     cout.unsetf(std::ios_base::floatfield);
+    print_latency("insert");
+    if (strcmp(set->name(), "lockfree") == 0)
+    {
+        print_reclaim_stats();
+        print_op_stats();
+    }
 
     // show_tree(root);
-    return 0;
+    return elapsed_time;
 }
 
-void *run_remove(void *i)
+void *run_insert_batch(void *i)
 {
-    int *p = numbers + ((long)i) * size_per_thread;
+    const tree_key *start = numbers + ((long)i) * size_per_thread;
+    topo_pin((long)i, run_threads, pin_policy);
     thread_index_init((long)i);
-    int *start = p;
-    int count = size_per_thread;
-    for (int j = 0; j < count; j++)
+    for (long j = 0; j < size_per_thread; j += INSERT_BATCH_SIZE)
+        rb_insert_batch(root, start + j, min((long)INSERT_BATCH_SIZE, size_per_thread - j));
+    return NULL;
+}
+
+double run_multi_thread_insert_batch(int thread_count)
+{
+    pthread_t tid[thread_count];
+    size_per_thread = total_size / thread_count;
+    run_threads = thread_count;
+
+    struct timespec start, end;
+
+    rb_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    thread_count--; // main thread will also perform insertion
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_create(&tid[i], NULL, run_insert_batch, (void *)(long)(i + 1));
+    }
+
+    run_insert_batch(0);
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_time = (end.tv_sec - start.tv_sec) * 1e9;
+    elapsed_time += (end.tv_nsec - start.tv_nsec);
+    elapsed_time *= 1e-9;
+    cout << "time taken by batch insert with " << thread_count + 1 << " threads: " << fixed << elapsed_time << "sec" << endl;
+    cout.unsetf(std::ios_base::floatfield);
+    print_op_stats();
+
+    return elapsed_time;
+}
+
+/**
+ * insert the data with a loop of rb_insert and then in batches of
+ * INSERT_BATCH_SIZE, and check the trees the batches built
+ */
+void run_batch_compare(int thread_count)
+{
+    double loop_time = 0, batch_time = 0;
+    bool valid = true;
+    for (int round = 0; round < BATCH_COMPARE_ROUNDS; round++)
     {
-        int element = start[j];
-        rb_remove(root, element);
-        usleep(sleep_time);
+        set = bench_set_create("lockfree");
+        double time = run_multi_thread_insert(thread_count);
+        if (round == 0 || time < loop_time)
+            loop_time = time;
+        run_multi_thread_remove(thread_count);
+        delete set;
+
+        root = rb_init();
+        time = run_multi_thread_insert_batch(thread_count);
+        if (round == 0 || time < batch_time)
+            batch_time = time;
+        valid = valid && check_tree_dfs(root->left_child) &&
+                count_nodes(root) == (long)size_per_thread * thread_count;
+        rb_destroy(root);
+    }
+    printf("batch speedup with %d threads: %.2fx %s\n", thread_count,
+           loop_time / batch_time, valid ? "" : "INVALID TREE");
+}
+
+void *run_remove(void *i)
+{
+    const tree_key *p = numbers + ((long)i) * size_per_thread;
+    topo_pin((long)i, run_threads, pin_policy);
+    set->thread_init((long)i);
+    const tree_key *start = p;
+    long count = size_per_thread;
+    latency_histogram *latency = &thread_latency[(long)i];
+    for (long j = 0; j < count; j++)
+    {
+        tree_key element = start[j];
+        unsigned long op_start = bench_now_ns();
+        set->remove(element);
+        hist_record(latency, bench_now_ns() - op_start);
+        if (sleep_time > 0)
+            usleep(sleep_time);
         dbg_printf("[RUN] finish removing element %d\n", element);
         // show_tree(root);
     }
     return NULL;
 }
 
-int run_multi_thread_remove(int thread_count)
+double run_multi_thread_remove(int thread_count)
 {
     pthread_t tid[thread_count];
     size_per_thread = total_size / thread_count;
+    run_threads = thread_count;
+    thread_latency.resize(thread_count);
+    for (auto &latency : thread_latency)
+        hist_clear(&latency);
 
     struct timespec start, end;
 
+    rb_reset_stats();
     clock_gettime(CLOCK_MONOTONIC, &start);
 
     thread_count--; // main thread will also perform insertion
@@ -212,27 +1004,195 @@ int run_multi_thread_remove(int thread_count)
     double elapsed_time = (end.tv_sec - start.tv_sec) * 1e9;
     elapsed_time += (end.tv_nsec - start.tv_nsec);
     elapsed_time *= 1e-9;
-    cout << "time taken by remove with " << thread_count + 1 << " threads and sleep " << (float)sleep_time / 1000000 << " seconds: " << fixed << elapsed_time << "sec" << endl;
+    cout << "time taken by " << (STRUCTURES.size() > 1 ? set->name() + string(" ") : "")
+         << "remove with " << thread_count + 1 << " threads and sleep " << (float)sleep_time / 1000000 << " seconds: " << fixed << elapsed_time << "sec" << endl;
     cout.unsetf(std::ios_base::floatfield);
+    print_latency("remove");
+    if (strcmp(set->name(), "lockfree") == 0)
+    {
+        print_reclaim_stats();
+        print_op_stats();
+    }
 
     // show_tree(root);
-    return 0;
+    return elapsed_time;
 }
 
-void load_data_from_txt()
+/**
+ * the keys a thread inserted, looked up once each with search()
+ */
+void *run_search(void *i)
 {
-    char buffer[20];
-    fstream file;
-    file.open("data.txt", ios::in);
-    total_size = 0;
-    while(!file.eof())
+    const tree_key *start = numbers + ((long)i) * size_per_thread;
+    topo_pin((long)i, run_threads, pin_policy);
+    set->thread_init((long)i);
+    latency_histogram *latency = &thread_latency[(long)i];
+    for (long j = 0; j < size_per_thread; j++)
     {
-        file.getline(buffer, 20, '\n');
+        unsigned long op_start = bench_now_ns();
+        set->search(start[j]);
+        hist_record(latency, bench_now_ns() - op_start);
+        if (sleep_time > 0)
+            usleep(sleep_time);
+    }
+    return NULL;
+}
 
-        int result = strtol(buffer, NULL, 10);
-        if (result > 0)
-        {
-            numbers[total_size++] = result;
-        }
+double run_multi_thread_search(int thread_count)
+{
+    pthread_t tid[thread_count];
+    size_per_thread = total_size / thread_count;
+    run_threads = thread_count;
+    thread_latency.resize(thread_count);
+    for (auto &latency : thread_latency)
+        hist_clear(&latency);
+
+    struct timespec start, end;
+
+    rb_reset_stats();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    thread_count--; // main thread will also search
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_create(&tid[i], NULL, run_search, (void *)(long)(i + 1));
+    }
+
+    run_search(0);
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed_time = (end.tv_sec - start.tv_sec) * 1e9;
+    elapsed_time += (end.tv_nsec - start.tv_nsec);
+    elapsed_time *= 1e-9;
+    cout << "time taken by " << (STRUCTURES.size() > 1 ? set->name() + string(" ") : "")
+         << "search with " << thread_count + 1 << " threads and sleep " << (float)sleep_time / 1000000 << " seconds: " << fixed << elapsed_time << "sec" << endl;
+    cout.unsetf(std::ios_base::floatfield);
+    print_latency(latency_name(set->name(), OP_SEARCH));
+    if (strcmp(set->name(), "lockfree") == 0)
+        print_op_stats();
+
+    return elapsed_time;
+}
+
+/**
+ * tail latency of the last sweep phase, all threads merged
+ */
+void print_latency(const char *name)
+{
+    latency_histogram all;
+    hist_clear(&all);
+    for (auto &latency : thread_latency)
+        hist_merge(&all, &latency);
+    hist_print(name, &all);
+}
+
+/**
+ * bytes of the nodes of the structure under test, and per key
+ */
+void print_memory()
+{
+    long size = set->size();
+    long bytes = set->memory();
+    printf("    memory: %.1fMB, %.1f bytes per key\n", bytes / 1048576.0,
+           size > 0 ? (double)bytes / size : 0.0);
+}
+
+/**
+ * label of the latency histogram of an operation kind
+ * the tree and its shards look keys up with rb_lookup(), which checks
+ * versions instead of taking flags like tree_search(), so their lookup
+ * histogram is labelled as the optimistic lookup; a search is
+ * tree_search() for the tree and a lookup for every other structure
+ */
+const char *latency_name(const string &structure, int kind)
+{
+    bool sharded = structure.compare(0, 7, "sharded") == 0;
+    if (kind == OP_SEARCH && structure != "lockfree")
+        return sharded ? "search as optimistic lookup" : "search as lookup";
+    if (kind == OP_LOOKUP && (structure == "lockfree" || sharded))
+        return "optimistic lookup";
+    return OP_NAMES[kind];
+}
+
+/**
+ * retired nodes so far and the largest retire list of any thread
+ */
+void print_reclaim_stats()
+{
+    reclaim_stats stats;
+    reclaim_get_stats(&stats);
+    printf("    retired: %lu freed: %lu pending: %lu largest retire list: %lu",
+           stats.retired, stats.freed, stats.pending, stats.peak_pending);
+    if (stats.bound)
+        printf(" (bound %lu)", stats.bound);
+    printf("\n");
+}
+
+/**
+ * the operation counters of the last run that are not 0,
+ * nothing with RB_NO_STATS
+ */
+void print_op_stats()
+{
+    rb_stats stats;
+    rb_get_stats(&stats);
+    bool any = false;
+    for (int i = 0; i < STAT_COUNTERS; i++)
+    {
+        if (stats.count[i] == 0)
+            continue;
+        printf("%s%s: %lu", any ? " " : "    ", rb_stats_name(i), stats.count[i]);
+        any = true;
+    }
+    if (any)
+        printf("\n");
+}
+
+/**
+ * the keys of the sweep, mapped from a binary key file or parsed from
+ * text by all cores; the threads read them where they are
+ */
+bool load_keys(const char *path)
+{
+    double start = bench_now();
+    if (!key_file_open(&sweep_keys, path, (int)sysconf(_SC_NPROCESSORS_ONLN)))
+    {
+        fprintf(stderr, "[ERROR] cannot read %s: %s.\n", path, strerror(errno));
+        return false;
+    }
+    numbers = sweep_keys.keys;
+    total_size = sweep_keys.count;
+    printf("%s: %ld keys %s in %.3f sec\n", path, total_size,
+           sweep_keys.parsed != NULL ? "parsed" : "mapped", bench_now() - start);
+    return true;
+}
+
+/**
+ * the key file of -T; the key range becomes 1..its largest key
+ */
+bool load_trace(const char *path)
+{
+    double start = bench_now();
+    if (!key_file_open(&trace, path, (int)sysconf(_SC_NPROCESSORS_ONLN)))
+    {
+        fprintf(stderr, "[ERROR] cannot read %s: %s.\n", path, strerror(errno));
+        return false;
+    }
+    if (trace.count == 0)
+    {
+        fprintf(stderr, "[ERROR] no keys in %s.\n", path);
+        return false;
     }
+    long largest = 0;
+    for (long i = 0; i < trace.count; i++)
+        largest = max(largest, (long)trace.keys[i]);
+    mix.key_range = largest;
+    printf("%s: %ld keys%s %s in %.3f sec\n", path, trace.count,
+           trace.ops != NULL ? " and operations" : "",
+           trace.parsed != NULL ? "parsed" : "mapped", bench_now() - start);
+    return true;
 }
@@ -0,0 +1,250 @@
+#include "tree.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+/******************
+ * NUMA topology and thread placement
+ ******************/
+
+/**
+ * The nodes and their cpus are read once from sysfs, limited to the
+ * cpus this process may run on; nodes without such cpus are left out,
+ * and a machine without /sys/devices/system/node is one node. No
+ * libnuma is needed: pinning is pthread_setaffinity_np() and placing
+ * memory is the mbind() system call.
+ *
+ * topo_init() with a number of nodes splits the cpus into that many
+ * nodes instead, so the pinning policies can be tried on a machine with
+ * one. Memory is not placed on a simulated topology, there is nowhere
+ * to place it.
+ *
+ * A pinned thread remembers its node, so topo_current_node() is a load
+ * for it and needs no sched_getcpu().
+ */
+
+typedef struct topology_t
+{
+    vector<vector<int>> node_cpus; // the cpus of every node
+    vector<int> node_ids;          // the kernel's number of every node
+    vector<int> cpu_node;          // node of every cpu, -1 if not ours
+    cpu_set_t allowed;
+    bool simulated;
+} topology;
+
+static topology topo;
+static pthread_once_t topo_once = PTHREAD_ONCE_INIT;
+static thread_local int pinned_node = -1;
+
+/**
+ * parse a cpulist like "0-3,8,10-11" into the allowed cpus among them
+ */
+static vector<int> parse_cpulist(const char *text, const cpu_set_t *allowed)
+{
+    vector<int> cpus;
+    const char *p = text;
+    while (*p >= '0' && *p <= '9')
+    {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, allowed))
+                cpus.push_back((int)cpu);
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+    return cpus;
+}
+
+static void read_topology(void)
+{
+    if (sched_getaffinity(0, sizeof(topo.allowed), &topo.allowed) != 0)
+    {
+        CPU_ZERO(&topo.allowed);
+        for (long cpu = 0; cpu < sysconf(_SC_NPROCESSORS_ONLN) && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, &topo.allowed);
+    }
+    topo.simulated = false;
+
+    for (int node = 0; node < TOPO_MAX_NODES; node++)
+    {
+        char path[64], line[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        bool read = fgets(line, sizeof(line), file) != NULL;
+        fclose(file);
+        vector<int> cpus = read ? parse_cpulist(line, &topo.allowed) : vector<int>();
+        if (cpus.empty())
+            continue; // memory only, or none of our cpus
+        topo.node_cpus.push_back(cpus);
+        topo.node_ids.push_back(node);
+    }
+    if (topo.node_cpus.empty())
+    {
+        vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &topo.allowed))
+                cpus.push_back(cpu);
+        }
+        topo.node_cpus.push_back(cpus);
+        topo.node_ids.push_back(0);
+    }
+
+    topo.cpu_node.assign(CPU_SETSIZE, -1);
+    for (size_t node = 0; node < topo.node_cpus.size(); node++)
+    {
+        for (int cpu : topo.node_cpus[node])
+            topo.cpu_node[cpu] = (int)node;
+    }
+}
+
+static topology &get_topology(void)
+{
+    pthread_once(&topo_once, read_topology);
+    return topo;
+}
+
+/**
+ * read the topology, or with simulated_nodes > 0 split the cpus into
+ * that many nodes of consecutive cpus; a node gets a cpu of its own if
+ * possible and shares one otherwise
+ * must be called before any thread is pinned
+ */
+void topo_init(int simulated_nodes)
+{
+    topology &t = get_topology();
+    if (simulated_nodes <= 0)
+        return;
+    simulated_nodes = min(simulated_nodes, TOPO_MAX_NODES);
+
+    vector<int> cpus;
+    for (auto &node : t.node_cpus)
+        cpus.insert(cpus.end(), node.begin(), node.end());
+    sort(cpus.begin(), cpus.end());
+    long count = (long)cpus.size();
+
+    t.node_cpus.assign(simulated_nodes, vector<int>());
+    t.node_ids.assign(simulated_nodes, -1);
+    t.cpu_node.assign(CPU_SETSIZE, -1);
+    for (int node = 0; node < simulated_nodes; node++)
+    {
+        long first = count * node / simulated_nodes, last = count * (node + 1) / simulated_nodes;
+        if (first == last)
+            last = (first %= count) + 1;
+        for (long i = first; i < last; i++)
+        {
+            t.node_cpus[node].push_back(cpus[i]);
+            if (t.cpu_node[cpus[i]] < 0)
+                t.cpu_node[cpus[i]] = node;
+        }
+    }
+    t.simulated = true;
+}
+
+int topo_nodes(void)
+{
+    return (int)get_topology().node_cpus.size();
+}
+
+int topo_cpus(void)
+{
+    return CPU_COUNT(&get_topology().allowed);
+}
+
+bool topo_simulated(void)
+{
+    return get_topology().simulated;
+}
+
+/**
+ * the node the calling thread is pinned to, or runs on
+ */
+int topo_current_node(void)
+{
+    if (pinned_node >= 0)
+        return pinned_node;
+    topology &t = get_topology();
+    int cpu = sched_getcpu();
+    if (cpu < 0 || cpu >= CPU_SETSIZE || t.cpu_node[cpu] < 0)
+        return 0;
+    return t.cpu_node[cpu];
+}
+
+/**
+ * pin the calling thread, number index of threads, by policy (see
+ * PIN_NONE); PIN_NONE lets it run anywhere again. Threads beyond the
+ * cpus start over at the first one.
+ * returns the node of the thread
+ */
+int topo_pin(long index, int threads, int policy)
+{
+    topology &t = get_topology();
+    int nodes = (int)t.node_cpus.size();
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int node;
+
+    switch (policy)
+    {
+    case PIN_COMPACT:
+    {
+        long total = 0;
+        for (auto &cpus : t.node_cpus)
+            total += cpus.size();
+        long cpu = index % total;
+        for (node = 0; cpu >= (long)t.node_cpus[node].size(); node++)
+            cpu -= t.node_cpus[node].size();
+        CPU_SET(t.node_cpus[node][cpu], &set);
+        break;
+    }
+    case PIN_SCATTER:
+    {
+        node = (int)(index % nodes);
+        vector<int> &cpus = t.node_cpus[node];
+        CPU_SET(cpus[(index / nodes) % cpus.size()], &set);
+        break;
+    }
+    case PIN_SOCKET:
+        node = (int)(index * nodes / max(threads, 1) % nodes);
+        for (int cpu : t.node_cpus[node])
+            CPU_SET(cpu, &set);
+        break;
+    default:
+        pthread_setaffinity_np(pthread_self(), sizeof(t.allowed), &t.allowed);
+        pinned_node = -1;
+        return topo_current_node();
+    }
+
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    pinned_node = node;
+    return node;
+}
+
+/**
+ * have the pages of [mem, mem + size) come from node, moving the ones
+ * already there; mem is page aligned
+ * false on a simulated or single node topology, or if the kernel refuses
+ */
+bool topo_bind(void *mem, size_t size, int node)
+{
+    topology &t = get_topology();
+    if (t.simulated || t.node_ids.size() < 2 || node < 0 || node >= (int)t.node_ids.size())
+        return false;
+    unsigned long mask[TOPO_MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    int id = t.node_ids[node];
+    mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_mbind, mem, size, MPOL_PREFERRED, mask, 8 * sizeof(mask) + 1,
+                   MPOL_MF_MOVE) == 0;
+}
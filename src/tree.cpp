@@ -1,8 +1,7 @@
 #include "tree.h"
 
 #include <stdlib.h>
-
-extern thread_local long thread_index;
+#include <algorithm>
 
 /**
  * initialize red-black tree and return its root
@@ -16,6 +15,7 @@ tree_node *rb_init(void)
     tree_node *dummy5 = create_dummy_node();
     tree_node *dummy_sibling = create_dummy_node();
     tree_node *root = create_dummy_node();
+    tree_node *lock = create_dummy_node(); // see fixup_lock()
 
     dummy_sibling->parent = root;
     root->parent = dummy5;
@@ -24,33 +24,68 @@ tree_node *rb_init(void)
     dummy3->parent = dummy2;
     dummy2->parent = dummy1;
 
-    free_node(dummy1->left_child);
     dummy1->left_child = dummy2;
-    free_node(dummy2->left_child);
+    dummy1->right_child = lock;
     dummy2->left_child = dummy3;
-    free_node(dummy3->left_child);
     dummy3->left_child = dummy4;
-    free_node(dummy4->left_child);
     dummy4->left_child = dummy5;
-    free_node(dummy5->left_child);
     dummy5->left_child = root;
-    free_node(root->right_child);
     root->right_child = dummy_sibling;
     return root;
 }
 
+/**
+ * free the nodes of a subtree that no thread can reach any more
+ */
+static void free_nodes(tree_node *node)
+{
+    std::vector<tree_node *> frontier;
+    frontier.push_back(node);
+    while (frontier.size() > 0)
+    {
+        tree_node *cur_node = frontier.back();
+        frontier.pop_back();
+        if (is_leaf(cur_node))
+            continue;
+        frontier.push_back(cur_node->left_child);
+        frontier.push_back(cur_node->right_child);
+        dealloc_node(cur_node);
+    }
+}
+
+/**
+ * free a tree from rb_init() with all its nodes and dummies
+ * no thread may be inside an operation on the tree any more, nodes it
+ * removed earlier are left to the reclamation scheme
+ */
+void rb_destroy(tree_node *root)
+{
+    free_nodes(root->left_child);
+    dealloc_node(root->right_child);
+    tree_node *dummy = get_parent(root);
+    dealloc_node(root);
+    while (dummy != NULL)
+    {
+        tree_node *next = get_parent(dummy);
+        if (next == NULL)
+            dealloc_node(dummy->right_child); // the fixup lock
+        dealloc_node(dummy);
+        dummy = next;
+    }
+}
+
 /**
  * perform red-black left rotation
  */
 void left_rotate(tree_node *root, tree_node *node)
 {
-    if (node->is_leaf)
+    if (is_leaf(node))
     {
         fprintf(stderr, "[ERROR] invalid rotate on NULL node.\n");
         exit(1);
     }
     
-    if (node->right_child->is_leaf)
+    if (is_leaf(node->right_child))
     {
         fprintf(stderr, 
                 "[ERROR] invalid rotate on node with NULL right child.\n");
@@ -58,6 +93,11 @@ void left_rotate(tree_node *root, tree_node *node)
     }
 
     tree_node *right_child = node->right_child;
+    tree_node *parent = node->parent;
+    write_begin(parent);
+    write_begin(node);
+    write_begin(right_child);
+
     right_child->parent = node->parent;
     if (is_left(node))
     {
@@ -70,13 +110,16 @@ void left_rotate(tree_node *root, tree_node *node)
 
     node->parent = right_child;
 
-    node->right_child = right_child->left_child;
+    set_right_child(node, right_child->left_child);
     right_child->left_child = node;
-
-    if (node->right_child)
-    {
-        node->right_child->parent = node;
-    }
+#ifdef RB_ORDER_STATS
+    update_size(node);
+    update_size(right_child);
+#endif
+
+    write_end(right_child);
+    write_end(node);
+    write_end(parent);
     
     dbg_printf("[Rotate] Left rotation complete.\n");
 }
@@ -86,13 +129,13 @@ void left_rotate(tree_node *root, tree_node *node)
  */
 void right_rotate(tree_node *root, tree_node *node)
 {
-    if (node->is_leaf)
+    if (is_leaf(node))
     {
         fprintf(stderr, "[ERROR] invalid rotate on NULL node.\n");
         exit(1);
     }
 
-    if (node->left_child->is_leaf)
+    if (is_leaf(node->left_child))
     {
         fprintf(stderr,
                 "[ERROR] invalid rotate on node with NULL left child.\n");
@@ -100,6 +143,11 @@ void right_rotate(tree_node *root, tree_node *node)
     }
 
     tree_node *left_child = node->left_child;
+    tree_node *parent = node->parent;
+    write_begin(parent);
+    write_begin(node);
+    write_begin(left_child);
+
     left_child->parent = node->parent;
     if (is_left(node))
     {
@@ -112,149 +160,512 @@ void right_rotate(tree_node *root, tree_node *node)
     
     node->parent = left_child;
 
-    node->left_child = left_child->right_child;
+    set_left_child(node, left_child->right_child);
     left_child->right_child = node;
+#ifdef RB_ORDER_STATS
+    update_size(node);
+    update_size(left_child);
+#endif
+
+    write_end(left_child);
+    write_end(node);
+    write_end(parent);
+
+    dbg_printf("[Rotate] Right rotation complete.\n");
+}
+
+#ifdef RB_ORDER_STATS
+/**
+ * keeping subtree sizes
+ *
+ * An insert or remove changes the size of every node above the place it
+ * changed. Rotations recompute the two nodes they turn, under the flags
+ * they hold anyway, and leave every other size as it was. Once its
+ * fixup is done and its local area released, the update walks from that
+ * place up to the root and recomputes every node on the way from its
+ * children, see size_fix_up(). So every node that is above a change
+ * when the walk passes it is recomputed after the change, and a node
+ * that a rotation took off the path was recomputed by the rotation.
+ * The sizes are exact once no update runs; while updates run, a size
+ * may miss the changes whose walks have not passed it yet.
+ */
+
+/**
+ * keep a node we hold the flag of allocated for size_fix_up(), it is in
+ * the tree, so it cannot have been retired
+ */
+static void size_hold(tree_node *node)
+{
+    node_link link = node;
+    reclaim_protect(HP_SIZE_NODE, &link);
+}
+
+/**
+ * recompute the sizes from node up to the root, node is protected by
+ * size_hold() and no flag is held
+ *
+ * The walk holds the flag of the node it recomputes, and the flag of
+ * that node's child while it takes it: a node only gets another parent
+ * by a change under the flag of the old one, so the parent checked
+ * under its flag is the parent. It never waits for a flag while it holds
+ * one, so it cannot block a fixup waiting for a flag of its own (see
+ * fixup_lock()). A node that was removed while no flag was held has size
+ * 0, its remove walks up from its place instead.
+ */
+static void size_fix_up(tree_node *root, tree_node *node)
+{
+    int node_slot = HP_SIZE_NODE, parent_slot = HP_SIZE_PREV, slot;
+    unsigned int failures = 0;
 
-    if (node->left_child)
+    while (true)
     {
-        node->left_child->parent = node;
+        if (!try_flag(node))
+        {
+            if (get_size(node) == 0)
+                return;
+            contention_wait(&failures);
+            continue;
+        }
+        if (get_size(node) == 0)
+        {
+            release_flag(node);
+            return;
+        }
+        update_size(node);
+
+        while (true)
+        {
+            tree_node *parent = reclaim_protect(parent_slot, &node->parent);
+            if (parent == root)
+            {
+                release_flag(node);
+                return;
+            }
+            if (!try_flag(parent))
+                break;
+            if (parent != node->parent)
+            {
+                release_flag(parent); // rotated meanwhile
+                continue;
+            }
+            release_flag(node);
+            node = parent; // its hazard slot goes with it
+            slot = node_slot;
+            node_slot = parent_slot;
+            parent_slot = slot;
+            update_size(node);
+        }
+
+        release_flag(node);
+        contention_wait(&failures);
     }
+}
+#endif
 
-    dbg_printf("[Rotate] Right rotation complete.\n");
+/**
+ * key moves
+ *
+ * Removing a node with two children copies the key of its successor up
+ * into it, past any lookup that is already below it on the way to the
+ * successor. Such a lookup sees every node it visits unchanged and still
+ * misses the key, so rb_lookup() also checks that no key moved while it
+ * ran. Moves are counted when they start and when they are done.
+ *
+ * The counts belong to the tree, so they live in the version bits of two
+ * dummies from rb_init() that are never written otherwise: started in
+ * the sibling of root, done in the parent of root. They wrap with the
+ * version, a lookup would have to outlast 2^18 moves to miss one.
+ */
+static tree_node *key_moves_started(tree_node *root)
+{
+    return root->right_child;
+}
+
+static tree_node *key_moves_done(tree_node *root)
+{
+    return get_parent(root);
+}
+
+static void key_move_begin(tree_node *root)
+{
+    key_moves_started(root)->state.fetch_add(NODE_VERSION_ONE);
+}
+
+static void key_move_end(tree_node *root)
+{
+    key_moves_done(root)->state.fetch_add(NODE_VERSION_ONE);
+}
+
+static uint32_t key_moves_count(tree_node *counter)
+{
+    return counter->state.load(memory_order_acquire) & NODE_VERSION_MASK;
 }
 
 /**
- * basic insertion of a binary search tree
+ * insert finger
+ *
+ * A batch inserts its keys in order, so a key usually goes close to the
+ * one before it. The finger keeps the path of the last descent: every
+ * node on it with its version and the range of keys that belong below
+ * it. Rotations and removals change the version of every node whose
+ * range they shrink, and other changes only widen ranges, so a node
+ * whose version is unchanged still covers its recorded range, unless a
+ * key moved up meanwhile (see key moves). The next descent starts at the
+ * deepest such node that covers its key instead of at the root. The
+ * nodes on the path must stay allocated, see rb_insert_batch().
+ */
+typedef struct finger_entry_t
+{
+    tree_node *node;
+    uint32_t version;
+    tree_key lo, hi; // keys in (lo, hi], a bound is only set if has_lo/has_hi
+    bool has_lo, has_hi;
+} finger_entry;
+
+typedef struct insert_finger_t
+{
+    vector<finger_entry> path;
+    uint32_t moves; // key moves started when the path was begun
+    bool valid;     // no key was moving then
+} insert_finger;
+
+/**
+ * start a new path from the root
+ */
+static void finger_reset(tree_node *root, insert_finger *finger)
+{
+    uint32_t done = key_moves_count(key_moves_done(root));
+    uint32_t started = key_moves_count(key_moves_started(root));
+    finger->path.clear();
+    finger->moves = started;
+    finger->valid = started == done;
+}
+
+/**
+ * add a node we hold the flag of to the path
+ */
+static void finger_push(insert_finger *finger, tree_node *node, finger_entry *range)
+{
+    finger_entry entry = *range;
+    entry.node = node;
+    read_version(node, &entry.version); // even, we hold the flag
+    finger->path.push_back(entry);
+}
+
+/**
+ * flag the deepest node on the path that still covers key and get its
+ * range, the path is cut back to above it
+ * returns NULL if the descent has to start at the root
+ */
+static tree_node *finger_start(tree_node *root, insert_finger *finger,
+                               tree_key key, finger_entry *range)
+{
+    if (!finger->valid)
+        return NULL;
+
+    for (size_t i = finger->path.size(); i-- > 0; )
+    {
+        finger_entry *entry = &finger->path[i];
+        if ((entry->has_lo && !key_less(entry->lo, key)) ||
+            (entry->has_hi && key_less(entry->hi, key)))
+            continue;
+
+        uint32_t version;
+        if (!read_version(entry->node, &version) || version != entry->version)
+            continue; // changed since, a node further up may still do
+        if (!try_flag(entry->node))
+            return NULL;
+
+        // holding the flag, the node can only change through us from now
+        // on, and keys can only move up in ways a descent from the root
+        // would also meet
+        if (!check_version(entry->node, entry->version) ||
+            key_moves_count(key_moves_started(root)) != finger->moves ||
+            key_moves_count(key_moves_done(root)) != finger->moves)
+        {
+            release_flag(entry->node);
+            return NULL;
+        }
+        *range = *entry;
+        finger->path.resize(i);
+        return range->node;
+    }
+    return NULL;
+}
+
+/**
+ * create a red node for insertion
+ */
+static tree_node *new_insert_node(tree_key key RB_VALUE_PARAM)
+{
+    tree_node *new_node;
+    new_node = alloc_node();
+    if (new_node == NULL)
+    {
+        // nothing is flagged yet, but the insert has no way to fail
+        fprintf(stderr, "[ERROR] out of memory.\n");
+        exit(1);
+    }
+    init_node_state(new_node, RED);
+    new_node->key = key;
+#ifdef TREE_VALUE
+    new_node->value = value;
+#endif
+#ifdef RB_ORDER_STATS
+    new_node->size = 1;
+#endif
+    new_node->left_child = nil_left(new_node);
+    new_node->right_child = nil_right(new_node);
+    new_node->parent = NULL;
+    return new_node;
+}
+
+/**
+ * basic insertion of a binary search tree, from the finger if it has a
+ * node that covers the key
  * further fixup needed for red-black tree
+ *
+ * new_node is linked in if given, otherwise a node is only created once
+ * the descent reaches a nil. Returns the linked node, or NULL and holds
+ * no flag if a node on the way already has the key; a node passed in is
+ * then left to the caller.
  */
-void tree_insert(tree_node *root, tree_node *new_node)
+static tree_node *insert_from(tree_node *root, tree_key key RB_VALUE_PARAM,
+                              tree_node *new_node, insert_finger *finger)
 {
-    int value = new_node->value;
+    tree_node *z, *curr_node;
+    bool own_node = new_node == NULL;
+    node_link *link;
+    int curr_slot, z_slot, slot;
+    finger_entry range; // keys that belong below curr_node
+    unsigned int failures = 0;
+
+    if (finger != NULL)
+    {
+        curr_node = finger_start(root, finger, key, &range);
+        if (curr_node != NULL)
+        {
+            curr_slot = HP_FIND_NODE;
+            z_slot = HP_FIND_PREV;
+            goto descend;
+        }
+    }
 
     // insert like any binary search tree
-    bool expected = false;
-    while (!root->flag.compare_exchange_weak(expected, true));
+empty:
+    while (!try_flag(root))
+        contention_wait(&failures);
 
     dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)root);
 
     // empty tree
-    if (root->left_child->is_leaf)
+    if (is_leaf(root->left_child))
     {
-        free_node(root->left_child);
-        new_node->flag = true;
+        if (new_node == NULL)
+#ifdef TREE_VALUE
+            new_node = new_insert_node(key, value);
+#else
+            new_node = new_insert_node(key);
+#endif
+        set_flag(new_node);
         dbg_printf("[FLAG] set flag of 0x%lx\n", (unsigned long)new_node);
-        root->left_child = new_node;
         new_node->parent = root;
-        dbg_printf("[Insert] new node with value (%d)\n", value);
+        write_begin(root);
+        root->left_child = new_node;
+        write_end(root);
+        dbg_printf("[Insert] new node with key (%d)\n", key);
         dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)root);
-        root->flag = false;
-        return;
+        release_flag(root);
+        return new_node;
     }
 
     // release root's flag for non-empty tree
     dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)root);
-    root->flag = false;
+    release_flag(root);
 
     restart:
 
-    tree_node *z = NULL;
-    tree_node *curr_node = root->left_child;
-    expected = false;
-    if (!curr_node->flag.compare_exchange_strong(expected, true))
+    if (finger != NULL)
+        finger_reset(root, finger);
+    range.has_lo = false;
+    range.has_hi = false;
+    curr_node = reclaim_protect(HP_FIND_NODE, &root->left_child);
+    curr_slot = HP_FIND_NODE;
+    z_slot = HP_FIND_PREV;
+    if (is_leaf(curr_node)) // emptied since
+        goto empty;
+    if (!try_flag(curr_node))
     {
         dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)curr_node);
-        
+        contention_wait(&failures);
+        RB_STAT(STAT_INSERT_RESTARTS);
+        goto restart;
+    }
+    if (curr_node != root->left_child)
+    {
+        release_flag(curr_node);
+        RB_STAT(STAT_INSERT_RESTARTS);
         goto restart;
     }
     dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)curr_node);
 
-    
-    while (!curr_node->is_leaf)
+descend:
+    z = NULL;
+    while (!is_leaf(curr_node))
     {
-        z = curr_node;
-        if (value > curr_node->value) /* go right */
+        // the only flag held is curr_node's, it keeps the key in place
+        if (key_equal(curr_node->key, key))
+        {
+            release_flag(curr_node);
+            if (own_node && new_node != NULL)
+                dealloc_node(new_node); // made before a restart, never linked
+            RB_STAT(STAT_INSERT_EXISTS);
+            return NULL;
+        }
+
+        z = curr_node; // its hazard slot goes with it
+        slot = z_slot;
+        z_slot = curr_slot;
+        curr_slot = slot;
+        if (finger != NULL && finger->valid)
+            finger_push(finger, z, &range);
+        if (key_less(curr_node->key, key)) /* go right */
         {
-            curr_node = curr_node->right_child;
+            link = &curr_node->right_child;
+            range.lo = curr_node->key;
+            range.has_lo = true;
         }
         else /* go left */
         {
-            curr_node = curr_node->left_child;
+            link = &curr_node->left_child;
+            range.hi = curr_node->key;
+            range.has_hi = true;
         }
+        curr_node = reclaim_protect(curr_slot, link);
 
-        expected = false;
-        if (!curr_node->flag.compare_exchange_weak(expected, true))
+        if (!try_flag(curr_node))
         {
             dbg_printf("[FLAG] failed getting flag of 0x%lx\n", (unsigned long)curr_node);
             dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)z);
-            z->flag = false;// release z's flag
-            
+            release_flag(z);// release z's flag
+            contention_wait(&failures);
+            RB_STAT(STAT_INSERT_RESTARTS);
+            goto restart;
+        }
+
+        // a rotation below z may have moved curr_node meanwhile
+        if (curr_node != *link)
+        {
+            release_flag(curr_node);
+            release_flag(z);
+            RB_STAT(STAT_INSERT_RESTARTS);
             goto restart;
         }
 
         dbg_printf("[FLAG] get flag of 0x%lx\n", (unsigned long)curr_node);
 
-        if (!curr_node->is_leaf)
+        if (!is_leaf(curr_node))
         {
             // release old curr_node's flag
             dbg_printf("[FLAG] release flag of 0x%lx\n", (unsigned long)z);
-            z->flag = false;
+            release_flag(z);
         }
     }
-    
-    new_node->flag = true;
+
+    if (new_node == NULL)
+#ifdef TREE_VALUE
+        new_node = new_insert_node(key, value);
+#else
+        new_node = new_insert_node(key);
+#endif
+    set_flag(new_node);
     if (!setup_local_area_for_insert(z))
     {
-        curr_node->flag = false;
+        release_flag(curr_node);
         dbg_printf("[FLAG] release flag of %lu and %lu\n", (unsigned long)z, (unsigned long)curr_node);
-        z->flag = false;
+        release_flag(z);
+        contention_wait(&failures);
+        RB_STAT(STAT_INSERT_RESTARTS);
         goto restart;
     }
 
+    // a red parent with a red uncle is case 1, which makes the grandparent
+    // red. That ends the fixup when the node above it, our first marker,
+    // is black; otherwise the fixup moves up the tree and needs the fixup
+    // lock: take it if it is free, or give everything back and come again
+    // with it
+    if (!current_context->fixup_lock && get_color(z) == RED)
+    {
+        tree_node *gp = z->parent;
+        tree_node *uncle = is_left(z) ? gp->right_child : gp->left_child;
+        if (get_color(uncle) == RED && !is_root(root, gp) && get_color(gp->parent) == RED &&
+            !fixup_try_lock(root))
+        {
+            release_setup_markers();
+            release_flag(uncle);
+            release_flag(z->parent);
+            release_flag(curr_node);
+            release_flag(z);
+            fixup_lock(root);
+            goto restart;
+        }
+    }
+
     // now the local area has been setup
     // insert the node
     new_node->parent = z;
-    if (value <= z->value)
-    {
-        free(z->left_child);
+    write_begin(z);
+    if (!key_less(z->key, key))
         z->left_child = new_node;
-    }
     else
-    {
-        free(z->right_child);
         z->right_child = new_node;
-    }
+    write_end(z);
     
-    dbg_printf("[Insert] new node with value (%d)\n", value);
+    dbg_printf("[Insert] new node with key (%d)\n", key);
+    return new_node;
 }
 
 /**
- * insert a new node
- * fixup the tree to be a red-black tree
+ * basic insertion of a binary search tree
+ * further fixup needed for red-black tree
+ * false if the key is already in the tree, new_node is not linked then
  */
-void rb_insert(tree_node *root, int value)
+bool tree_insert(tree_node *root, tree_node *new_node)
 {
-    // init thread local nodes with flag
-    clear_local_area();
-
-    tree_node *new_node;
-    new_node = (tree_node *)malloc(sizeof(tree_node));
-    new_node->color = RED;
-    new_node->value = value;
-    new_node->left_child = create_leaf_node();
-    new_node->right_child = create_leaf_node();
-    new_node->is_leaf = false;
-    new_node->parent = NULL;
-    new_node->flag = false;
-    new_node->marker = DEFAULT_MARKER;
+#ifdef TREE_VALUE
+    return insert_from(root, new_node->key, new_node->value, new_node, NULL) != NULL;
+#else
+    return insert_from(root, new_node->key, new_node, NULL) != NULL;
+#endif
+}
 
-    tree_insert(root, new_node); // normal insert
+/**
+ * link a new node in and fixup the tree to be a red-black tree
+ * local_area collects the flags the fixup takes, see insert_area
+ * false if the key is already in the tree
+ */
+static bool insert_node(tree_node *root, tree_key key RB_VALUE_PARAM, insert_finger *finger,
+                        insert_area &local_area)
+{
+#ifdef TREE_VALUE
+    tree_node *new_node = insert_from(root, key, value, NULL, finger); // normal insert
+#else
+    tree_node *new_node = insert_from(root, key, NULL, finger); // normal insert
+#endif
+    if (new_node == NULL)
+    {
+        fixup_unlock(root);
+        return false;
+    }
 
     tree_node *curr_node = new_node;
     
     tree_node *parent, *uncle = NULL, *grandparent = NULL;
 
     parent = curr_node->parent;
-    vector<tree_node *> local_area = {curr_node, parent};
+    local_area.clear();
+    local_area.push_back(curr_node);
+    local_area.push_back(parent);
 
     if (parent != NULL)
     {
@@ -275,47 +686,54 @@ void rb_insert(tree_node *root, int value)
 
     local_area.push_back(uncle);
     local_area.push_back(grandparent);
+    tree_node *top = grandparent; // the markers are above it
 
     if (is_root(root, curr_node))
     {
-        curr_node->color = BLACK;
-        for (auto node:local_area)
-        {
-            if (node != NULL) 
-            {
-                dbg_printf("[FLAG] release flag of %lu\n", (unsigned long)node);
-                node->flag = false;
-            }
-        }
+        // empty tree: tree_insert only left the new node's flag set
+        set_color(curr_node, BLACK);
+        dbg_printf("[FLAG] release flag of %lu\n", (unsigned long)curr_node);
+        release_flag(curr_node);
+        fixup_unlock(root);
         dbg_printf("[INSERT] insertFixup complete.\n");
-        return;
+        return true;
     }
 
     while (true)
     {
         if (is_root(root, curr_node)) // trivial case 1
         {
-            curr_node->color = BLACK;
+            set_color(curr_node, BLACK);
             break;
         }
         
         parent = curr_node->parent;
 
-        if (parent->color == BLACK) // trivial case 2
+        if (get_color(parent) == BLACK) // trivial case 2
         {
             break;
         }
         
         uncle = get_uncle(curr_node);
 
-        if (parent->color == RED && uncle->color == RED) /* case 1 */
+        if (get_color(parent) == RED && get_color(uncle) == RED) /* case 1 */
         {
-            parent->color = BLACK;
-            uncle->color = BLACK;
+            set_color(parent, BLACK);
+            set_color(uncle, BLACK);
             // curr_node = parent->parent;
-            parent->parent->color = RED;
+            set_color(parent->parent, RED);
 
+            RB_STAT(STAT_INSERT_CASE_1);
+            // the node above the grandparent carries our marker, so its
+            // color holds; black, or no node at all, ends the fixup here
+            grandparent = parent->parent;
+            if (is_root(root, grandparent) || get_color(grandparent->parent) == BLACK)
+            {
+                curr_node = grandparent;
+                continue;
+            }
             curr_node = move_inserter_up(curr_node, local_area);
+            top = curr_node->parent->parent;
             continue;
         }
 
@@ -324,15 +742,18 @@ void rb_insert(tree_node *root, int value)
             switch (is_left(curr_node))
             {
             case false:
+                RB_STAT(STAT_INSERT_CASE_2);
                 left_rotate(root, parent);
                 curr_node = parent;
             case true:
                 parent = curr_node->parent;
                 uncle = get_uncle(curr_node);
 
-                parent->parent->color = RED;
-                parent->color = BLACK;
+                RB_STAT(STAT_INSERT_CASE_3);
+                set_color(parent->parent, RED);
+                set_color(parent, BLACK);
                 right_rotate(root, parent->parent);
+                top = parent;
                 break;
             }
             break;
@@ -342,57 +763,325 @@ void rb_insert(tree_node *root, int value)
             switch (is_left(curr_node))
             {
             case true:
+                RB_STAT(STAT_INSERT_CASE_2);
                 right_rotate(root, parent);
                 curr_node = parent;
             case false:
                 parent = curr_node->parent;
                 uncle = get_uncle(curr_node);
 
-                parent->parent->color = RED;
-                parent->color = BLACK;
+                RB_STAT(STAT_INSERT_CASE_3);
+                set_color(parent->parent, RED);
+                set_color(parent, BLACK);
                 left_rotate(root, parent->parent);
+                top = parent;
                 break;
             }
             break;
         }
     }
 
-    // release flags of all nodes in local_area
+#ifdef RB_ORDER_STATS
+    size_hold(new_node);
+#endif
+    // clear markers above, then release flags of all nodes in local_area
+    if (current_context->fixup_lock)
+    {
+        unsigned int failures = 0;
+        while (!release_markers_above(top, NULL))
+            contention_wait(&failures);
+    }
+    else
+        release_setup_markers();
     for (auto node : local_area)
     {
         if (node != NULL)
         {
             dbg_printf("[FLAG] release flag of %lu\n", (unsigned long)node);
-            node->flag = false;
+            release_flag(node);
         }
     }
+    fixup_unlock(root);
+#ifdef RB_ORDER_STATS
+    size_fix_up(root, new_node);
+#endif
+    return true;
+}
+
+/**
+ * insert key if it is not in the tree yet
+ * fixup the tree to be a red-black tree
+ * returns whether it was inserted; an existing key is found on the way
+ * down, before any node is made, and keeps its value
+ */
+bool rb_insert(tree_node *root, tree_key key RB_VALUE_PARAM)
+{
+    // init thread local nodes with flag
+    clear_local_area();
+    reclaim_enter();
+
+    insert_area local_area;
+#ifdef TREE_VALUE
+    bool inserted = insert_node(root, key, value, NULL, local_area);
+#else
+    bool inserted = insert_node(root, key, NULL, local_area);
+#endif
+    reclaim_exit();
     
     dbg_printf("[Insert] rb fixup complete.\n");
+    return inserted;
+}
+
+/**
+ * insert a batch of keys
+ *
+ * Sorts the batch by key and inserts the keys in order, each with its
+ * own fixup, but every descent after the first starts at the finger
+ * instead of at the root when the tree allows it. The whole batch is one
+ * operation for memory reclamation; with hazard pointers, which only
+ * keep a few nodes, the finger is not used. Keys already in the tree are
+ * skipped like in rb_insert(), and of equal keys in the batch the first
+ * one goes in. Returns the number of keys inserted.
+ */
+long rb_insert_batch(tree_node *root, const tree_key *keys RB_VALUES_PARAM, long n)
+{
+    vector<long> order(n);
+    for (long i = 0; i < n; i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(),
+                [keys](long a, long b) { return key_less(keys[a], keys[b]); });
+
+    clear_local_area();
+    reclaim_enter();
+    insert_finger finger;
+    finger.valid = false;
+    insert_finger *use_finger = reclaim_keeps_nodes() ? &finger : NULL;
+    insert_area local_area;
+    long inserted = 0;
+    for (auto i : order)
+    {
+#ifdef TREE_VALUE
+        inserted += insert_node(root, keys[i], values[i], use_finger, local_area);
+#else
+        inserted += insert_node(root, keys[i], use_finger, local_area);
+#endif
+    }
+    reclaim_exit();
+    return inserted;
+}
+
+/**
+ * bulk build
+ *
+ * rb_build() turns a sorted array into a tree without any search, flag
+ * or fixup: every subtree takes the middle key of its range, so the top
+ * full_levels levels are complete and the rest is at most one partial
+ * level. Nodes on the full levels are black and the ones below are red,
+ * which gives every path the same number of black nodes and no red node
+ * a red child. The top levels are built first, the subtrees below
+ * them are handed out to the threads one at a time.
+ */
+typedef struct build_task_t
+{
+    long lo, hi; // keys[lo, hi) go below parent
+    int depth;
+    tree_node *parent;
+    bool left;
+} build_task;
+
+typedef struct build_job_t
+{
+    const tree_key *keys;
+#ifdef TREE_VALUE
+    const tree_value *values;
+#endif
+    int full_levels;
+    int split_depth; // depth of the subtrees handed out
+    vector<build_task> tasks;
+    atomic<size_t> next_task;
+    atomic<bool> failed; // out of memory, see rb_build()
+} build_job;
+
+/**
+ * build the subtree of keys[lo, hi) at depth below parent and link it in
+ * above split_depth the subtrees at split_depth are only queued
+ */
+static void build_subtree(build_job *job, long lo, long hi, int depth,
+                          tree_node *parent, bool left, bool split)
+{
+    if (lo == hi)
+    {
+        if (left)
+            parent->left_child = nil_left(parent);
+        else
+            parent->right_child = nil_right(parent);
+        return;
+    }
+    if (split && depth == job->split_depth)
+    {
+        build_task task = {lo, hi, depth, parent, left};
+        job->tasks.push_back(task);
+        return;
+    }
+
+    long mid = lo + (hi - lo) / 2;
+    tree_node *node = alloc_node();
+    if (node == NULL)
+    {
+        // end the subtree here, the tree is taken apart afterwards
+        job->failed = true;
+        if (left)
+            parent->left_child = nil_left(parent);
+        else
+            parent->right_child = nil_right(parent);
+        return;
+    }
+    init_node_state(node, depth < job->full_levels ? BLACK : RED);
+    node->key = job->keys[mid];
+#ifdef TREE_VALUE
+    node->value = job->values[mid];
+#endif
+#ifdef RB_ORDER_STATS
+    node->size = hi - lo;
+#endif
+    node->parent = parent;
+    if (left)
+        parent->left_child = node;
+    else
+        parent->right_child = node;
+
+    build_subtree(job, lo, mid, depth + 1, node, true, split);
+    build_subtree(job, mid + 1, hi, depth + 1, node, false, split);
+}
+
+static void *build_worker(void *arg)
+{
+    build_job *job = (build_job *)arg;
+    size_t i;
+    while ((i = job->next_task.fetch_add(1)) < job->tasks.size())
+    {
+        build_task *task = &job->tasks[i];
+        build_subtree(job, task->lo, task->hi, task->depth, task->parent, task->left, false);
+    }
+    return NULL;
+}
+
+/**
+ * build the tree from n keys in strictly increasing order, with threads
+ * threads including the caller
+ * the tree must be empty and no other thread may use it meanwhile
+ * returns false if it is not empty or the keys are not sorted or repeat,
+ * or if it ran out of memory, which leaves the tree empty again
+ */
+bool rb_build(tree_node *root, const tree_key *keys RB_VALUES_PARAM, long n, int threads)
+{
+    if (!is_leaf(root->left_child))
+        return false;
+    for (long i = 1; i < n; i++)
+    {
+        if (!key_less(keys[i - 1], keys[i]))
+            return false;
+    }
+    if (n == 0)
+        return true;
+
+    build_job job;
+    job.keys = keys;
+#ifdef TREE_VALUE
+    job.values = values;
+#endif
+    // the largest full_levels with 2^full_levels - 1 <= n
+    job.full_levels = 0;
+    while ((2L << job.full_levels) - 1 <= n)
+        job.full_levels++;
+    // a few subtrees per thread, so uneven ones even out
+    job.split_depth = 0;
+    while (threads > 1 && (1L << job.split_depth) < 4L * threads &&
+           job.split_depth < job.full_levels)
+        job.split_depth++;
+    job.next_task = 0;
+    job.failed = false;
+
+    write_begin(root);
+    build_subtree(&job, 0, n, 0, root, true, true);
+    write_end(root);
+
+    vector<pthread_t> tid(threads > 1 ? threads - 1 : 0);
+    for (auto &t : tid)
+        pthread_create(&t, NULL, build_worker, &job);
+    build_worker(&job);
+    for (auto t : tid)
+        pthread_join(t, NULL);
+
+    if (job.failed)
+    {
+        // every subtree ended in nils, so the partial tree can be walked
+        write_begin(root);
+        free_nodes(root->left_child);
+        root->left_child = nil_left(root);
+        write_end(root);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * true if the fixup for removing y stays within the local area the
+ * setup has flagged, see setup_local_area_for_delete()
+ * That is no fixup at all, case 2 with a red parent, which takes the
+ * extra black, and case 4. Case 1, case 3 and a case 2 that moves up
+ * need flags from outside the area.
+ */
+static bool remove_fixup_is_local(tree_node *root, tree_node *y)
+{
+    tree_node *x = is_leaf(y->left_child) ? y->right_child : y->left_child;
+    if (get_color(y) == RED || get_color(x) == RED || y->parent == root)
+        return true;
+
+    // y is black with no child, so its sibling is a node
+    tree_node *w = is_left(y) ? y->parent->right_child : y->parent->left_child;
+    tree_node *outer = is_left(y) ? w->right_child : w->left_child;
+    tree_node *inner = is_left(y) ? w->left_child : w->right_child;
+    if (get_color(w) == RED)
+        return false; // case 1
+    if (get_color(outer) == RED)
+        return true; // case 4
+    if (get_color(inner) == RED)
+        return false; // case 3
+    return get_color(y->parent) == RED; // case 2
 }
 
 /**
  * red-black tree remove
  */
-void rb_remove(tree_node *root, int value)
+void rb_remove(tree_node *root, tree_key key)
 {
-    dbg_printf("[Remove] thread %ld value %d\n", thread_index, value);
+    dbg_printf("[Remove] thread %ld key %d\n", current_context->index, key);
     // init thread local nodes with flag
     clear_local_area();
+    reclaim_enter();
+    unsigned int failures = 0;
 restart:
 
-    tree_node *z = par_find(root, value);
+    tree_node *z = par_find(root, key);
     tree_node *y; // actual delete node
     if (z == NULL)
+    {
+        fixup_unlock(root);
+        reclaim_exit();
         return;
+    }
 
-    if (z->left_child->is_leaf || z->right_child->is_leaf)
+    if (is_leaf(z->left_child) || is_leaf(z->right_child))
         y = z;
     else
         y = par_find_successor(z);
     
     if (y == NULL)
     {
-        z->flag = false;
+        release_flag(z);
+        contention_wait(&failures);
+        RB_STAT(STAT_REMOVE_RESTARTS);
         goto restart;
     }
     
@@ -402,37 +1091,82 @@ restart:
     if (!setup_local_area_for_delete(y, z))
     {
         // release flags
-        y->flag = false;
-        if (y != z) z->flag = false;
+        release_flag(y);
+        if (y != z) release_flag(z);
+        contention_wait(&failures);
+        RB_STAT(STAT_REMOVE_RESTARTS);
         goto restart; // deletion failed, try again
     }
-    dbg_printf("[Remove] actual node with value %d\n", y->value);
+
+    // a fixup that leaves the local area is left to the holder of the
+    // fixup lock: take it if it is free, or give everything back and come
+    // again with it
+    if (!current_context->fixup_lock && !remove_fixup_is_local(root, y) &&
+        !fixup_try_lock(root))
+    {
+        release_setup_markers();
+        if (y != z && !is_in_local_area(z))
+            release_flag(z);
+        clear_local_area();
+        release_flag(y);
+        fixup_lock(root);
+        goto restart;
+    }
+    dbg_printf("[Remove] actual node with value %d\n", y->key);
     
+    // replace the key before y is unlinked, so it is always in the tree
+    if (y != z)
+    {
+        key_move_begin(root);
+        write_begin(z);
+        z->key = y->key;
+#ifdef TREE_VALUE
+        z->value = y->value;
+#endif
+        write_end(z);
+    }
+
     // unlink y from the tree
     tree_node *replace_node = replace_parent(root, y);
-
-    // replace the value
     if (y != z)
-        z->value = y->value;
+        key_move_end(root);
+#ifdef RB_ORDER_STATS
+    // the sizes change from y's parent up, we still hold its flag
+    tree_node *size_start = get_parent(replace_node);
+    if (size_start != root)
+        size_hold(size_start);
+#endif
     
     // release z's flag safely
     if (!is_in_local_area(z))
     {
-        z->flag = false;
-        dbg_printf("[Flag] release %d\n", z->value);
+        release_flag(z);
+        dbg_printf("[Flag] release %d\n", z->key);
     }
 
-    if (y->color == BLACK) /* fixup case */
+    if (get_color(y) == BLACK) /* fixup case */
         replace_node = rb_remove_fixup(root, replace_node, z);
     
     // clear markers above
-    while (!release_markers_above(replace_node->parent, z))
-        ;
+    if (current_context->fixup_lock)
+    {
+        failures = 0;
+        while (!release_markers_above(get_parent(replace_node), z))
+            contention_wait(&failures);
+    }
+    else
+        release_setup_markers();
 
     clear_local_area();
+    fixup_unlock(root);
+#ifdef RB_ORDER_STATS
+    if (size_start != root)
+        size_fix_up(root, size_start);
+#endif
     
-    dbg_printf("[Remove] node with value %d complete.\n", value);
+    dbg_printf("[Remove] node with key %d complete.\n", key);
     free_node(y);
+    reclaim_exit();
 }
 
 /**
@@ -444,37 +1178,66 @@ tree_node *rb_remove_fixup(tree_node *root,
                            tree_node *node,
                            tree_node *z)
 {
-    while (!is_root(root, node) && node->color == BLACK)
+    unsigned int failures = 0;
+    while (!is_root(root, node) && get_color(node) == BLACK)
     {
         tree_node *brother_node;
         if (is_left(node))
         {
-            brother_node = node->parent->right_child;
-            if (brother_node->color == RED) // case 1
+            brother_node = get_parent(node)->right_child;
+            if (get_color(brother_node) == RED) // case 1
             {
-                brother_node->color = BLACK;
-                node->parent->color = RED;
-                left_rotate(root, node->parent);
-                brother_node = node->parent->right_child; // must be black
+                // the children of the new brother join the local area,
+                // their flags are taken before anything changes
+                tree_node *new_brother = brother_node->left_child;
+                if (!get_fix_up_flags(new_brother->left_child, new_brother->right_child))
+                {
+                    RB_STAT(STAT_DELETER_RETRIES);
+                    contention_wait(&failures);
+                    continue;
+                }
+                failures = 0;
+                RB_STAT(STAT_REMOVE_CASE_1);
+                set_color(brother_node, BLACK);
+                set_color(get_parent(node), RED);
+                left_rotate(root, get_parent(node));
+                brother_node = get_parent(node)->right_child; // must be black
 
                 fix_up_case1(node, brother_node);
                 dbg_printf("[Remove] case1 done.\n");
             } // case 1 will definitely turn into case 2
 
-            if (brother_node->left_child->color == BLACK &&
-                brother_node->right_child->color == BLACK) // case 2
+            if (get_color(brother_node->left_child) == BLACK &&
+                get_color(brother_node->right_child) == BLACK) // case 2
             {
-                brother_node->color = RED;
+                RB_STAT(STAT_REMOVE_CASE_2);
+                set_color(brother_node, RED);
+                // a red parent takes the extra black, so there is
+                // nothing to move up for (always so after case 1)
+                if (get_color(get_parent(node)) == RED)
+                {
+                    set_color(get_parent(node), BLACK);
+                    dbg_printf("[Remove] case2 done.\n");
+                    break;
+                }
                 node = move_deleter_up(node);
                 dbg_printf("[Remove] case2 done.\n");
             }
 
-            else if (brother_node->right_child->color == BLACK) // case 3
+            else if (get_color(brother_node->right_child) == BLACK) // case 3
             {
-                brother_node->left_child->color = BLACK;
-                brother_node->color = RED;
+                if (!get_fix_up_flags(brother_node->left_child->left_child, NULL))
+                {
+                    RB_STAT(STAT_DELETER_RETRIES);
+                    contention_wait(&failures);
+                    continue;
+                }
+                failures = 0;
+                RB_STAT(STAT_REMOVE_CASE_3);
+                set_color(brother_node->left_child, BLACK);
+                set_color(brother_node, RED);
                 right_rotate(root, brother_node);
-                brother_node = node->parent->right_child;
+                brother_node = get_parent(node)->right_child;
 
                 fix_up_case3(node, brother_node);
                 dbg_printf("[Remove] case3 done.\n");
@@ -482,44 +1245,71 @@ tree_node *rb_remove_fixup(tree_node *root,
 
             else // case 4
             {
-                brother_node->color = node->parent->color;
-                node->parent->color = BLACK;
-                brother_node->right_child->color = BLACK;
-                left_rotate(root, node->parent);
+                RB_STAT(STAT_REMOVE_CASE_4);
+                set_color(brother_node, get_color(get_parent(node)));
+                set_color(get_parent(node), BLACK);
+                set_color(brother_node->right_child, BLACK);
+                left_rotate(root, get_parent(node));
 
-                node = node->parent;
+                node = get_parent(node);
                 dbg_printf("[Remove] case4 done.\n");
                 break;
             }
         }
         else // mirror case of the above
         {
-            brother_node = node->parent->left_child;
-            if (brother_node->color == RED)
+            brother_node = get_parent(node)->left_child;
+            if (get_color(brother_node) == RED)
             {
-                brother_node->color = BLACK;
-                node->parent->color = RED;
-                right_rotate(root, node->parent);
-                brother_node = node->parent->left_child;
+                tree_node *new_brother = brother_node->right_child;
+                if (!get_fix_up_flags(new_brother->left_child, new_brother->right_child))
+                {
+                    RB_STAT(STAT_DELETER_RETRIES);
+                    contention_wait(&failures);
+                    continue;
+                }
+                failures = 0;
+                RB_STAT(STAT_REMOVE_CASE_1);
+                set_color(brother_node, BLACK);
+                set_color(get_parent(node), RED);
+                right_rotate(root, get_parent(node));
+                brother_node = get_parent(node)->left_child;
 
                 fix_up_case1_r(node, brother_node);
                 dbg_printf("[Remove] case1 done.\n");
             }
 
-            if (brother_node->left_child->color == BLACK &&
-                     brother_node->right_child->color == BLACK)
+            if (get_color(brother_node->left_child) == BLACK &&
+                     get_color(brother_node->right_child) == BLACK)
             {
-                brother_node->color = RED;
+                RB_STAT(STAT_REMOVE_CASE_2);
+                set_color(brother_node, RED);
+                // a red parent takes the extra black, so there is
+                // nothing to move up for (always so after case 1)
+                if (get_color(get_parent(node)) == RED)
+                {
+                    set_color(get_parent(node), BLACK);
+                    dbg_printf("[Remove] case2 done.\n");
+                    break;
+                }
                 node = move_deleter_up(node);
                 dbg_printf("[Remove] case2 done.\n");
             }
 
-            else if (brother_node->left_child->color == BLACK) // case 3
+            else if (get_color(brother_node->left_child) == BLACK) // case 3
             {
-                brother_node->right_child->color = BLACK;
-                brother_node->color = RED;
+                if (!get_fix_up_flags(brother_node->right_child->right_child, NULL))
+                {
+                    RB_STAT(STAT_DELETER_RETRIES);
+                    contention_wait(&failures);
+                    continue;
+                }
+                failures = 0;
+                RB_STAT(STAT_REMOVE_CASE_3);
+                set_color(brother_node->right_child, BLACK);
+                set_color(brother_node, RED);
                 left_rotate(root, brother_node);
-                brother_node = node->parent->left_child;
+                brother_node = get_parent(node)->left_child;
 
                 fix_up_case3_r(node, brother_node);
                 dbg_printf("[Remove] case3 done.\n");
@@ -527,19 +1317,20 @@ tree_node *rb_remove_fixup(tree_node *root,
 
             else // case 4
             {
-                brother_node->color = node->parent->color;
-                node->parent->color = BLACK;
-                brother_node->left_child->color = BLACK;
-                right_rotate(root, node->parent);
+                RB_STAT(STAT_REMOVE_CASE_4);
+                set_color(brother_node, get_color(get_parent(node)));
+                set_color(get_parent(node), BLACK);
+                set_color(brother_node->left_child, BLACK);
+                right_rotate(root, get_parent(node));
 
-                node = node->parent;
+                node = get_parent(node);
                 dbg_printf("[Remove] case4 done.\n");
                 break;
             }
         }
     }
 
-    node->color = BLACK;
+    set_color(node, BLACK);
     
     dbg_printf("[Remove] fixup complete.\n");
     return node;
@@ -548,10 +1339,268 @@ tree_node *rb_remove_fixup(tree_node *root,
 /**
  * lock-free tree search
  */
-tree_node *tree_search(tree_node *root, int value)
+tree_node *tree_search(tree_node *root, tree_key key)
 {
-    tree_node *z = par_find(root, value);
+    // the returned node keeps its flag, so it cannot be retired
+    reclaim_enter();
+    tree_node *z = par_find(root, key);
+    reclaim_exit();
 
     dbg_printf("[Warning] tree serach not found.\n");
     return z;
 }
+
+/**
+ * one optimistic pass from the root, the visitor picks the way down
+ * returns 1 if the visitor stopped at a node, 0 if the walk ended at a
+ * nil, and -1 if a writer got in the way
+ */
+template <typename Visitor>
+static int opt_walk(tree_node *root, Visitor &visitor)
+{
+    uint32_t done = key_moves_count(key_moves_done(root));
+    uint32_t started = key_moves_count(key_moves_started(root));
+    if (started != done)
+        return -1; // a key is on its way up
+
+    tree_node *parent = root, *node, *next;
+    uint32_t parent_version, version;
+    int node_slot = HP_FIND_NODE, next_slot = HP_FIND_PREV, slot;
+    visitor.start();
+    if (!read_version(parent, &parent_version))
+        return -1;
+    node = reclaim_protect(node_slot, &parent->left_child);
+
+    while (!is_leaf(node))
+    {
+        // parent still links to node, so node is in the tree
+        if (!read_version(node, &version) || !check_version(parent, parent_version))
+            return -1;
+
+        // what the visitor read is good only if the version still holds
+        walk_step step = visitor.visit(node);
+        if (step == WALK_STOP)
+            return check_version(node, version) ? 1 : -1;
+
+        if (step == WALK_LEFT)
+            next = reclaim_protect(next_slot, &node->left_child);
+        else
+            next = reclaim_protect(next_slot, &node->right_child);
+        if (!check_version(node, version))
+            return -1;
+
+        slot = node_slot;
+        node_slot = next_slot;
+        next_slot = slot;
+        parent = node;
+        parent_version = version;
+        node = next;
+    }
+
+    // the nil hangs from parent, whose version covers it, so no key the
+    // visitor is after can hang there either
+    if (!check_version(parent, parent_version))
+        return -1;
+    if (key_moves_count(key_moves_started(root)) != started)
+        return -1;
+    return 0;
+}
+
+/**
+ * lookup that never writes to the tree
+ *
+ * Walks down without flags and validates the version of every node after
+ * reading it, see write_begin(). Passes that meet a writer start over
+ * from the root, after OPT_READ_TRIES of them the lookup falls back to
+ * par_find().
+ */
+bool rb_lookup(tree_node *root, tree_key key RB_VALUE_OUT)
+{
+#ifdef TREE_VALUE
+    find_visitor visitor(key, value);
+#else
+    find_visitor visitor(key);
+#endif
+    reclaim_enter();
+    for (int i = 0; i < OPT_READ_TRIES; i++)
+    {
+        int found = opt_walk(root, visitor);
+        if (found >= 0)
+        {
+            reclaim_exit();
+            return found;
+        }
+    }
+
+    tree_node *node = par_find(root, key);
+    if (node != NULL)
+    {
+#ifdef TREE_VALUE
+        *value = node->value;
+#endif
+        release_flag(node);
+    }
+    reclaim_exit();
+    return node != NULL;
+}
+
+/**
+ * find the smallest key greater than key, or equal to it if inclusive
+ *
+ * Walks down like rb_lookup(), so it never writes to the tree unless it
+ * has to fall back to par_find_next(). Returns false if there is no such
+ * key.
+ */
+bool rb_next(tree_node *root, tree_key key, bool inclusive, tree_key *next RB_VALUE_OUT)
+{
+#ifdef TREE_VALUE
+    next_visitor visitor(key, inclusive, next, value);
+#else
+    next_visitor visitor(key, inclusive, next);
+#endif
+    reclaim_enter();
+    for (int i = 0; i < OPT_READ_TRIES; i++)
+    {
+        if (opt_walk(root, visitor) >= 0)
+        {
+            reclaim_exit();
+            return visitor.found;
+        }
+    }
+
+#ifdef TREE_VALUE
+    bool found = par_find_next(root, key, inclusive, next, value);
+#else
+    bool found = par_find_next(root, key, inclusive, next);
+#endif
+    reclaim_exit();
+    return found;
+}
+
+/**
+ * iterator over the keys from lo upwards, the first rb_iter_next() gives
+ * the smallest key not less than lo
+ */
+void rb_iter_init(tree_iterator *it, tree_node *root, tree_key lo)
+{
+    it->root = root;
+    it->key = lo;
+    it->started = false;
+}
+
+/**
+ * move the iterator to the next key, false at the end of the tree
+ * every step is a search from the root for the key after the current
+ * one, so the iterator holds no node between steps
+ */
+bool rb_iter_next(tree_iterator *it)
+{
+    // a pass that gives up may leave a stale key in next
+    tree_key next;
+#ifdef TREE_VALUE
+    if (!rb_next(it->root, it->key, !it->started, &next, &it->value))
+#else
+    if (!rb_next(it->root, it->key, !it->started, &next))
+#endif
+        return false;
+    it->key = next;
+    it->started = true;
+    return true;
+}
+
+/**
+ * ordered range scan
+ *
+ * Calls fn for every key in [lo, hi] in increasing order until it
+ * returns false, and returns the number of keys it was called for. It
+ * runs concurrently with updates and is not a snapshot: every key it
+ * reports was in the tree at some moment during the scan, no key is
+ * reported twice, and every key that is in the tree for the whole scan
+ * is reported. Keys inserted or removed meanwhile may or may not be.
+ */
+long rb_scan(tree_node *root, tree_key lo, tree_key hi, rb_scan_fn fn, void *arg)
+{
+    tree_iterator it;
+    long count = 0;
+    rb_iter_init(&it, root, lo);
+    while (rb_iter_next(&it) && !key_less(hi, it.key))
+    {
+        count++;
+#ifdef TREE_VALUE
+        if (!fn(it.key, it.value, arg))
+#else
+        if (!fn(it.key, arg))
+#endif
+            break;
+    }
+    return count;
+}
+
+#ifdef RB_ORDER_STATS
+/**
+ * number of keys less than key, which is the rank of key if it is in
+ * the tree
+ *
+ * Walks down like rb_lookup() and adds up the sizes of the subtrees left
+ * of the path, so it is O(log n) and never writes to the tree unless it
+ * falls back to par_rank(). Exact while no update runs; with updates
+ * running it may be off by the updates still on their way up (see
+ * keeping subtree sizes).
+ */
+long rb_rank(tree_node *root, tree_key key)
+{
+    rank_visitor visitor(key);
+    long rank;
+    reclaim_enter();
+    for (int i = 0; i < OPT_READ_TRIES; i++)
+    {
+        if (opt_walk(root, visitor) >= 0)
+        {
+            reclaim_exit();
+            return visitor.below;
+        }
+    }
+
+    rank = par_rank(root, key);
+    reclaim_exit();
+    return rank;
+}
+
+/**
+ * find the key of the given rank, the smallest key has rank 0
+ *
+ * Walks down like rb_rank(), choosing the side by the size of the left
+ * subtree. Returns false if the tree has no more than rank keys. Exact
+ * while no update runs, see rb_rank().
+ */
+bool rb_select(tree_node *root, long rank, tree_key *key RB_VALUE_OUT)
+{
+    if (rank < 0)
+        return false;
+
+#ifdef TREE_VALUE
+    select_visitor visitor(rank, key, value);
+#else
+    select_visitor visitor(rank, key);
+#endif
+    reclaim_enter();
+    for (int i = 0; i < OPT_READ_TRIES; i++)
+    {
+        // a walk that ends at a nil found fewer than rank + 1 keys
+        int found = opt_walk(root, visitor);
+        if (found >= 0)
+        {
+            reclaim_exit();
+            return found;
+        }
+    }
+
+#ifdef TREE_VALUE
+    bool found = par_select(root, rank, key, value);
+#else
+    bool found = par_select(root, rank, key);
+#endif
+    reclaim_exit();
+    return found;
+}
+#endif
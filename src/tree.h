@@ -6,8 +6,11 @@
 #include <vector>
 #include <unistd.h>
 #include <atomic>
+#include <stdint.h>
+#include <assert.h>
+#include <functional> // std::less and friends for TREE_KEY_COMPARE
+#include <type_traits> // LockFreeRBMap checks its parameters
 
-extern thread_local long thread_index;
 extern bool remove_dbg; // for only debug remove
 
 // #define DEBUG
@@ -15,7 +18,7 @@ extern bool remove_dbg; // for only debug remove
 #define dbg_printf(fmt, ...) \
         do {                 \
             if (remove_dbg)  \
-                printf("T[%ld] %s line:%d %s():" fmt, thread_index, \
+                printf("T[%ld] %s line:%d %s():" fmt, current_context->index, \
                 __FILE__, __LINE__, __func__, ##__VA_ARGS__); \
         } while(0)
 
@@ -28,34 +31,483 @@ extern bool remove_dbg; // for only debug remove
 
 #define DEFAULT_MARKER -1
 
+/* memory reclamation schemes */
+#define RECLAIM_NONE 0  // removed nodes are never freed
+#define RECLAIM_EPOCH 1 // epoch-based reclamation
+#define RECLAIM_HAZARD 2 // hazard pointers, each retire list bounded by threads x hazards
+
+#ifndef RECLAIM_DEFAULT_MODE
+#define RECLAIM_DEFAULT_MODE RECLAIM_EPOCH
+#endif
+
+/* what a thread does when it fails to get a flag, see contention.cpp */
+#define CONTENTION_SPIN 0     // retry at once
+#define CONTENTION_SLEEP 1    // usleep(100) before every retry
+#define CONTENTION_BACKOFF 2  // randomized exponential backoff
+#define CONTENTION_YIELD 3    // spin once, then sched_yield()
+#define CONTENTION_ADAPTIVE 4 // backoff, then yield, tuned per thread
+
+#ifndef CONTENTION_DEFAULT_MODE
+#define CONTENTION_DEFAULT_MODE CONTENTION_ADAPTIVE
+#endif
+
+/* per-thread operation counters, see stats.cpp, -DRB_NO_STATS drops them */
+#define STAT_FLAG_FAILURES 0     // try_flag() found the flag taken
+#define STAT_INSERT_RESTARTS 1   // tree_insert() back to the root
+#define STAT_REMOVE_RESTARTS 2   // rb_remove() back to par_find()
+#define STAT_FIND_RESTARTS 3     // par_find() or par_find_next() back to the root
+#define STAT_MARKER_CONFLICTS 4  // another thread's marker in the way
+#define STAT_INSERTER_RETRIES 5  // failed tries of move_inserter_up()
+#define STAT_DELETER_RETRIES 6   // failed tries of move_deleter_up() or a fixup rotation
+#define STAT_INSERT_CASE_1 7     // insert fixup: red uncle, recolor
+#define STAT_INSERT_CASE_2 8     //   inner child, first rotation
+#define STAT_INSERT_CASE_3 9     //   rotation at the grandparent
+#define STAT_REMOVE_CASE_1 10    // remove fixup: red sibling
+#define STAT_REMOVE_CASE_2 11    //   black nephews, recolor
+#define STAT_REMOVE_CASE_3 12    //   far nephew black
+#define STAT_REMOVE_CASE_4 13    //   far nephew red
+#define STAT_INSERT_EXISTS 14    // rb_insert() found the key already there
+#define STAT_FIXUP_LOCK 15       // an update took the fixup lock, see fixup_lock()
+#define STAT_INSERT_MOVE_UP 16   // move_inserter_up() moved the fixup up
+#define STAT_REMOVE_MOVE_UP 17   // move_deleter_up() moved the fixup up
+#define STAT_COUNTERS 18
+
+/* hazard pointer slots, one per node held at the same time */
+#define HP_FIND_NODE 0 // par_find() and tree_insert() hand over hand
+#define HP_FIND_PREV 1
+#define HP_SUCC_NODE 2 // par_find_successor() hand over hand
+#define HP_SUCC_PREV 3
+#define HP_MARKER_1 4 // nodes above the local area that get markers
+#define HP_MARKER_2 5
+#define HP_MARKER_3 6
+#define HP_MARKER_4 7
+#define HP_MARKER_5 8
+#define HP_MARKER_6 9
+#define HP_SIZE_NODE 10  // size_fix_up() walking up, see RB_ORDER_STATS
+#define HP_SIZE_PREV 11
+#define HP_SIZE_CHILD 12 // rb_rank() and rb_select() reading a child's size
+#define RECLAIM_HAZARDS 13
+
+/* optimistic passes of rb_lookup() before it takes flags */
+#ifndef OPT_READ_TRIES
+#define OPT_READ_TRIES 8
+#endif
+
+/* node allocators */
+#define NODE_ALLOC_MALLOC 0 // glibc malloc/free
+#define NODE_ALLOC_SLAB 1   // per-thread slabs with a lock-free remote free list
+#define NODE_SLAB_SIZE (64 * 1024)
+
+#ifndef NODE_ALLOC_DEFAULT_MODE
+#define NODE_ALLOC_DEFAULT_MODE NODE_ALLOC_SLAB
+#endif
+
+/* thread pinning policies, see topology.cpp */
+#define PIN_NONE 0    // wherever the scheduler puts the thread
+#define PIN_COMPACT 1 // fill the cpus of a node before the next node
+#define PIN_SCATTER 2 // one thread per node in turn
+#define PIN_SOCKET 3  // an equal share of the threads per node, free within it
+#define TOPO_MAX_NODES 64
+
 using namespace std;
 
-typedef struct tree_node_t
-{
-    struct tree_node_t *parent;
-    struct tree_node_t *left_child;
-    struct tree_node_t *right_child;
-    int value;
-    char color; // RED or BLACK
-    bool is_leaf;
-    bool is_root;
-    atomic<bool> flag;
-    int marker;
+/* tree_node layouts, pick one with -DNODE_LAYOUT=... */
+#define NODE_LAYOUT_PACKED 0 // 32 bytes, the flag is a bit of the state word
+#define NODE_LAYOUT_LINE 1   // packed, one node per cache line
+#define NODE_LAYOUT_SPLIT 2  // the flag on a cache line of its own
+#define CACHE_LINE_SIZE 64
+
+#ifndef NODE_LAYOUT
+#define NODE_LAYOUT NODE_LAYOUT_PACKED
+#endif
+
+#if NODE_LAYOUT == NODE_LAYOUT_PACKED
+#define NODE_ALIGN
+#else
+#define NODE_ALIGN alignas(CACHE_LINE_SIZE)
+#endif
+
+/* bits of the node state word */
+#define NODE_FLAG 0x1         // flag, not used by NODE_LAYOUT_SPLIT
+#define NODE_BLACK 0x2        // color, RED when clear
+#define NODE_MARKER_SHIFT 2   // marker as a 12 bit thread index
+#define NODE_MARKER_BITS 12
+#define NODE_MARKER_MASK 0x3ffcu
+#define NODE_MARKER_MAX ((1 << (NODE_MARKER_BITS - 1)) - 1) // largest thread index
+#define NODE_VERSION_SHIFT 14 // bumped around every change of links or key
+#define NODE_VERSION_ONE (1u << NODE_VERSION_SHIFT)
+#define NODE_VERSION_MASK (~0u << NODE_VERSION_SHIFT)
+
+/**
+ * keys and values
+ *
+ * The tree is built for one key type and, optionally, one value type,
+ * chosen at compile time like the layout: -DTREE_KEY=uint64_t, and
+ * -DTREE_VALUE=... for a map instead of a set. Keys are ordered by
+ * TREE_KEY_LESS, give it for keys without operator <, or name a
+ * comparator type with TREE_KEY_COMPARE. The comparator is a stateless
+ * functor like std::less, built for every compare: the tree is not a
+ * template and no tree object carries an instance. With the default
+ * order equality is ==, so int and uint64_t keys are one compare each.
+ * Dummy nodes are told apart by their place above the root and never
+ * compared, so every key value can be stored.
+ */
+#ifndef TREE_KEY
+#define TREE_KEY int
+#endif
+#ifndef TREE_KEY_FMT
+#define TREE_KEY_FMT "%d" // show_tree() only
+#endif
+
+#ifdef TREE_KEY_COMPARE
+#ifdef TREE_KEY_LESS
+#error "give TREE_KEY_LESS or TREE_KEY_COMPARE, not both"
+#endif
+#define TREE_KEY_LESS(a, b) (tree_key_compare()((a), (b)))
+#endif
+
+#ifdef TREE_KEY_LESS
+#define TREE_KEY_EQUAL(a, b) (!TREE_KEY_LESS(a, b) && !TREE_KEY_LESS(b, a))
+#else
+#define TREE_KEY_LESS(a, b) ((a) < (b))
+#define TREE_KEY_EQUAL(a, b) ((a) == (b))
+#endif
+
+typedef TREE_KEY tree_key;
+
+// the order as an object, for std::set and the like
+#ifdef TREE_KEY_COMPARE
+typedef TREE_KEY_COMPARE tree_key_compare;
+#else
+struct tree_key_compare
+{
+    bool operator()(const tree_key &a, const tree_key &b) const
+    {
+        return TREE_KEY_LESS(a, b);
+    }
+};
+#endif
+
+#ifdef TREE_VALUE
+typedef TREE_VALUE tree_value;
+#define RB_VALUE_PARAM , tree_value value
+#define RB_VALUE_OUT , tree_value *value
+#define RB_VALUES_PARAM , const tree_value *values
+#else
+#define RB_VALUE_PARAM
+#define RB_VALUE_OUT
+#define RB_VALUES_PARAM
+#endif
+
+inline bool key_less(const tree_key &a, const tree_key &b)
+{
+    return TREE_KEY_LESS(a, b);
+}
+
+inline bool key_equal(const tree_key &a, const tree_key &b)
+{
+    return TREE_KEY_EQUAL(a, b);
+}
+
+/**
+ * node links
+ *
+ * A link is a plain pointer by default. With NODE_REF_INDEX every node
+ * lives in one arena that is reserved up front, and a link is the 32 bit
+ * index of the node in the arena, shifted to keep the nil tags. 0 is
+ * NULL; the first chunk of the arena is a slab header, never a node.
+ * node_link converts to and from tree_node * wherever it is used, so the
+ * tree code only ever deals with pointers.
+ */
+#ifdef NODE_REF_INDEX
+#ifndef NODE_ARENA_SIZE
+#define NODE_ARENA_SIZE ((size_t)16 << 30) // address space, not memory
+#endif
+#define NODE_REF_SHIFT 2 // room for the nil tags
+
+extern char *node_arena;
+
+struct tree_node_t;
+inline uint32_t link_encode(struct tree_node_t *node);
+inline struct tree_node_t *link_decode(uint32_t ref);
+
+class node_link
+{
+public:
+    uint32_t ref;
+
+    node_link() {}
+    node_link(struct tree_node_t *node) : ref(link_encode(node)) {}
+
+    operator struct tree_node_t *() const { return link_decode(ref); }
+    struct tree_node_t *operator->() const { return link_decode(ref); }
+    node_link &operator=(struct tree_node_t *node)
+    {
+        ref = link_encode(node);
+        return *this;
+    }
+};
+#else
+typedef struct tree_node_t *node_link;
+#endif
+
+typedef struct NODE_ALIGN tree_node_t
+{
+    node_link parent;
+    node_link left_child;
+    node_link right_child;
+    tree_key key;
+    atomic<uint32_t> state; // color, marker and flag, see the helpers below
+#ifdef RB_ORDER_STATS
+    atomic<uint32_t> size; // nodes in the subtree, see subtree sizes below
+#endif
+#ifdef TREE_VALUE
+    tree_value value; // last, a search never reads it
+#endif
+#if NODE_LAYOUT == NODE_LAYOUT_SPLIT
+    alignas(CACHE_LINE_SIZE) atomic<bool> flag;
+#endif
 } tree_node;
 
+/**
+ * the nodes an operation holds flags on
+ *
+ * A fixed array with a count instead of a vector, so that keeping track
+ * of flags never allocates. The capacities are bounds of the algorithm,
+ * not guesses: a remove holds its local area of five nodes, and an
+ * insert adds four nodes each time it moves up two levels.
+ */
+#define OWN_FLAG_MAX 5                 // x, w, the parent and w's children
+#define INSERT_AREA_MAX (4 + 4 * 64)   // a tree of 2^64 nodes is at most 128 levels deep
+
+template <int N>
+struct flag_list_t
+{
+    int size;
+    tree_node *nodes[N];
+
+    flag_list_t() : size(0) {}
+    void clear(void) { size = 0; }
+    void push_back(tree_node *node)
+    {
+        assert(size < N); // the bounds above are wrong if this fires
+        nodes[size++] = node;
+    }
+    tree_node **begin(void) { return nodes; }
+    tree_node **end(void) { return nodes + size; }
+
+    bool contains(tree_node *node) const
+    {
+        for (int i = 0; i < size; i++)
+        {
+            if (nodes[i] == node)
+                return true;
+        }
+        return false;
+    }
+};
+
+typedef flag_list_t<INSERT_AREA_MAX> insert_area;
+
+/**
+ * operation context
+ *
+ * The marker index of a thread, the nodes it holds flags on in its
+ * local area and where its last markers went. The free functions use the context current_context points
+ * to, which is a per-thread default set up by thread_index_init(), or
+ * the thread's context for the tree a LockFreeRBTree call is working on.
+ */
+typedef struct tree_context_t
+{
+    long index;
+    flag_list_t<OWN_FLAG_MAX> own_flag;
+    tree_node *marker[4]; // set by get_markers_above(), see release_setup_markers()
+    bool fixup_lock;      // holds the fixup lock of the tree, see fixup_lock()
+} tree_context;
+
+extern thread_local tree_context *current_context;
+
+/**
+ * work in the given context for the lifetime of the object
+ */
+struct context_scope_t
+{
+    tree_context *saved;
+
+    context_scope_t(tree_context *context) : saved(current_context)
+    {
+        current_context = context;
+    }
+
+    ~context_scope_t()
+    {
+        current_context = saved;
+    }
+};
+
+/**
+ * ordered iteration, see rb_scan()
+ * a scan callback returns false to stop the scan
+ */
+typedef struct tree_iterator_t
+{
+    tree_node *root;
+    tree_key key; // current key after rb_iter_next() returned true
+#ifdef TREE_VALUE
+    tree_value value;
+#endif
+    bool started;
+} tree_iterator;
+
+typedef bool (*rb_scan_fn)(tree_key key RB_VALUE_PARAM, void *arg);
+
+/**
+ * per-node visitors for the walks down from the root
+ *
+ * opt_walk() in tree.cpp validates versions and par_walk() in
+ * lockfree_utils.cpp gets flag hand over hand, but both go down the
+ * same way and leave the choice of child to a visitor. visit() is
+ * called once for every node on the way and says which child to go to,
+ * or to stop at the node. start() is called before every pass from the
+ * root, so a pass that restarts keeps nothing of the last one.
+ */
+enum walk_step
+{
+    WALK_LEFT,
+    WALK_RIGHT,
+    WALK_STOP
+};
+
+// stops at the node holding key, copies its value if value is not NULL
+struct find_visitor
+{
+    tree_key key;
+#ifdef TREE_VALUE
+    tree_value *value;
+
+    find_visitor(tree_key key, tree_value *value = NULL) : key(key), value(value) {}
+#else
+    find_visitor(tree_key key) : key(key) {}
+#endif
+
+    void start(void) {}
+
+    walk_step visit(tree_node *node)
+    {
+        tree_key node_key = node->key;
+        if (key_equal(key, node_key))
+        {
+#ifdef TREE_VALUE
+            if (value != NULL)
+                *value = node->value;
+#endif
+            return WALK_STOP;
+        }
+        return key_less(node_key, key) ? WALK_RIGHT : WALK_LEFT;
+    }
+};
+
+// keeps the smallest key past key on the way down, see rb_next()
+struct next_visitor
+{
+    tree_key key;
+    bool inclusive;
+    tree_key *next;
+#ifdef TREE_VALUE
+    tree_value *value;
+#endif
+    bool found; // *next holds a key
+
+#ifdef TREE_VALUE
+    next_visitor(tree_key key, bool inclusive, tree_key *next, tree_value *value)
+        : key(key), inclusive(inclusive), next(next), value(value), found(false) {}
+#else
+    next_visitor(tree_key key, bool inclusive, tree_key *next)
+        : key(key), inclusive(inclusive), next(next), found(false) {}
+#endif
+
+    void start(void) { found = false; }
+
+    walk_step visit(tree_node *node)
+    {
+        tree_key node_key = node->key;
+        bool equal = inclusive && key_equal(key, node_key);
+        if (!equal && !key_less(key, node_key))
+            return WALK_RIGHT;
+
+        // the smallest key on the way down that is past key
+        *next = node_key;
+#ifdef TREE_VALUE
+        *value = node->value;
+#endif
+        found = true;
+        return equal ? WALK_STOP : WALK_LEFT;
+    }
+};
+
+typedef struct reclaim_stats_t
+{
+    unsigned long retired;      // nodes handed to retire_node()
+    unsigned long freed;        // nodes actually freed
+    unsigned long pending;      // retired but not yet freed
+    unsigned long peak_pending; // largest retire list of a single thread
+    unsigned long bound;        // limit on peak_pending, 0 if unbounded
+} reclaim_stats;
+
+typedef struct node_alloc_stats_t
+{
+    unsigned long heaps;        // one per thread that ever allocated
+    unsigned long slabs;        // slabs taken from the system
+    unsigned long remote_frees; // nodes freed by a thread other than the owner
+    unsigned long bound_slabs;  // slabs placed on the node of their heap
+    long in_use;                // nodes allocated and not freed, retired ones included
+    long bytes_in_use;          // in_use with its share of the slab headers
+} node_alloc_stats;
+
+typedef struct rb_stats_t
+{
+    unsigned long count[STAT_COUNTERS]; // indexed by the STAT_ numbers
+} rb_stats;
+
+/**
+ * a snapshot image mapped into memory, see snapshot.cpp
+ */
+typedef struct rb_snapshot_t
+{
+    void *map;
+    size_t map_size;
+    long count;
+    const tree_key *keys; // in increasing order
+#ifdef TREE_VALUE
+    const tree_value *values;
+#endif
+} rb_snapshot;
+
 /* function prototypes */
 /* main functions */
 void thread_index_init(long i);
 tree_node *rb_init(void);
+void rb_destroy(tree_node *root);
 void right_rotate(tree_node *root, tree_node *node);
 void left_rotate(tree_node *root, tree_node *node);
-void tree_insert(tree_node *root, tree_node *node);
-void rb_insert(tree_node *root, int value);
-void rb_remove(tree_node *root, int value);
+bool tree_insert(tree_node *root, tree_node *node);
+bool rb_insert(tree_node *root, tree_key key RB_VALUE_PARAM);
+long rb_insert_batch(tree_node *root, const tree_key *keys RB_VALUES_PARAM, long n);
+bool rb_build(tree_node *root, const tree_key *keys RB_VALUES_PARAM, long n, int threads);
+void rb_remove(tree_node *root, tree_key key);
 tree_node *rb_remove_fixup(tree_node *root, 
                            tree_node *node,
                            tree_node *z);
-tree_node *tree_search(tree_node *root, int value);
+tree_node *tree_search(tree_node *root, tree_key key);
+bool rb_lookup(tree_node *root, tree_key key RB_VALUE_OUT);
+bool rb_next(tree_node *root, tree_key key, bool inclusive, tree_key *next RB_VALUE_OUT);
+void rb_iter_init(tree_iterator *it, tree_node *root, tree_key lo);
+bool rb_iter_next(tree_iterator *it);
+long rb_scan(tree_node *root, tree_key lo, tree_key hi, rb_scan_fn fn, void *arg);
+#ifdef RB_ORDER_STATS
+long rb_rank(tree_node *root, tree_key key);
+bool rb_select(tree_node *root, long rank, tree_key *key RB_VALUE_OUT);
+#endif
 
 /* utility functions  */
 tree_node *create_dummy_node(void);
@@ -64,35 +516,498 @@ void show_tree_file(tree_node *root);
 void show_tree(tree_node *root);
 bool check_tree(tree_node *root);
 bool check_tree_dfs(tree_node *root);
+long count_nodes(tree_node *root);
 
 bool is_root(tree_node *root, tree_node *node);
 bool is_left(tree_node *node);
 
-tree_node *create_leaf_node(void);
 tree_node *get_uncle(tree_node *node);
 tree_node *replace_parent(tree_node *root, tree_node *node);
 
 void free_node(tree_node *node);
 
+/* memory reclamation */
+void reclaim_init(int mode);
+void reclaim_enter(void);
+void reclaim_exit(void);
+bool reclaim_keeps_nodes(void);
+tree_node *reclaim_protect(int slot, node_link *ref);
+void retire_node(tree_node *node);
+void reclaim_drain(void);
+void reclaim_get_stats(reclaim_stats *stats);
+
+/* contention manager */
+void contention_init(int mode);
+void contention_wait(unsigned int *failures);
+const char *contention_name(int mode);
+
+/**
+ * the thread contexts of a tree object, see rb_tree.cpp
+ * The object owns the context of every thread that has used it and frees
+ * them all with itself, whichever threads made them.
+ */
+struct context_entry_t;
+
+typedef struct context_list_t
+{
+    unsigned long serial;    // never reused, names the tree in thread caches
+    atomic<long> next_index; // the marker index of the next new thread
+    atomic<struct context_entry_t *> head;
+
+    context_list_t();
+    ~context_list_t();
+    tree_context *get(void);
+
+    context_list_t(const context_list_t &) = delete;
+    context_list_t &operator=(const context_list_t &) = delete;
+} context_list;
+
+/* snapshot images */
+long rb_snapshot_save(tree_node *root, const char *path);
+rb_snapshot *rb_snapshot_open(const char *path);
+void rb_snapshot_close(rb_snapshot *snap);
+bool rb_snapshot_find(rb_snapshot *snap, tree_key key RB_VALUE_OUT);
+bool rb_snapshot_build(tree_node *root, rb_snapshot *snap, int threads);
+
+/* operation counters */
+void rb_get_stats(rb_stats *stats);
+void rb_reset_stats(void);
+const char *rb_stats_name(int counter);
+
+/* node allocator */
+void node_alloc_init(int mode);
+tree_node *alloc_node(void);
+void dealloc_node(tree_node *node);
+void node_alloc_get_stats(node_alloc_stats *stats);
+
+/* NUMA topology */
+void topo_init(int simulated_nodes);
+int topo_nodes(void);
+int topo_cpus(void);
+bool topo_simulated(void);
+int topo_current_node(void);
+int topo_pin(long index, int threads, int policy);
+bool topo_bind(void *mem, size_t size, int node);
+
 /* lock-free related */
 void clear_local_area(void);
 bool is_in_local_area(tree_node *target_node);
 
 // insert related
 bool setup_local_area_for_insert(tree_node *x);
-tree_node *move_inserter_up(tree_node *oldx, vector<tree_node *> &local_area);
+tree_node *move_inserter_up(tree_node *oldx, insert_area &local_area);
 
 // delete related
 bool setup_local_area_for_delete(tree_node *y, tree_node *z);
 tree_node *move_deleter_up(tree_node *oldx);
-tree_node *par_find(tree_node *root, int value);
+tree_node *par_find(tree_node *root, tree_key key);
+bool par_find_next(tree_node *root, tree_key key, bool inclusive,
+                   tree_key *next RB_VALUE_OUT);
+#ifdef RB_ORDER_STATS
+long par_rank(tree_node *root, tree_key key);
+bool par_select(tree_node *root, long rank, tree_key *key RB_VALUE_OUT);
+#endif
 tree_node *par_find_successor(tree_node *delete_node);
 bool release_markers_above(tree_node *start, tree_node *z);
+void release_setup_markers(void);
+bool get_fix_up_flags(tree_node *first, tree_node *second);
+void wait_no_others_marker(tree_node *node);
+// a fixup that moves up the tree takes the fixup lock first: updates are
+// then lock-free only while they fix up within their local area; those
+// that move up run one at a time and block on a preempted lock holder
+void fixup_lock(tree_node *root);
+bool fixup_try_lock(tree_node *root);
+void fixup_unlock(tree_node *root);
 void fix_up_case1(tree_node *x, tree_node *w);
 void fix_up_case3(tree_node *x, tree_node *w);
 void fix_up_case1_r(tree_node *x, tree_node *w); // mirror case
 void fix_up_case3_r(tree_node *x, tree_node *w); // mirror case
 
+/**
+ * nil children
+ *
+ * A missing child is not a node of its own. The child link holds the
+ * address of the parent with NIL_LEFT or NIL_RIGHT set in the low bits,
+ * so a nil knows its parent and side without being allocated, and it
+ * moves with its parent for free. A nil is black, has no marker, and
+ * its flag is covered by the parent's: every thread that reaches a nil
+ * holds the flag of the node it hangs from, so flag operations on a nil
+ * always succeed and do nothing.
+ *
+ * Never dereference a node that may be a nil, use the helpers below.
+ */
+#define NIL_LEFT 1
+#define NIL_RIGHT 2
+#define NIL_MASK 3
+
+#ifdef NODE_REF_INDEX
+inline uint32_t link_encode(tree_node *node)
+{
+    if (node == NULL)
+        return 0;
+    uintptr_t tag = (uintptr_t)node & NIL_MASK;
+    uint32_t index = ((char *)node - tag - node_arena) / sizeof(tree_node);
+    return (index << NODE_REF_SHIFT) | tag;
+}
+
+inline tree_node *link_decode(uint32_t ref)
+{
+    if (ref == 0)
+        return NULL;
+    char *node = node_arena + (size_t)(ref >> NODE_REF_SHIFT) * sizeof(tree_node);
+    return (tree_node *)((uintptr_t)node | (ref & NIL_MASK));
+}
+#endif
+
+/**
+ * read a link that other threads may change
+ */
+inline tree_node *load_link(node_link *link, int memorder)
+{
+#ifdef NODE_REF_INDEX
+    return link_decode(__atomic_load_n(&link->ref, memorder));
+#else
+    return __atomic_load_n(link, memorder);
+#endif
+}
+
+inline bool is_leaf(tree_node *node)
+{
+    return ((uintptr_t)node & NIL_MASK) != 0;
+}
+
+inline tree_node *nil_left(tree_node *parent)
+{
+    return (tree_node *)((uintptr_t)parent | NIL_LEFT);
+}
+
+inline tree_node *nil_right(tree_node *parent)
+{
+    return (tree_node *)((uintptr_t)parent | NIL_RIGHT);
+}
+
+inline tree_node *get_parent(tree_node *node)
+{
+    if (is_leaf(node))
+        return (tree_node *)((uintptr_t)node & ~(uintptr_t)NIL_MASK);
+    return node->parent;
+}
+
+/**
+ * node state
+ *
+ * Color, marker, version and, in the packed layouts, the flag share one
+ * 32 bit word, so a node is three pointers, the key and the state word.
+ * The word is only changed with atomic read-modify-write operations: the
+ * flag holder recolors a node while other threads may set or clear its
+ * marker, and neither may undo the other. Markers are thread indices
+ * below 2048.
+ */
+inline uint32_t node_state(char color)
+{
+    return (color == BLACK ? NODE_BLACK : 0) |
+           (((uint32_t)DEFAULT_MARKER << NODE_MARKER_SHIFT) & NODE_MARKER_MASK);
+}
+
+/**
+ * give a fresh node its color, no marker and no flag
+ */
+inline void init_node_state(tree_node *node, char color)
+{
+    node->state = node_state(color);
+#if NODE_LAYOUT == NODE_LAYOUT_SPLIT
+    node->flag = false;
+#endif
+}
+
+inline char get_color(tree_node *node)
+{
+    if (is_leaf(node))
+        return BLACK;
+    return (node->state.load(memory_order_relaxed) & NODE_BLACK) ? BLACK : RED;
+}
+
+inline void set_color(tree_node *node, char color)
+{
+    if (is_leaf(node))
+        return;
+    if (color == BLACK)
+        node->state.fetch_or(NODE_BLACK);
+    else
+        node->state.fetch_and(~(uint32_t)NODE_BLACK);
+}
+
+inline int get_marker(tree_node *node)
+{
+    if (is_leaf(node))
+        return DEFAULT_MARKER;
+    // sign extend the marker field, so DEFAULT_MARKER reads back as -1
+    uint32_t state = node->state.load(memory_order_relaxed);
+    return (int32_t)(state << (32 - NODE_MARKER_SHIFT - NODE_MARKER_BITS)) >> (32 - NODE_MARKER_BITS);
+}
+
+inline void set_marker(tree_node *node, int marker)
+{
+    if (is_leaf(node))
+        return;
+    uint32_t bits = ((uint32_t)marker << NODE_MARKER_SHIFT) & NODE_MARKER_MASK;
+    uint32_t old = node->state.load(memory_order_relaxed);
+    while (!node->state.compare_exchange_weak(old, (old & ~NODE_MARKER_MASK) | bits))
+        ;
+}
+
+/**
+ * clear the marker of a node only if it is still the given one, a
+ * marker another thread has set since is left alone
+ */
+inline void clear_marker(tree_node *node, int marker)
+{
+    if (is_leaf(node))
+        return;
+    uint32_t bits = ((uint32_t)marker << NODE_MARKER_SHIFT) & NODE_MARKER_MASK;
+    uint32_t old = node->state.load(memory_order_relaxed);
+    while ((old & NODE_MARKER_MASK) == bits &&
+           !node->state.compare_exchange_weak(old, old | NODE_MARKER_MASK))
+        ;
+}
+
+#ifdef RB_NO_STATS
+#define RB_STAT(counter) ((void)0)
+#else
+extern thread_local atomic<unsigned long> *thread_stats;
+atomic<unsigned long> *stats_register(void);
+
+/**
+ * count an event in the calling thread's record, only the owner writes
+ * it, so no read-modify-write is needed
+ */
+inline void stat_add(int counter)
+{
+    atomic<unsigned long> *stats = thread_stats;
+    if (stats == NULL)
+        stats = stats_register();
+    stats[counter].store(stats[counter].load(memory_order_relaxed) + 1,
+                         memory_order_relaxed);
+}
+#define RB_STAT(counter) stat_add(counter)
+#endif
+
+/**
+ * try to get the flag of a node, always succeeds on a nil
+ * a taken flag is only read, so spinning threads do not steal the line
+ */
+inline bool try_flag(tree_node *node)
+{
+    if (is_leaf(node))
+        return true;
+#if NODE_LAYOUT == NODE_LAYOUT_SPLIT
+    bool expect = false;
+    if (!node->flag.load(memory_order_relaxed) &&
+        node->flag.compare_exchange_strong(expect, true))
+        return true;
+#else
+    if (!(node->state.load(memory_order_relaxed) & NODE_FLAG) &&
+        !(node->state.fetch_or(NODE_FLAG) & NODE_FLAG))
+        return true;
+#endif
+    RB_STAT(STAT_FLAG_FAILURES);
+    return false;
+}
+
+inline void set_flag(tree_node *node)
+{
+    if (is_leaf(node))
+        return;
+#if NODE_LAYOUT == NODE_LAYOUT_SPLIT
+    node->flag = true;
+#else
+    node->state.fetch_or(NODE_FLAG);
+#endif
+}
+
+inline void release_flag(tree_node *node)
+{
+    if (is_leaf(node))
+        return;
+#if NODE_LAYOUT == NODE_LAYOUT_SPLIT
+    node->flag = false;
+#else
+    node->state.fetch_and(~(uint32_t)NODE_FLAG);
+#endif
+}
+
+inline bool has_flag(tree_node *node)
+{
+    if (is_leaf(node))
+        return false;
+#if NODE_LAYOUT == NODE_LAYOUT_SPLIT
+    return node->flag;
+#else
+    return node->state & NODE_FLAG;
+#endif
+}
+
+/**
+ * node versions
+ *
+ * Lookups may walk the tree without taking flags (see rb_lookup()), so
+ * every change of a node's links or key is bracketed by write_begin()
+ * and write_end() on that node, which leave the version odd in between.
+ * A reader takes the version before reading a node and checks it after,
+ * like a seqlock. The writer holds the node's flag, so there is only one
+ * writer per node.
+ */
+inline void write_begin(tree_node *node)
+{
+    if (!is_leaf(node))
+        node->state.fetch_add(NODE_VERSION_ONE);
+}
+
+inline void write_end(tree_node *node)
+{
+    if (!is_leaf(node))
+        node->state.fetch_add(NODE_VERSION_ONE);
+}
+
+/**
+ * get the version of a node, fails while a writer is changing it
+ */
+inline bool read_version(tree_node *node, uint32_t *version)
+{
+    *version = node->state.load(memory_order_acquire) & NODE_VERSION_MASK;
+    return !(*version & NODE_VERSION_ONE);
+}
+
+/**
+ * whether the node is unchanged since read_version()
+ */
+inline bool check_version(tree_node *node, uint32_t version)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return (node->state.load(memory_order_relaxed) & NODE_VERSION_MASK) == version;
+}
+
+#ifdef RB_ORDER_STATS
+/**
+ * subtree sizes
+ *
+ * Built with -DRB_ORDER_STATS, every node counts the nodes of its
+ * subtree, itself included, so rb_rank() and rb_select() need one walk
+ * down. A nil counts 0, and so does a node that has been unlinked. The
+ * size is written by the holder of the node's flag only, and read
+ * without one; see size_fix_up() for how it is kept up to date.
+ */
+inline uint32_t get_size(tree_node *node)
+{
+    if (is_leaf(node))
+        return 0;
+    return node->size.load(memory_order_relaxed);
+}
+
+/**
+ * recompute the size of a node we hold the flag of from its children
+ */
+inline void update_size(tree_node *node)
+{
+    node->size.store(get_size(node->left_child) + get_size(node->right_child) + 1,
+                     memory_order_relaxed);
+}
+
+// size of the left subtree of a node on a walk, see HP_SIZE_CHILD
+inline long left_size(tree_node *node)
+{
+    return get_size(reclaim_protect(HP_SIZE_CHILD, &node->left_child));
+}
+
+// adds up the sizes left of the way down to key, see rb_rank()
+struct rank_visitor
+{
+    tree_key key;
+    long below; // the number of keys less than key once the walk is done
+
+    rank_visitor(tree_key key) : key(key), below(0) {}
+
+    void start(void) { below = 0; }
+
+    walk_step visit(tree_node *node)
+    {
+        tree_key node_key = node->key;
+        if (key_equal(key, node_key))
+        {
+            below += left_size(node);
+            return WALK_STOP;
+        }
+        if (!key_less(node_key, key))
+            return WALK_LEFT;
+
+        // node and everything left of it is below key
+        below += left_size(node) + 1;
+        return WALK_RIGHT;
+    }
+};
+
+// goes the way the sizes point to the key of the given rank, see rb_select()
+struct select_visitor
+{
+    long rank;
+    long left; // rank within the subtree of the node visited next
+    tree_key *key;
+#ifdef TREE_VALUE
+    tree_value *value;
+
+    select_visitor(long rank, tree_key *key, tree_value *value)
+        : rank(rank), left(rank), key(key), value(value) {}
+#else
+    select_visitor(long rank, tree_key *key) : rank(rank), left(rank), key(key) {}
+#endif
+
+    void start(void) { left = rank; }
+
+    walk_step visit(tree_node *node)
+    {
+        long size = left_size(node);
+        if (left < size)
+            return WALK_LEFT;
+        if (left > size)
+        {
+            left -= size + 1;
+            return WALK_RIGHT;
+        }
+
+        *key = node->key;
+#ifdef TREE_VALUE
+        *value = node->value;
+#endif
+        return WALK_STOP;
+    }
+};
+#endif
+
+/**
+ * link child below parent, a nil child is re-homed to its new slot
+ */
+inline void set_left_child(tree_node *parent, tree_node *child)
+{
+    if (is_leaf(child))
+    {
+        parent->left_child = nil_left(parent);
+        return;
+    }
+    parent->left_child = child;
+    child->parent = parent;
+}
+
+inline void set_right_child(tree_node *parent, tree_node *child)
+{
+    if (is_leaf(child))
+    {
+        parent->right_child = nil_right(parent);
+        return;
+    }
+    parent->right_child = child;
+    child->parent = parent;
+}
+
 inline void print_get(tree_node *x)
 {
     dbg_printf("[FLAG] get flag of %lu\n", (unsigned long)x);
@@ -102,4 +1017,204 @@ inline void print_release(tree_node *x)
 {
     dbg_printf("[FLAG] release flag of %lu\n", (unsigned long)x);
 }
+
+/**
+ * tree object
+ *
+ * Owns a tree from rb_init() and keeps the context of every thread that
+ * works on it, so threads need no thread_index_init() and may use any
+ * number of trees at the same time. A thread gets the next free marker
+ * index of a tree when it first uses it, so at most NODE_MARKER_MAX + 1
+ * threads can ever work on one tree. The destructor must not run while
+ * any thread is still inside an operation on the tree.
+ *
+ * restore() brings back a tree saved with save() without waiting for
+ * it: find() answers from the mapped image at once while a thread
+ * builds the tree from it, and every other call waits for the build.
+ */
+class LockFreeRBTree
+{
+public:
+    LockFreeRBTree();
+    ~LockFreeRBTree();
+
+    bool insert(tree_key key RB_VALUE_PARAM);
+    long insert_batch(const tree_key *keys RB_VALUES_PARAM, long n);
+    bool build(const tree_key *keys RB_VALUES_PARAM, long n, int threads);
+    void remove(tree_key key);
+    bool find(tree_key key RB_VALUE_OUT);
+    long scan(tree_key lo, tree_key hi, rb_scan_fn fn, void *arg);
+#ifdef RB_ORDER_STATS
+    long rank(tree_key key);
+    bool select(long rank, tree_key *key RB_VALUE_OUT);
+#endif
+    long size(void);
+    bool check(void);
+    long save(const char *path);
+    bool restore(const char *path, int threads);
+    bool restored(void) { return !restoring.load(); }
+    bool wait_restored(void);
+    tree_node *root(void) { return root_node; }
+
+private:
+    tree_node *root_node;
+    context_list contexts;  // every thread's context for this tree
+    rb_snapshot *image;     // restored from, mapped until the tree is deleted
+    atomic<bool> restoring; // find() reads the image while set
+    bool restore_ok;        // what rb_snapshot_build() returned
+    pthread_mutex_t restore_lock;
+    pthread_cond_t restore_done; // restoring cleared
+    int restore_threads;
+    pthread_t restorer;
+
+    tree_context *context(void);
+    static void *restore_thread(void *arg);
+
+    LockFreeRBTree(const LockFreeRBTree &) = delete;
+    LockFreeRBTree &operator=(const LockFreeRBTree &) = delete;
+};
+
+/**
+ * tree object with its key parameters as a template
+ *
+ * The parameters of a map or set template, named over the tree of this
+ * build: the key, value and order stay compile-time choices of the build
+ * (see keys and values) and a parameter that differs from them does not
+ * compile. Value is void for a set. Alloc is node_allocator<mode> with
+ * the NODE_ALLOC_ mode the build allocates nodes with; node_alloc_init()
+ * chooses it for the whole program, not per tree. Every call is the one
+ * of LockFreeRBTree, so int and uint64_t keys still compare with one
+ * instruction in par_find().
+ */
+template <int Mode>
+struct node_allocator
+{
+    static const int mode = Mode;
+};
+
+#ifdef TREE_VALUE
+typedef tree_value tree_mapped;
+#else
+typedef void tree_mapped; // a set
+#endif
+
+template <class Key = tree_key, class Value = tree_mapped, class Compare = tree_key_compare,
+          class Alloc = node_allocator<NODE_ALLOC_DEFAULT_MODE>>
+class LockFreeRBMap
+{
+    static_assert(std::is_same<Key, tree_key>::value, "Key must be TREE_KEY of the build");
+    static_assert(std::is_same<Value, tree_mapped>::value,
+                  "Value must be TREE_VALUE of the build, or void without one");
+    static_assert(std::is_same<Compare, tree_key_compare>::value,
+                  "Compare must be tree_key_compare, see TREE_KEY_COMPARE");
+    static_assert(std::is_empty<Compare>::value, "Compare must be stateless");
+    static_assert(Alloc::mode == NODE_ALLOC_DEFAULT_MODE,
+                  "Alloc must name the build's allocator, see NODE_ALLOC_DEFAULT_MODE");
+
+public:
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef Compare key_compare;
+    typedef Alloc allocator_type;
+
+#ifdef TREE_VALUE
+    bool insert(const Key &key, const Value &value) { return tree.insert(key, value); }
+    long insert_batch(const Key *keys, const Value *values, long n)
+    {
+        return tree.insert_batch(keys, values, n);
+    }
+    bool build(const Key *keys, const Value *values, long n, int threads)
+    {
+        return tree.build(keys, values, n, threads);
+    }
+    bool find(const Key &key, Value *value) { return tree.find(key, value); }
+#else
+    bool insert(const Key &key) { return tree.insert(key); }
+    long insert_batch(const Key *keys, long n) { return tree.insert_batch(keys, n); }
+    bool build(const Key *keys, long n, int threads) { return tree.build(keys, n, threads); }
+    bool find(const Key &key) { return tree.find(key); }
+#endif
+    void remove(const Key &key) { tree.remove(key); }
+    long scan(const Key &lo, const Key &hi, rb_scan_fn fn, void *arg)
+    {
+        return tree.scan(lo, hi, fn, arg);
+    }
+    long size(void) { return tree.size(); }
+    bool check(void) { return tree.check(); }
+    long save(const char *path) { return tree.save(path); }
+    bool restore(const char *path, int threads) { return tree.restore(path, threads); }
+    bool wait_restored(void) { return tree.wait_restored(); }
+    key_compare key_comp(void) const { return key_compare(); }
+    LockFreeRBTree &base(void) { return tree; }
+
+private:
+    LockFreeRBTree tree;
+};
+
+/* sharded tree object, see sharded_tree.cpp */
+#define SHARD_SAMPLE_EVERY 64  // a thread samples one operation in so many
+#define SHARD_SAMPLES 256      // keys of sampled operations kept per shard
+#define SHARD_BALANCE_USEC 10000 // time between two balance steps
+#define SHARD_BALANCE_MIN 4096 // operations per shard since the last step before balancing
+#define SHARD_SKEW 1.5         // load of the busiest shard over the mean that is skewed
+#define SHARD_MOVE_MAX 4096    // keys one balance step moves at most
+
+struct shard_t;
+struct shard_table_t;
+struct shard_slot_t;
+
+/**
+ * sharded tree object
+ *
+ * Keys are split by range between a fixed number of independent trees,
+ * so operations on different shards share no flags, not even the ones
+ * of the dummies above the root. The boundaries move while operations
+ * run: a balance step hands keys next to a boundary from the busiest
+ * shard to a less busy neighbour. Threads need no setup, like in
+ * LockFreeRBTree, and at most NODE_MARKER_MAX + 1 of them can ever use
+ * one object.
+ */
+class ShardedRBTree
+{
+public:
+    ShardedRBTree(int shards, bool balance_thread = true);
+    ~ShardedRBTree();
+
+    bool insert(tree_key key RB_VALUE_PARAM);
+    bool build(const tree_key *keys RB_VALUES_PARAM, long n, int threads);
+    void remove(tree_key key);
+    bool find(tree_key key RB_VALUE_OUT);
+    long scan(tree_key lo, tree_key hi, rb_scan_fn fn, void *arg);
+    bool balance(void);
+    int shards(void) { return shard_count; }
+    long boundary_moves(void) { return moves; }
+    long size(void);
+    bool check(void);
+
+private:
+    int shard_count;
+    struct shard_t *shard_list;
+    atomic<struct shard_table_t *> table;
+    atomic<unsigned long> tables; // published so far, the version of the last one
+    struct shard_slot_t *slots;   // the table every thread is working with
+    context_list contexts;        // one for all shards
+    atomic<bool> balancing;
+    atomic<long> moves;
+    atomic<bool> stop;
+    pthread_t balancer;
+    bool has_balancer;
+
+    tree_context *context(void);
+    int enter(tree_context *ctx, tree_key key);
+    void leave(tree_context *ctx);
+    void wait_readers(struct shard_table_t *old);
+    void sample(int shard, tree_key key);
+    void publish(struct shard_table_t *next);
+    bool balance_step(void);
+    void move_bound(int from, int to, tree_key bound);
+    static void *balance_loop(void *arg);
+
+    ShardedRBTree(const ShardedRBTree &) = delete;
+    ShardedRBTree &operator=(const ShardedRBTree &) = delete;
+};
 #endif
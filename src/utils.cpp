@@ -11,39 +11,41 @@ pthread_mutex_t show_tree_lock; // for print the whole tree
 
 /**
  * create a dummy black node, for initialization use
+ * the key of a dummy is never compared, so no key is reserved for it
  */
 tree_node *create_dummy_node(void)
 {
     tree_node *node;
-    node = (tree_node *)malloc(sizeof(tree_node));
-    node->color = BLACK;
-    node->value = INT32_MAX;
-    node->left_child = create_leaf_node();
-    node->right_child = create_leaf_node();
-    node->is_leaf = false;
+    node = alloc_node();
+    if (node == NULL)
+    {
+        fprintf(stderr, "[ERROR] out of memory.\n");
+        exit(1);
+    }
+    init_node_state(node, BLACK);
+    node->left_child = nil_left(node);
+    node->right_child = nil_right(node);
     node->parent = NULL;
-    node->flag = false;
-    node->marker = DEFAULT_MARKER;
     return node;
 }
 
 /**
  * create a red node, for insertion use
  */
-tree_node *create_node(int value)
+tree_node *create_node(tree_key key)
 {
     tree_node *new_node;
-    new_node = (tree_node *)malloc(sizeof(tree_node));
-    new_node->color = RED;
-    new_node->value = value;
-    new_node->left_child = create_leaf_node();
-    new_node->right_child = create_leaf_node();
-    new_node->left_child->parent = new_node;
-    new_node->right_child->parent = new_node;
-    new_node->is_leaf = false;
+    new_node = alloc_node();
+    if (new_node == NULL)
+    {
+        fprintf(stderr, "[ERROR] out of memory.\n");
+        exit(1);
+    }
+    init_node_state(new_node, RED);
+    new_node->key = key;
+    new_node->left_child = nil_left(new_node);
+    new_node->right_child = nil_right(new_node);
     new_node->parent = NULL;
-    new_node->flag = false;
-    new_node->marker = DEFAULT_MARKER;
     return new_node;
 }
 
@@ -56,10 +58,10 @@ void show_tree(tree_node *root)
 {
     pthread_mutex_lock(&show_tree_lock);
     dbg_printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-    printf("[root] pointer: 0x%lx flag:%d\n", (unsigned long) root, (int) root->flag);
+    printf("[root] pointer: 0x%lx flag:%d\n", (unsigned long) root, (int)has_flag(root));
 
     tree_node *root_node = root->left_child;
-    if (root_node->is_leaf)
+    if (is_leaf(root_node))
     {
         printf("Empty Tree.\n");
         pthread_mutex_unlock(&show_tree_lock);
@@ -76,37 +78,37 @@ void show_tree(tree_node *root)
         tree_node *left_child = cur_node->left_child;
         tree_node *right_child = cur_node->right_child;
 
-        printf("pointer: 0x%lx flag:%d marker: %d\n", (unsigned long) cur_node, (int) cur_node->flag, cur_node->marker);
+        printf("pointer: 0x%lx flag:%d marker: %d\n", (unsigned long) cur_node, (int)has_flag(cur_node), get_marker(cur_node));
 
-        if (cur_node->color == BLACK)
-            printf("(%d) Black\n", cur_node->value);
+        if (get_color(cur_node) == BLACK)
+            printf("(" TREE_KEY_FMT ") Black\n", cur_node->key);
         else
-            printf("(%d) Red\n", cur_node->value);
+            printf("(" TREE_KEY_FMT ") Red\n", cur_node->key);
 
         frontier.pop_back();
-        if (left_child->is_leaf)
+        if (is_leaf(left_child))
         {
-            printf("    left null flag:%d pointer: 0x%lx\n", (int)left_child->flag, (unsigned long)left_child);
+            printf("    left null pointer: 0x%lx\n", (unsigned long)left_child);
         }
         else
         {
-            if (left_child->color == BLACK)
-                printf("    (%d) Black\n", left_child->value);
+            if (get_color(left_child) == BLACK)
+                printf("    (" TREE_KEY_FMT ") Black\n", left_child->key);
             else
-                printf("    (%d) Red\n", left_child->value);
+                printf("    (" TREE_KEY_FMT ") Red\n", left_child->key);
             frontier.push_back(left_child);
         }
 
-        if (right_child->is_leaf)
+        if (is_leaf(right_child))
         {
-            printf("    right null flag:%d pointer: 0x%lx\n", (int)right_child->flag, (unsigned long)right_child);
+            printf("    right null pointer: 0x%lx\n", (unsigned long)right_child);
         }
         else
         {
-            if (right_child->color == BLACK)
-                printf("    (%d) Black\n", right_child->value);
+            if (get_color(right_child) == BLACK)
+                printf("    (" TREE_KEY_FMT ") Black\n", right_child->key);
             else
-                printf("    (%d) Red\n", right_child->value);
+                printf("    (" TREE_KEY_FMT ") Red\n", right_child->key);
             frontier.push_back(right_child);
         }
     }
@@ -122,10 +124,10 @@ void show_tree(tree_node *root)
 void show_tree_strict(tree_node *root)
 {
     printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-    printf("[root] pointer: 0x%lx flag:%d\n", (unsigned long)root, (int)root->flag);
+    printf("[root] pointer: 0x%lx flag:%d\n", (unsigned long)root, (int)has_flag(root));
 
     tree_node *root_node = root->left_child;
-    if (root_node->is_leaf)
+    if (is_leaf(root_node))
     {
         printf("Empty Tree.\n");
         return;
@@ -141,45 +143,45 @@ void show_tree_strict(tree_node *root)
         tree_node *left_child = cur_node->left_child;
         tree_node *right_child = cur_node->right_child;
 
-        printf("pointer: 0x%lx flag:%d marker: %d\n", (unsigned long)cur_node, (int)cur_node->flag, cur_node->marker);
-        if (cur_node->flag) 
+        printf("pointer: 0x%lx flag:%d marker: %d\n", (unsigned long)cur_node, (int)has_flag(cur_node), get_marker(cur_node));
+        if (has_flag(cur_node)) 
             printf(">>>>>>> FLAG WARNING <<<<<<<\n");
-        if (cur_node->marker != DEFAULT_MARKER) 
+        if (get_marker(cur_node) != DEFAULT_MARKER) 
             printf(">>>>>>> MARKER WARNING <<<<<<<\n");
 
-        if (cur_node->color == BLACK)
-            printf("(%d) Black\n", cur_node->value);
+        if (get_color(cur_node) == BLACK)
+            printf("(" TREE_KEY_FMT ") Black\n", cur_node->key);
         else
-            printf("(%d) Red\n", cur_node->value);
+            printf("(" TREE_KEY_FMT ") Red\n", cur_node->key);
 
         frontier.pop_back();
-        if (left_child->is_leaf)
+        if (is_leaf(left_child))
         {
-            printf("    left null flag:%d pointer: 0x%lx\n", (int)left_child->flag, (unsigned long)left_child);
-            if (cur_node->flag)
+            printf("    left null pointer: 0x%lx\n", (unsigned long)left_child);
+            if (has_flag(cur_node))
                 printf(">>>>>>> FLAG WARNING <<<<<<<\n");
         }
         else
         {
-            if (left_child->color == BLACK)
-                printf("    (%d) Black\n", left_child->value);
+            if (get_color(left_child) == BLACK)
+                printf("    (" TREE_KEY_FMT ") Black\n", left_child->key);
             else
-                printf("    (%d) Red\n", left_child->value);
+                printf("    (" TREE_KEY_FMT ") Red\n", left_child->key);
             frontier.push_back(left_child);
         }
 
-        if (right_child->is_leaf)
+        if (is_leaf(right_child))
         {
-            printf("    right null flag:%d pointer: 0x%lx\n", (int)right_child->flag, (unsigned long)right_child);
-            if (cur_node->flag)
+            printf("    right null pointer: 0x%lx\n", (unsigned long)right_child);
+            if (has_flag(cur_node))
                 printf(">>>>>>> FLAG WARNING <<<<<<<\n");
         }
         else
         {
-            if (right_child->color == BLACK)
-                printf("    (%d) Black\n", right_child->value);
+            if (get_color(right_child) == BLACK)
+                printf("    (" TREE_KEY_FMT ") Black\n", right_child->key);
             else
-                printf("    (%d) Red\n", right_child->value);
+                printf("    (" TREE_KEY_FMT ") Red\n", right_child->key);
             frontier.push_back(right_child);
         }
     }
@@ -196,10 +198,10 @@ void show_tree_file(tree_node *root)
     FILE *fd = fopen("./show_tree.txt", "w");
 
     fprintf(fd, "\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-    fprintf(fd, "[root] pointer: 0x%lx flag:%d\n", (unsigned long)root, (int)root->flag);
+    fprintf(fd, "[root] pointer: 0x%lx flag:%d\n", (unsigned long)root, (int)has_flag(root));
 
     tree_node *root_node = root->left_child;
-    if (root_node->is_leaf)
+    if (is_leaf(root_node))
     {
         fprintf(fd, "Empty Tree.\n");
         fclose(fd);
@@ -216,37 +218,37 @@ void show_tree_file(tree_node *root)
         tree_node *left_child = cur_node->left_child;
         tree_node *right_child = cur_node->right_child;
 
-        fprintf(fd, "pointer: 0x%lx flag:%d marker: %d\n", (unsigned long)cur_node, (int)cur_node->flag, cur_node->marker);
+        fprintf(fd, "pointer: 0x%lx flag:%d marker: %d\n", (unsigned long)cur_node, (int)has_flag(cur_node), get_marker(cur_node));
 
-        if (cur_node->color == BLACK)
-            fprintf(fd, "(%d) Black\n", cur_node->value);
+        if (get_color(cur_node) == BLACK)
+            fprintf(fd, "(" TREE_KEY_FMT ") Black\n", cur_node->key);
         else
-            fprintf(fd, "(%d) Red\n", cur_node->value);
+            fprintf(fd, "(" TREE_KEY_FMT ") Red\n", cur_node->key);
 
         frontier.pop_back();
-        if (left_child->is_leaf)
+        if (is_leaf(left_child))
         {
-            fprintf(fd, "    left null flag:%d pointer: 0x%lx\n", (int)left_child->flag, (unsigned long)left_child);
+            fprintf(fd, "    left null pointer: 0x%lx\n", (unsigned long)left_child);
         }
         else
         {
-            if (left_child->color == BLACK)
-                fprintf(fd, "    (%d) Black\n", left_child->value);
+            if (get_color(left_child) == BLACK)
+                fprintf(fd, "    (" TREE_KEY_FMT ") Black\n", left_child->key);
             else
-                fprintf(fd, "    (%d) Red\n", left_child->value);
+                fprintf(fd, "    (" TREE_KEY_FMT ") Red\n", left_child->key);
             frontier.push_back(left_child);
         }
 
-        if (right_child->is_leaf)
+        if (is_leaf(right_child))
         {
-            fprintf(fd, "    right null flag:%d pointer: 0x%lx\n", (int)right_child->flag, (unsigned long)right_child);
+            fprintf(fd, "    right null pointer: 0x%lx\n", (unsigned long)right_child);
         }
         else
         {
-            if (right_child->color == BLACK)
-                fprintf(fd, "    (%d) Black\n", right_child->value);
+            if (get_color(right_child) == BLACK)
+                fprintf(fd, "    (" TREE_KEY_FMT ") Black\n", right_child->key);
             else
-                fprintf(fd, "    (%d) Red\n", right_child->value);
+                fprintf(fd, "    (" TREE_KEY_FMT ") Red\n", right_child->key);
             frontier.push_back(right_child);
         }
     }
@@ -262,7 +264,10 @@ bool check_tree(tree_node *root)
     // rule 1,3 inherently holds
     // rule 2
     root = root->left_child;
-    if (root->color != BLACK)
+    if (is_leaf(root))
+        return true; // empty tree
+
+    if (get_color(root) != BLACK)
     {
         fprintf(stderr, "[ERROR] tree root with non-black color\n");
         return false;
@@ -279,14 +284,14 @@ bool check_tree(tree_node *root)
         tree_node *right_child = cur_node->right_child;
 
         // rule 4
-        if (cur_node->color == RED)
+        if (get_color(cur_node) == RED)
         {
-            if (left_child->color == RED)
+            if (get_color(left_child) == RED)
             {
                 fprintf(stderr, "[ERROR] red node's child must be black.\n");
                 return false;
             }
-            if (right_child->color == RED)
+            if (get_color(right_child) == RED)
             {
                 fprintf(stderr, "[ERROR] red node's child must be black.\n");
                 return false;
@@ -294,47 +299,47 @@ bool check_tree(tree_node *root)
         }
 
         // rule 5
-        if (cur_node->color == BLACK)
+        if (get_color(cur_node) == BLACK)
         {
-            if (!left_child->is_leaf && !right_child->is_leaf)
+            if (!is_leaf(left_child) && !is_leaf(right_child))
             {
-                if (left_child->color != right_child->color)
+                if (get_color(left_child) != get_color(right_child))
                 {
                     fprintf(stderr,
                             "[ERROR] rule 5 violated.\n");
                     return false;
                 }
             }
-            else if (left_child->is_leaf && right_child->is_leaf)
+            else if (is_leaf(left_child) && is_leaf(right_child))
             {
                 /* seems good */
             }
-            else if (left_child->is_leaf)
+            else if (is_leaf(left_child))
             {
                 /* right_child must be red and has two NULL children */
-                if (right_child->color != RED)
+                if (get_color(right_child) != RED)
                 {
                     fprintf(stderr,
                             "[ERROR] rule 5 violated.\n");
                     return false;
                 }
-                if (right_child->left_child || right_child->right_child)
+                if (!is_leaf(right_child->left_child) || !is_leaf(right_child->right_child))
                 {
                     fprintf(stderr,
                             "[ERROR] rule 5 violated.\n");
                     return false;
                 }
             }
-            else if (right_child->is_leaf)
+            else if (is_leaf(right_child))
             {
                 /* left_child must be red and has two NULL children */
-                if (left_child->color != RED)
+                if (get_color(left_child) != RED)
                 {
                     fprintf(stderr,
                             "[ERROR] rule 5 violated.\n");
                     return false;
                 }
-                if (left_child->left_child || left_child->right_child)
+                if (!is_leaf(left_child->left_child) || !is_leaf(left_child->right_child))
                 {
                     fprintf(stderr,
                             "[ERROR] rule 5 violated.\n");
@@ -344,11 +349,11 @@ bool check_tree(tree_node *root)
         }
 
         frontier.pop_back();
-        if (!left_child->is_leaf)
+        if (!is_leaf(left_child))
         {
             frontier.push_back(left_child);
         }
-        if (!right_child->is_leaf)
+        if (!is_leaf(right_child))
         {
             frontier.push_back(right_child);
         }
@@ -358,7 +363,7 @@ bool check_tree(tree_node *root)
 }
 
 /**
- * check_tree_dfs_util: return the height of current node. 
+ * check_tree_dfs_util: return the black height of current node. 
  *      compute heights of two sub-trees first.
  *      also determine if rule 4 is violated between this node and its children.
  *      return 0 if rule 4 or 5 is violated.
@@ -366,33 +371,33 @@ bool check_tree(tree_node *root)
 int check_tree_dfs_util(tree_node *node)
 {
     // no more check for leaf node
-    if (node->is_leaf)
+    if (is_leaf(node))
     {
         return 1;
     }
 
     // check value
-    if (!node->left_child->is_leaf && node->left_child->value > node->value)
+    if (!is_leaf(node->left_child) && key_less(node->key, node->left_child->key))
     {
         dbg_printf("[ERROR] left child's value is larger than parent's.\n");
         return 0;
     }
-    if (!node->right_child->is_leaf && node->right_child->value < node->value)
+    if (!is_leaf(node->right_child) && key_less(node->right_child->key, node->key))
     {
         dbg_printf("[ERROR] right child's value is smaller than parent's.\n");
         return 0;
     }
 
     // check rule 4
-    if (node->color == RED)
+    if (get_color(node) == RED)
     {
-        if (!node->left_child->is_leaf && node->left_child->color == RED)
+        if (!is_leaf(node->left_child) && get_color(node->left_child) == RED)
         {
             dbg_printf("[ERROR] rule 4 is violated.\n");
             return 0;
         }
 
-        if (!node->right_child->is_leaf && node->right_child->color == RED)
+        if (!is_leaf(node->right_child) && get_color(node->right_child) == RED)
         {
             dbg_printf("[ERROR] rule 4 is violated.\n");
             return 0;
@@ -416,8 +421,32 @@ int check_tree_dfs_util(tree_node *node)
         return 0;
     }
 
-    return left_height + 1;
+    // only black nodes count for rule 5
+    if (get_color(node) == BLACK)
+        return left_height + 1;
+    return left_height;
+}
+
+#ifdef RB_ORDER_STATS
+/**
+ * check the subtree sizes below node, returns the size or -1
+ */
+static long check_sizes(tree_node *node)
+{
+    if (is_leaf(node))
+        return 0;
+    long left = check_sizes(node->left_child);
+    long right = check_sizes(node->right_child);
+    if (left < 0 || right < 0)
+        return -1;
+    if (get_size(node) != left + right + 1)
+    {
+        dbg_printf("[ERROR] wrong subtree size.\n");
+        return -1;
+    }
+    return left + right + 1;
 }
+#endif
 
 /**
  * check_tree_dfs: check if the tree is a red-black tree. 
@@ -427,8 +456,11 @@ int check_tree_dfs_util(tree_node *node)
  */
 bool check_tree_dfs(tree_node *root)
 {
+    if (is_leaf(root))
+        return true; // empty tree
+
     // check if root is black first
-    if (root->color != BLACK)
+    if (get_color(root) != BLACK)
     {
         dbg_printf("[ERROR] tree root with non-black color\n");
         return false;
@@ -437,12 +469,12 @@ bool check_tree_dfs(tree_node *root)
     // no need to check children's color
 
     // check value
-    if (!root->left_child->is_leaf && root->left_child->value > root->value)
+    if (!is_leaf(root->left_child) && key_less(root->key, root->left_child->key))
     {
         dbg_printf("[ERROR] left child's value is larger than root.\n");
         return false;
     }
-    if (!root->right_child->is_leaf && root->right_child->value < root->value)
+    if (!is_leaf(root->right_child) && key_less(root->right_child->key, root->key))
     {
         dbg_printf("[ERROR] right child's value is smaller than root.\n");
         return false;
@@ -458,15 +490,43 @@ bool check_tree_dfs(tree_node *root)
         return false;
     }
 
+#ifdef RB_ORDER_STATS
+    if (check_sizes(root) < 0)
+        return false;
+#endif
     return true;
 }
 
+/**
+ * count the nodes below root
+ * only valid when no operation is running
+ */
+long count_nodes(tree_node *root)
+{
+    long count = 0;
+    std::vector<tree_node *> frontier;
+    frontier.push_back(root->left_child);
+
+    while (frontier.size() > 0)
+    {
+        tree_node *cur_node = frontier.back();
+        frontier.pop_back();
+        if (is_leaf(cur_node))
+            continue;
+        count++;
+        frontier.push_back(cur_node->left_child);
+        frontier.push_back(cur_node->right_child);
+    }
+
+    return count;
+}
+
 /**
  * true if node is the root node, aka has a null parent
  */
 bool is_root(tree_node *root, tree_node *node)
 {
-    if (node->parent == root)
+    if (get_parent(node) == root)
     {
         return true;
     }
@@ -476,23 +536,6 @@ bool is_root(tree_node *root, tree_node *node)
     }
 }
 
-/**
- * create a leaf node, aka null node
- */
-tree_node* create_leaf_node(void)
-{
-    tree_node *new_node;
-    new_node = (tree_node *)malloc(sizeof(tree_node));
-    new_node->color = BLACK;
-    new_node->value = 0;
-    new_node->left_child = NULL;
-    new_node->right_child = NULL;
-    new_node->is_leaf = true;
-    new_node->flag = false;
-    new_node->marker = DEFAULT_MARKER;
-    return new_node;
-}
-
 /**
  * replace the node with its child
  * this node has at most one non-nil child
@@ -501,36 +544,41 @@ tree_node* create_leaf_node(void)
 tree_node *replace_parent(tree_node *root, tree_node *node)
 {
     tree_node *child;
-    if (node->left_child->is_leaf)
-    {
+    if (is_leaf(node->left_child))
         child = node->right_child;
-        free_node(node->left_child);
-    }
     else
-    {
         child = node->left_child;
-        free_node(node->right_child);
-    }
     
+    // the node changes too, a lookup standing on it must not go on
+    tree_node *parent = node->parent;
+    write_begin(parent);
+    write_begin(node);
+
     if (is_root(root, node))
     {
-        child->parent = root;
-        root->left_child = child;
+        set_left_child(root, child);
         node->parent = NULL;
+        child = root->left_child;
     }
     
     else if (is_left(node))
     {
-        child->parent = node->parent;
-        node->parent->left_child = child;
+        set_left_child(node->parent, child);
+        child = node->parent->left_child;
     }
 
     else
     {
-        child->parent = node->parent;
-        node->parent->right_child = child;
+        set_right_child(node->parent, child);
+        child = node->parent->right_child;
     }
 
+#ifdef RB_ORDER_STATS
+    node->size = 0; // out of the tree, see size_fix_up()
+#endif
+    write_end(node);
+    write_end(parent);
+
     dbg_printf("[Remove] unlink complete.\n");
     return child;
 }
@@ -541,7 +589,11 @@ tree_node *replace_parent(tree_node *root, tree_node *node)
  */
 bool is_left(tree_node *node)
 {
-    if (node->parent->is_leaf)
+    // a nil knows its side
+    if (is_leaf(node))
+        return ((uintptr_t)node & NIL_MASK) == NIL_LEFT;
+
+    if (node->parent == NULL)
     {
         fprintf(stderr, "[ERROR] root node has no parent.\n");
     }
@@ -562,13 +614,13 @@ bool is_left(tree_node *node)
  */
 tree_node *get_uncle(tree_node *node)
 {
-    if (node->parent->is_leaf)
+    if (node->parent == NULL)
     {
         fprintf(stderr, "[ERROR] get_uncle node should be at least layer 3.\n");
         return NULL;
     }
 
-    if (node->parent->parent->is_leaf)
+    if (node->parent->parent == NULL)
     {
         fprintf(stderr, "[ERROR] get_uncle node should be at least layer 3.\n");
         return NULL;
@@ -588,8 +640,9 @@ tree_node *get_uncle(tree_node *node)
 
 /**
  * free current node
+ * the node is only retired here, other threads may still be reading it
  */
 void free_node(tree_node *node)
 {
-    free(node);
+    retire_node(node);
 }